@@ -3,8 +3,30 @@
 
 // Compile time constants:
 // CULL_RIBBON                   - float
+// HULL_BOUNDS                   - int(bool), bound the control points of Bezier ranges
+// NORMAL_CONE_CULLING           - int(bool), cull back-facing Bezier ranges
 // BOUND_SAMPLE_RATE             - int
 // MAX_SPLIT_DEPTH               - int
+// PATCH_SIZE                    - int
+// HIZ_CULLING                   - int(bool)
+// HIZ_SIZE                      - int2
+// HIZ_LEVELS                    - int
+// HIZ_TILE_SIZE                 - int
+// SPLIT_CACHE                   - int(bool), record leaf ranges, see split_cache.cl
+// SPLIT_CACHE_LEAVES            - int
+
+
+void screen_bound(float3 pmin, float3 pmax, constant const projection* P, float2* smin, float2* smax)
+{
+    float n = max(P->near, -pmax.z);
+    float f = -pmin.z;
+
+    smin->x = pmin.x/((pmin.x < 0) ? n : f) * P->f.x + P->screen_size.x * 0.5;
+    smin->y = pmin.y/((pmin.y < 0) ? n : f) * P->f.y + P->screen_size.y * 0.5;
+
+    smax->x = pmax.x/((pmax.x > 0) ? n : f) * P->f.x + P->screen_size.x * 0.5;
+    smax->y = pmax.y/((pmax.y > 0) ? n : f) * P->f.y + P->screen_size.y * 0.5;
+}
 
 
 bool outside_frustum(float3 pmin, float3 pmax, constant const projection* P)
@@ -18,23 +40,182 @@ bool outside_frustum(float3 pmin, float3 pmax, constant const projection* P)
         return true;
     }
 
-    n = max(P->near, n);
-
-    smin.x = pmin.x/((pmin.x < 0) ? n : f) * P->f.x + P->screen_size.x * 0.5;
-    smin.y = pmin.y/((pmin.y < 0) ? n : f) * P->f.y + P->screen_size.y * 0.5;
-
-    smax.x = pmax.x/((pmax.x > 0) ? n : f) * P->f.x + P->screen_size.x * 0.5;
-    smax.y = pmax.y/((pmax.y > 0) ? n : f) * P->f.y + P->screen_size.y * 0.5;
+    screen_bound(pmin, pmax, P, &smin, &smax);
 
     return (smin.x > P->screen_size.x-1 + CULL_RIBBON || smax.x < -CULL_RIBBON ||
             smin.y > P->screen_size.y-1 + CULL_RIBBON || smax.y < -CULL_RIBBON );
 }
 
 
-// Returns 0b00000CBA
+// Tests the bounding box against the max-depth pyramid of what has been drawn
+// so far. Only boxes that lie completely inside the viewport can be occluded.
+bool occluded(const global int* depth_pyramid, float3 pmin, float3 pmax, constant const projection* P)
+{
+    float2 smin,smax;
+    screen_bound(pmin, pmax, P, &smin, &smax);
+
+    // One pixel of slack for micropolygons that straddle the bound
+    if (smin.x < 1 || smin.y < 1 ||
+        smax.x > P->screen_size.x-2 || smax.y > P->screen_size.y-2) {
+        return false;
+    }
+
+    int2 tmin = convert_int2(smin - 1) / HIZ_TILE_SIZE;
+    int2 tmax = convert_int2(smax + 1) / HIZ_TILE_SIZE;
+
+    if (tmax.x >= HIZ_SIZE.x || tmax.y >= HIZ_SIZE.y) {
+        return false;
+    }
+
+    // Pick the finest level at which the box covers at most 2x2 texels
+    int level = 0;
+    int offset = 0;
+    int2 size = HIZ_SIZE;
+
+    while (level < HIZ_LEVELS-1 &&
+           ((tmax.x >> level) - (tmin.x >> level) > 1 ||
+            (tmax.y >> level) - (tmin.y >> level) > 1)) {
+        offset += size.x * size.y;
+        size = (size + 1) / 2;
+        ++level;
+    }
+
+    tmin = tmin >> level;
+    tmax = tmax >> level;
+
+    int max_depth = 0;
+    for (int y = tmin.y; y <= tmax.y; ++y) {
+        for (int x = tmin.x; x <= tmax.x; ++x) {
+            max_depth = max(max_depth, depth_pyramid[offset + x + y * size.x]);
+        }
+    }
+
+    // Nearest depth of the box, mapped like the depth buffer does in sample
+    float4 p = mul_cm4v4(&P->proj, (float4)(0, 0, min(pmax.z, -P->near), 1));
+    int near_depth = (int)(clamp(p.z / p.w / 200.0f, 0.0f, 1.0f) * 0x7fffffff);
+
+    return near_depth > max_depth;
+}
+
+
+// Replaces the control points p[0], p[stride], ... of a cubic with those of
+// its part between t0 and t1, using de Casteljau subdivision at t1 and t0/t1
+void restrict_spline(float3* p, int stride, float t0, float t1)
+{
+    float3 p0 = p[0], p1 = p[stride], p2 = p[2*stride], p3 = p[3*stride];
+
+    float3 p10 = mix(p0, p1, t1);
+    float3 p11 = mix(p1, p2, t1);
+    float3 p12 = mix(p2, p3, t1);
+    float3 p20 = mix(p10, p11, t1);
+    float3 p21 = mix(p11, p12, t1);
+
+    p3 = mix(p20, p21, t1);
+    p2 = p20;
+    p1 = p10;
+
+    float t = t0 / t1;
+
+    p10 = mix(p0, p1, t);
+    p11 = mix(p1, p2, t);
+    p12 = mix(p2, p3, t);
+    p20 = mix(p10, p11, t);
+    p21 = mix(p11, p12, t);
+
+    p[0]        = mix(p20, p21, t);
+    p[stride]   = p21;
+    p[2*stride] = p12;
+    p[3*stride] = p3;
+}
+
+
+// Eye space control points of the part of a Bezier patch in [rmin,rmax]
+void range_control_points(const global float4* patch_buffer, int pid, float2 rmin, float2 rmax,
+                          const matrix4* mv, float3 cp[16])
+{
+    for (int i = 0; i < 16; ++i) {
+        cp[i] = mul_pm4v4(mv, (float4)(patch_buffer[pid * 16 + i].xyz, 1)).xyz;
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        restrict_spline(cp + i*4, 1, rmin.y, rmax.y);
+    }
+
+    for (int j = 0; j < 4; ++j) {
+        restrict_spline(cp + j, 4, rmin.x, rmax.x);
+    }
+}
+
+
+// Eye space version of calc_normal_cone() and is_backfacing() in Patch.cpp.
+// True if n.p < 0 for every normal n and point p of the range, which are
+// the micropolygons is_front_facing() in shade rejects.
+bool range_backfacing(const float3* cp)
+{
+    float3 sum = (float3)(0);
+    float3 bmin = cp[0], bmax = cp[0];
+
+    for (int i = 1; i < 16; ++i) {
+        bmin = min(bmin, cp[i]);
+        bmax = max(bmax, cp[i]);
+    }
+
+    for (int k = 0; k < 12; ++k) {
+        float3 du = cp[(k/4+1)*4 + k%4] - cp[(k/4)*4 + k%4];
+        for (int l = 0; l < 12; ++l) {
+            float3 n = cross(du, cp[(l/3)*4 + l%3 + 1] - cp[(l/3)*4 + l%3]);
+            float len = length(n);
+            if (len > 0) sum += n / len;
+        }
+    }
+
+    float sum_len = length(sum);
+    if (sum_len < 1e-6f) return false;
+
+    float3 axis = sum / sum_len;
+
+    float min_cos = 1;
+    for (int k = 0; k < 12; ++k) {
+        float3 du = cp[(k/4+1)*4 + k%4] - cp[(k/4)*4 + k%4];
+        for (int l = 0; l < 12; ++l) {
+            float3 n = cross(du, cp[(l/3)*4 + l%3 + 1] - cp[(l/3)*4 + l%3]);
+            float len = length(n);
+            if (len > 0) min_cos = min(min_cos, dot(axis, n) / len);
+        }
+    }
+
+    float angle = acos(clamp(min_cos, -1.0f, 1.0f));
+
+    float3 center = (bmin + bmax) * 0.5f;
+    float radius = length(bmax - bmin) * 0.5f;
+    float dist = length(center);
+
+    if (dist <= radius || angle >= M_PI_F * 0.5f) return false;
+
+    float b = acos(clamp(dot(axis, center) / dist, -1.0f, 1.0f));
+
+    return b - angle - asin(radius / dist) > M_PI_F * 0.5f;
+}
+
+
+// Smallest power of two dicing rate that keeps the micropolygons as small
+// as those of a range at the split limit diced with PATCH_SIZE
+uchar dice_level(float hlen, float vlen, float split_limit)
+{
+    float rate = max(hlen, vlen) / split_limit * PATCH_SIZE;
+
+    return min((int)ceil(log2(max(rate, 1.0f))), 15);
+}
+
+
+// Returns 0b0DDDDCBA
 // A ... draw
 // B ... split
 // C ... split direction, 0=horizontal 1=vertical
+// D ... log2 of the dicing rate of drawn ranges
+//
+// rpid counts the patches of all instances of the mesh, instance after
+// instance.
 #define RES BOUND_SAMPLE_RATE
 #define CULL 0
 #define DRAW 1
@@ -42,8 +223,13 @@ bool outside_frustum(float3 pmin, float3 pmax, constant const projection* P)
 #define VSPLIT 6
 uchar bound(const global float4* patch_buffer,
            int rpid, float2 rmin, float2 rmax, uchar rdepth,
-           private const matrix4* mv, constant const projection* P, float split_limit)
+           const global matrix4* instances, int instance_patch_count, constant const projection* P,
+           const global int* depth_pyramid, float split_limit)
 {   
+    matrix4 mv = instances[rpid / instance_patch_count];
+    int pid = rpid % instance_patch_count;
+
+
     // Calculate bounding box and max u/v length of patch 
     float2 ppos[RES][RES];
     
@@ -55,13 +241,27 @@ uchar bound(const global float4* patch_buffer,
     }
 
     float eps = P->near * 0.1;
-    
+
+    float3 cp[16];
+    if (HULL_BOUNDS || NORMAL_CONE_CULLING) {
+        range_control_points(patch_buffer, pid, rmin, rmax, &mv, cp);
+    }
+
+#if HULL_BOUNDS
+    // The surface lies in the convex hull of its control points, so the
+    // bound is conservative and a single subdivision replaces RES*RES
+    // patch evaluations
+    for (int i = 0; i < 16; ++i) {
+        bbox_min = min(bbox_min, cp[i]);
+        bbox_max = max(bbox_max, cp[i]);
+    }
+#else
     for (size_t u = 0; u < RES; ++u) {
         for (size_t v = 0; v < RES; ++v) {
             float2 uv = mix(rmin, rmax, (float2)(u * (1.0f / (RES-1)), v * (1.0f / (RES-1))));
 
-            float4 p = eval_patch(patch_buffer, rpid, uv);
-            p = mul_pm4v4(mv, p);
+            float4 p = eval_patch(patch_buffer, pid, uv);
+            p = mul_pm4v4(&mv, p);
 
             bbox_min = min(bbox_min, p.xyz);
             bbox_max = max(bbox_max, p.xyz);
@@ -70,14 +270,38 @@ uchar bound(const global float4* patch_buffer,
             ppos[v][u] = mul_cm2v2(&P->screen_matrix, p.xy / p.w);            
         }
     }
+#endif
 
     if (outside_frustum(bbox_min, bbox_max, P)) {
         return CULL;
+    } else if (NORMAL_CONE_CULLING && range_backfacing(cp)) {
+        return CULL;
     } else if (bbox_min.z < eps && bbox_max.z > P->near) {
         return (((rmax.x - rmin.x) < (rmax.y - rmin.y)) ? VSPLIT : HSPLIT);
+    } else if (HIZ_CULLING && occluded(depth_pyramid, bbox_min, bbox_max, P)) {
+        return CULL;
     } else {
 
         float hlen=0, vlen=0;
+#if HULL_BOUNDS
+        // Control polygons are at least as long as the curves they define
+        float2 cpos[16];
+        for (int i = 0; i < 16; ++i) {
+            float4 p = mul_cm4v4(&P->proj, (float4)(cp[i], 1));
+            cpos[i] = mul_cm2v2(&P->screen_matrix, p.xy / p.w);
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            float h = 0, v = 0;
+            for (int j = 0; j < 3; ++j) {
+                h += distance(cpos[j*4 + i], cpos[(j+1)*4 + i]);
+                v += distance(cpos[i*4 + j], cpos[i*4 + j+1]);
+            }
+
+            hlen = max(h, hlen);
+            vlen = max(v, vlen);
+        }
+#else
         for (size_t i = 0; i < RES; ++i) {
             float h = 0, v = 0;
             for (size_t j = 0; j < RES-1; ++j) {
@@ -88,9 +312,10 @@ uchar bound(const global float4* patch_buffer,
             hlen = max(h, hlen);
             vlen = max(v, vlen);
         }
+#endif
 
         if (hlen <= split_limit && vlen <= split_limit) {
-            return DRAW;
+            return DRAW | (dice_level(hlen, vlen, split_limit) << 3);
         } else {
             return ((hlen > vlen) ? VSPLIT : HSPLIT);
         }
@@ -100,6 +325,30 @@ uchar bound(const global float4* patch_buffer,
 }
 
 
+// Stores a range that bound() did not split for the next frame, see
+// split_cache.cl. Drawn ranges whose parent is diced at a rate up to
+// PATCH_SIZE and culled ranges may be merged, ranges at the split limit
+// may not. Lists that run out of slots count on and are dropped.
+void record_split_leaf(volatile global int* leaf_counts, global float4* leaf_ranges, global uchar* leaf_depths,
+                       int rpid, float2 rmin, float2 rmax, uchar rdepth, uchar bound_flags)
+{
+#if SPLIT_CACHE
+    bool mergeable = (bound_flags & DRAW)
+        ? (1 << (bound_flags >> 3)) < PATCH_SIZE
+        : rdepth < MAX_SPLIT_DEPTH-1;
+
+    int slot = atomic_inc(leaf_counts + rpid);
+
+    if (slot < SPLIT_CACHE_LEAVES) {
+        size_t pos = (size_t)rpid * SPLIT_CACHE_LEAVES + slot;
+
+        leaf_ranges[pos] = (float4)(rmin, rmax);
+        leaf_depths[pos] = rdepth | (mergeable ? 0x80 : 0);
+    }
+#endif
+}
+
+
 kernel __attribute__((reqd_work_group_size(1,1,1)))
 void init_projection_buffer(global projection* P,
                        
@@ -15,8 +15,14 @@ kernel void bound_kernel(const global float4* patch_buffer,
                          global int* split_flags,
                          global int* draw_flags,
                          
-                         matrix4 modelview,
+                         volatile global int* leaf_counts,
+                         global float4* leaf_ranges,
+                         global uchar* leaf_depths,
+
+                         const global matrix4* instances,
+                         int instance_patch_count,
                          constant const projection* proj,
+                         const global int* depth_pyramid,
                          float split_limit)
 {
     int lid = get_global_id(0);
@@ -31,10 +37,15 @@ kernel void bound_kernel(const global float4* patch_buffer,
     
     uchar flags = bound(patch_buffer,
                         rpid, rmin, rmax, rdepth,
-                        &modelview, proj, split_limit);
+                        instances, instance_patch_count, proj, depth_pyramid, split_limit);
 
     bound_flags[lid] = flags;
 
+    if ((flags & 2) == 0) {
+        // Drawn or culled
+        record_split_leaf(leaf_counts, leaf_ranges, leaf_depths, rpid, rmin, rmax, rdepth, flags);
+    }
+
     draw_flags[lid]  = (flags>>0)&1;
     split_flags[lid] = (flags>>1)&1;
 
@@ -79,7 +90,7 @@ kernel void move(int patch_count,
 
         int pos = draw_sum[lid] - 1;
 
-        out_pids[pos] = rpid;
+        out_pids[pos] = pack_range_pid(rpid, bound_flag >> 3);
         out_mins[pos] = rmin;
         out_maxs[pos] = rmax;
         
@@ -116,6 +127,12 @@ kernel void move(int patch_count,
 
 
 kernel void init_ranges(int patch_count,
+                        const global int* seed_pids,
+                        int use_seed_pids,
+                        const global uchar* seed_depths,
+                        const global float2* seed_mins,
+                        const global float2* seed_maxs,
+                        int use_seed_ranges,
                  
                  global int* pid_stack,
                  global uchar* depth_stack,
@@ -124,12 +141,14 @@ kernel void init_ranges(int patch_count,
 {
     int gid = get_global_id(0);
 
-    if (gid > patch_count) return;
+    if (gid >= patch_count) return;
+
+    pid_stack[gid] = use_seed_pids ? seed_pids[gid] : gid;
 
-    pid_stack[gid] = gid;
-    depth_stack[gid] = 0;
-    min_stack[gid] = (float2)(0,0);
-    max_stack[gid] = (float2)(1,1);
+    // Leaf ranges of the previous frame, see split_cache.cl
+    depth_stack[gid] = use_seed_ranges ? seed_depths[gid] : 0;
+    min_stack[gid] = use_seed_ranges ? seed_mins[gid] : (float2)(0,0);
+    max_stack[gid] = use_seed_ranges ? seed_maxs[gid] : (float2)(1,1);
     
 }
                  
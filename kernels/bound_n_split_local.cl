@@ -10,6 +10,21 @@
 // BOUND_SAMPLE_RATE             - int 
 // CULL_RIBBON                   - float
 // MAX_SPLIT_DEPTH               - int
+// WORK_STEALING                 - bool
+
+
+// Spinlocks guarding the per-work-group range queues when work stealing is
+// enabled. A value of 1 means the queue is unlocked.
+void lock_range_queue(volatile global int* queue_locks, int queue)
+{
+    while (!atomic_xchg(queue_locks + queue, 0));
+}
+
+void unlock_range_queue(volatile global int* queue_locks, int queue)
+{
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    atomic_xchg(queue_locks + queue, 1);
+}
 
 
 kernel __attribute__((reqd_work_group_size(BOUND_N_SPLIT_WORK_GROUP_SIZE, 1, 1)))
@@ -28,8 +43,17 @@ void bound_n_split(const global float4* patch_buffer,
 
                    volatile global int* processed_count,
 
-                   matrix4 modelview,
+                   volatile global int* queue_locks,
+                   volatile global int* idle_cnt,
+
+                   volatile global int* leaf_counts,
+                   global float4* leaf_ranges,
+                   global uchar* leaf_depths,
+
+                   const global matrix4* instances,
+                   int instance_patch_count,
                    constant const projection* proj,
+                   const global int* depth_pyramid,
                    float split_limit)
 {
     const size_t lid = get_local_id(0);
@@ -57,6 +81,12 @@ void bound_n_split(const global float4* patch_buffer,
     // Number of items to be copied from stack
     local int stack_cnt;
 
+    // Queue the input items are read from and whether its lock is held
+    local int src, stolen;
+
+    // Whether ranges are donated to the input queue this iteration
+    local int donate;
+
     if (lid == 0) {
         stack_height = 0;
         stack_cnt = 0;
@@ -71,10 +101,21 @@ void bound_n_split(const global float4* patch_buffer,
     while (1) {
         // Load range elements (source from stack first and fall back to input buffer if necessary)
         if (lid == 0) {
+            src = wid;
+            stolen = 0;
+            
             if (stack_height < BOUND_N_SPLIT_WORK_GROUP_SIZE) {
                 cnt = min(BOUND_N_SPLIT_WORK_GROUP_SIZE - stack_height, BOUND_N_SPLIT_WORK_GROUP_SIZE);
-                
-                top = atomic_sub(in_range_cnt + wid, cnt);
+
+                if (WORK_STEALING) {
+                    // Other work groups may steal from this queue
+                    lock_range_queue(queue_locks, wid);
+                    top = in_range_cnt[wid];
+                    in_range_cnt[wid] = top - min(cnt, max(0, top));
+                    unlock_range_queue(queue_locks, wid);
+                } else {
+                    top = atomic_sub(in_range_cnt + wid, cnt);
+                }
 
                 cnt = min(cnt, max(0, top));
                 start = top - cnt;
@@ -88,6 +129,41 @@ void bound_n_split(const global float4* patch_buffer,
                 stack_cnt = min(stack_height, BOUND_N_SPLIT_WORK_GROUP_SIZE);
                 stack_height -= stack_cnt;
             }
+
+            if (WORK_STEALING && cnt == 0 && stack_cnt == 0) {
+                // Own queue and stack are exhausted, steal half of another
+                // work group's queue. Only busy work groups add ranges to the
+                // queues, so idle ones keep looking until all work groups
+                // are idle, or until the output buffer is full and the
+                // queued ranges are left for the next launch. The victim's
+                // lock is held until the stolen ranges have been read.
+                atomic_inc(idle_cnt);
+
+                while (!stolen
+                       && atomic_add(idle_cnt, 0) < BOUND_N_SPLIT_WORK_GROUP_CNT
+                       && atomic_add(out_range_cnt, 0) < (int)BATCH_SIZE) {
+                    for (int i = 1; i < BOUND_N_SPLIT_WORK_GROUP_CNT && !stolen; ++i) {
+                        int victim = (wid + i) % BOUND_N_SPLIT_WORK_GROUP_CNT;
+
+                        if (in_range_cnt[victim] <= 0) continue;
+
+                        lock_range_queue(queue_locks, victim);
+                        top = max(0, in_range_cnt[victim]);
+                        cnt = min(BOUND_N_SPLIT_WORK_GROUP_SIZE, (top + 1) / 2);
+
+                        if (cnt > 0) {
+                            // Busy again before the ranges leave the queue
+                            atomic_dec(idle_cnt);
+                            in_range_cnt[victim] = top - cnt;
+                            start = top - cnt;
+                            src = victim;
+                            stolen = 1;
+                        } else {
+                            unlock_range_queue(queue_locks, victim);
+                        }
+                    }
+                }
+            }
             
             processed_count[wid] += cnt + stack_cnt;
         }
@@ -99,7 +175,7 @@ void bound_n_split(const global float4* patch_buffer,
         }
 
         if (lid < cnt) {
-            size_t pos = wid * in_buffer_stride + start + lid;
+            size_t pos = src * in_buffer_stride + start + lid;
             // in_pids packs the depth into the 8 most significant bits
 
             uint x = in_pids[pos];
@@ -119,11 +195,19 @@ void bound_n_split(const global float4* patch_buffer,
             occupied = 0;
         }
 
+        if (WORK_STEALING) {
+            barrier(CLK_GLOBAL_MEM_FENCE);
+
+            if (lid == 0 && stolen) {
+                unlock_range_queue(queue_locks, src);
+            }
+        }
+
         char bound_flags = 0;
 
         if (occupied) {
             bound_flags = bound(patch_buffer, rpid, rmin, rmax, rdepth,
-                                &modelview, proj, split_limit);
+                                instances, instance_patch_count, proj, depth_pyramid, split_limit);
         }
 
         // Perform split
@@ -179,6 +263,9 @@ void bound_n_split(const global float4* patch_buffer,
             start = atomic_add(out_range_cnt, cnt);
 
             if (cnt + start >= BATCH_SIZE) {
+                if (WORK_STEALING) {
+                    lock_range_queue(queue_locks, wid);
+                }
                 offset = max(0,in_range_cnt[wid]);
                 in_range_cnt[wid] = offset + stack_height + cnt - max(0,(int)BATCH_SIZE - start);
             }
@@ -190,9 +277,14 @@ void bound_n_split(const global float4* patch_buffer,
         sum--;
         
         if ((bound_flags & 1) != 0 && start + sum < BATCH_SIZE) {
-            out_pids[start + sum] = rpid;
+            out_pids[start + sum] = pack_range_pid(rpid, bound_flags >> 3);
             out_mins[start + sum] = rmin;
             out_maxs[start + sum] = rmax;
+
+            record_split_leaf(leaf_counts, leaf_ranges, leaf_depths, rpid, rmin, rmax, rdepth, bound_flags);
+        } else if (occupied && (bound_flags & 3) == 0) {
+            // Culled
+            record_split_leaf(leaf_counts, leaf_ranges, leaf_depths, rpid, rmin, rmax, rdepth, bound_flags);
         }
 
         if (cnt + start >= BATCH_SIZE) {
@@ -231,12 +323,77 @@ void bound_n_split(const global float4* patch_buffer,
                 in_maxs[pos] = rmax;                
             }
 
+            if (WORK_STEALING) {
+                barrier(CLK_GLOBAL_MEM_FENCE);
+
+                if (lid == 0) {
+                    unlock_range_queue(queue_locks, wid);
+                }
+            }
+
             return;
         }
         
 
         barrier(CLK_LOCAL_MEM_FENCE);
-        
+
+        if (WORK_STEALING) {
+            // Donate the bottom of the stack (the largest ranges) to the
+            // input queue while other work groups are idle, so they can
+            // steal it.
+            if (lid == 0) {
+                donate = stack_height >= 2 * BOUND_N_SPLIT_WORK_GROUP_SIZE
+                    && *idle_cnt > 0 && in_range_cnt[wid] <= 0;
+
+                if (donate) {
+                    lock_range_queue(queue_locks, wid);
+                    offset = max(0, in_range_cnt[wid]);
+                }
+            }
+
+            barrier(CLK_LOCAL_MEM_FENCE);
+
+            if (donate) {
+                size_t pos = lid + offset + wid * in_buffer_stride;
+
+                // pack stack depth back into pid value
+                uint x = pid_stack[lid] | (depth_stack[lid]<<24);
+                in_pids[pos] = x;
+                in_mins[pos] = min_stack[lid];
+                in_maxs[pos] = max_stack[lid];
+
+                // Move the remaining stack down
+                for (int wi = 0; wi + BOUND_N_SPLIT_WORK_GROUP_SIZE < stack_height; wi += BOUND_N_SPLIT_WORK_GROUP_SIZE) {
+                    int from = wi + BOUND_N_SPLIT_WORK_GROUP_SIZE + lid;
+                    
+                    if (from < stack_height) {
+                        rpid   = pid_stack[from];
+                        rdepth = depth_stack[from];
+                        rmin   = min_stack[from];
+                        rmax   = max_stack[from];
+                    }
+
+                    barrier(CLK_LOCAL_MEM_FENCE);
+
+                    if (from < stack_height) {
+                        pid_stack[wi + lid]   = rpid;
+                        depth_stack[wi + lid] = rdepth;
+                        min_stack[wi + lid]   = rmin;
+                        max_stack[wi + lid]   = rmax;
+                    }
+                }
+
+                barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+                if (lid == 0) {
+                    in_range_cnt[wid] = offset + BOUND_N_SPLIT_WORK_GROUP_SIZE;
+                    stack_height -= BOUND_N_SPLIT_WORK_GROUP_SIZE;
+                    unlock_range_queue(queue_locks, wid);
+                }
+
+                barrier(CLK_LOCAL_MEM_FENCE);
+            }
+        }
     }
     
 }
@@ -247,6 +404,12 @@ kernel __attribute__((reqd_work_group_size(BOUND_N_SPLIT_WORK_GROUP_SIZE, 1,1)))
 void init_range_buffers(global uint* pids,
                         global float2* mins,
                         global float2* maxs,
+                        const global int* seed_pids,
+                        int use_seed_pids,
+                        const global uchar* seed_depths,
+                        const global float2* seed_mins,
+                        const global float2* seed_maxs,
+                        int use_seed_ranges,
                         int patch_count,
                         int buffer_stride)
 {
@@ -258,9 +421,16 @@ void init_range_buffers(global uint* pids,
     
     if (gid < patch_count) {
         size_t pos = lid + wid * buffer_stride;
-        pids[pos] = gid;
+        pids[pos] = use_seed_pids ? seed_pids[gid] : gid;
         mins[pos] = (float2)(0,0);
         maxs[pos] = (float2)(1,1);
+
+        // Leaf ranges of the previous frame, see split_cache.cl
+        if (use_seed_ranges) {
+            pids[pos] |= (seed_depths[gid] & 0x7f) << 24;
+            mins[pos] = seed_mins[gid];
+            maxs[pos] = seed_maxs[gid];
+        }
     }
 }
 
@@ -270,6 +440,9 @@ void init_count_buffers(global int* in_range_cnt,
                         global int* out_range_cnt,
 
                         volatile global int* processed_count,
+
+                        global int* queue_locks,
+                        global int* idle_cnt,
                         
                         int patch_count)
 {
@@ -278,6 +451,11 @@ void init_count_buffers(global int* in_range_cnt,
 
     in_range_cnt[lid] = (patch_count+ilid)/BOUND_N_SPLIT_WORK_GROUP_CNT;
     processed_count[lid] = 0;
+    queue_locks[lid] = 1;
+
+    if (lid == 0) {
+        *idle_cnt = 0;
+    }
 }
                        
  
@@ -1,7 +1,11 @@
 
 #include "utility.h"
 #include "bound_n_split.h"
+#include "compaction.h"
 
+// Bounds the top batch_size ranges of the stack. Drawn ranges are
+// compacted into the out buffers, the two halves of split ranges into the
+// pads, from where push_split_ranges moves them back onto the stack.
 kernel void bound_kernel(const global float4* patch_buffer,
                          int batch_size,
                          int batch_offset,
@@ -11,123 +15,127 @@ kernel void bound_kernel(const global float4* patch_buffer,
                          global const float2* min_stack,
                          global const float2* max_stack,
 
-                         global uchar* bound_flags,
-                         global int* split_flags,
-                         global int* draw_flags,
-                         
                          global int* pid_pad,
                          global uchar* depth_pad,
                          global float2* min_pad,
                          global float2* max_pad,
+                         global int* split_count,
+
+                         global int* out_pids,
+                         global float2* out_mins,
+                         global float2* out_maxs,
+                         global int* draw_count,
                          
-                         matrix4 modelview,
+                         volatile global int* leaf_counts,
+                         global float4* leaf_ranges,
+                         global uchar* leaf_depths,
+
+                         const global matrix4* instances,
+                         int instance_patch_count,
                          constant const projection* proj,
+                         const global int* depth_pyramid,
                          float split_limit)
 {
+    local int group_count;
+    local int group_base;
+
     int lid = get_global_id(0);
     int gid = lid + batch_offset;
 
-    if (lid >= batch_size) return;
-
-    int rpid = pid_stack[gid];
-    uchar rdepth = depth_stack[gid];
-    float2 rmax = max_stack[gid];
-    float2 rmin = min_stack[gid];
-    
-    uchar flags = bound(patch_buffer,
-                        rpid, rmin, rmax, rdepth,
-                        &modelview, proj, split_limit);
-
-    bound_flags[lid] = flags;
-
-    draw_flags[lid]  = (flags>>0)&1;
-    split_flags[lid] = (flags>>1)&1;
-
-    pid_pad[lid] = rpid;
-    depth_pad[lid] = rdepth;
-    min_pad[lid] = rmin;
-    max_pad[lid] = rmax;
-
-}
+    // All work items take part in the compaction
+    bool active = lid < batch_size;
 
+    int rpid = 0;
+    uchar rdepth = 0;
+    float2 rmin = 0, rmax = 0;
+    uchar flags = 0;
 
-
-kernel void move(int batch_size,
-                 int batch_offset,
-
-                 global const int* pid_pad,
-                 global const uchar* depth_pad,
-                 global const float2* min_pad,
-                 global const float2* max_pad,
-
-                 
-                 global const uchar* bound_flags,
-                 global const int* draw_sum,
-                 global const int* split_sum,
-                 
-                 global int* pid_stack,
-                 global uchar* depth_stack,
-                 global float2* min_stack,
-                 global float2* max_stack,
-                 
-                 global int* out_pids,
-                 global float2* out_mins,
-                 global float2* out_maxs)
-{
-    int lid = get_global_id(0);
-
-    if (lid >= batch_size) return;
+    if (active) {
+        rpid = pid_stack[gid];
+        rdepth = depth_stack[gid];
+        rmax = max_stack[gid];
+        rmin = min_stack[gid];
     
-    uchar bound_flag = bound_flags[lid];
+        flags = bound(patch_buffer,
+                      rpid, rmin, rmax, rdepth,
+                      instances, instance_patch_count, proj, depth_pyramid, split_limit);
+    }
 
-    int rpid     = pid_pad[lid];
-    uchar rdepth = depth_pad[lid];
-    float2 rmin  = min_pad[lid];
-    float2 rmax  = max_pad[lid];
-    
-    if ((bound_flag>>0)&1) {
-        // DRAW
-        // Move range to output buffer
+    int draw_pos = compact_slot((flags>>0)&1, draw_count, &group_count, &group_base);
+    int split_pos = compact_slot((flags>>1)&1, split_count, &group_count, &group_base);
 
-        int pos = draw_sum[lid] - 1;
+    if (active && (flags & 2) == 0) {
+        // Drawn or culled
+        record_split_leaf(leaf_counts, leaf_ranges, leaf_depths, rpid, rmin, rmax, rdepth, flags);
+    }
 
-        out_pids[pos] = rpid;
-        out_mins[pos] = rmin;
-        out_maxs[pos] = rmax;
-        
-    } else if ((bound_flag>>1)&1) {
+    if (draw_pos >= 0) {
+        // DRAW
+        out_pids[draw_pos] = pack_range_pid(rpid, flags >> 3);
+        out_mins[draw_pos] = rmin;
+        out_maxs[draw_pos] = rmax;
+    } else if (split_pos >= 0) {
         // SPLIT
-        // Move patches back on stack
-
-        int pos0 = batch_offset + (split_sum[lid] - 1) * 2 + 0;
+        int pos0 = split_pos * 2 + 0;
         int pos1 = pos0 + 1;
         
-        pid_stack[pos0] = rpid;
-        pid_stack[pos1] = rpid;
+        pid_pad[pos0] = rpid;
+        pid_pad[pos1] = rpid;
 
-        depth_stack[pos0] = rdepth+1;
-        depth_stack[pos1] = rdepth+1;
+        depth_pad[pos0] = rdepth+1;
+        depth_pad[pos1] = rdepth+1;
 
         float2 c = (rmin+rmax)*0.5f;
         
-        min_stack[pos0] = rmin;
-        max_stack[pos1] = rmax;
+        min_pad[pos0] = rmin;
+        max_pad[pos1] = rmax;
         
         // Check split direction
-        if (bound_flag & 4) {
+        if (flags & 4) {
             // Vertical split
-            max_stack[pos0] = (float2)(c.x, rmax.y);
-            min_stack[pos1] = (float2)(c.x, rmin.y);
+            max_pad[pos0] = (float2)(c.x, rmax.y);
+            min_pad[pos1] = (float2)(c.x, rmin.y);
         } else {
-            // Vertical split
-            max_stack[pos0] = (float2)(rmax.x, c.y);
-            min_stack[pos1] = (float2)(rmin.x, c.y);
+            // Horizontal split
+            max_pad[pos0] = (float2)(rmax.x, c.y);
+            min_pad[pos1] = (float2)(rmin.x, c.y);
         }
     }
 }
 
 
+kernel void push_split_ranges(int batch_offset,
+                              global const int* split_count,
+
+                              global const int* pid_pad,
+                              global const uchar* depth_pad,
+                              global const float2* min_pad,
+                              global const float2* max_pad,
+                 
+                              global int* pid_stack,
+                              global uchar* depth_stack,
+                              global float2* min_stack,
+                              global float2* max_stack)
+{
+    int lid = get_global_id(0);
+    int gid = lid + batch_offset;
+
+    if (lid >= *split_count * 2) return;
+
+    pid_stack[gid] = pid_pad[lid];
+    depth_stack[gid] = depth_pad[lid];
+    min_stack[gid] = min_pad[lid];
+    max_stack[gid] = max_pad[lid];
+}
+
+
 kernel void init_ranges(int patch_count,
+                        const global int* seed_pids,
+                        int use_seed_pids,
+                        const global uchar* seed_depths,
+                        const global float2* seed_mins,
+                        const global float2* seed_maxs,
+                        int use_seed_ranges,
                  
                  global int* pid_stack,
                  global uchar* depth_stack,
@@ -136,12 +144,14 @@ kernel void init_ranges(int patch_count,
 {
     int gid = get_global_id(0);
 
-    if (gid > patch_count) return;
+    if (gid >= patch_count) return;
+
+    pid_stack[gid] = use_seed_pids ? seed_pids[gid] : gid;
 
-    pid_stack[gid] = gid;
-    depth_stack[gid] = 0;
-    min_stack[gid] = (float2)(0,0);
-    max_stack[gid] = (float2)(1,1);
+    // Leaf ranges of the previous frame, see split_cache.cl
+    depth_stack[gid] = use_seed_ranges ? seed_depths[gid] : 0;
+    min_stack[gid] = use_seed_ranges ? seed_mins[gid] : (float2)(0,0);
+    max_stack[gid] = use_seed_ranges ? seed_maxs[gid] : (float2)(1,1);
     
 }
                  
@@ -0,0 +1,39 @@
+// Stream compaction of flagged work items into an unordered output stream.
+//
+// Compile time constants:
+// WORK_GROUP_COLLECTIVES - int(bool), use OpenCL C 2.0 work-group functions
+
+// Returns the output slot of the calling work item, or -1 if its flag is
+// not set. Every work item of the (one dimensional) work-group has to call
+// this. Slots are reserved with one atomic per work-group on stream_size,
+// so the order of the output between work-groups is undefined.
+int compact_slot(int flag, global int* stream_size, local int* group_count, local int* group_base)
+{
+#if WORK_GROUP_COLLECTIVES
+    int offset = work_group_scan_exclusive_add(flag);
+    int count  = work_group_reduce_add(flag);
+
+    int base = 0;
+    if (get_local_id(0) == 0 && count > 0) {
+        base = atomic_add(stream_size, count);
+    }
+    base = work_group_broadcast(base, 0);
+
+    return flag ? base + offset : -1;
+#else
+    if (get_local_id(0) == 0) {
+        *group_count = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int offset = flag ? atomic_inc(group_count) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (get_local_id(0) == 0) {
+        *group_base = (*group_count > 0) ? atomic_add(stream_size, *group_count) : 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return flag ? *group_base + offset : -1;
+#endif
+}
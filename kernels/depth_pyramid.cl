@@ -0,0 +1,98 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#include "utility.h"
+
+// Compile time constants:
+// TILE_SIZE             - int
+// GRID_SIZE             - int2
+// FRAMEBUFFER_SIZE      - int2
+// HIZ_TILE_SIZE         - int
+
+int calc_framebuffer_pos(int2 pxlpos)
+{
+    int2 gridpos = pxlpos / TILE_SIZE;
+    int  grid_id = gridpos.x + GRID_SIZE.x * gridpos.y;
+    int2 loclpos = pxlpos - gridpos * TILE_SIZE;
+    int  locl_id = loclpos.x + TILE_SIZE * loclpos.y;
+
+    return grid_id * TILE_SIZE * TILE_SIZE + locl_id;
+}
+
+
+kernel void build_base(const global int* depth_buffer,
+                       global int* pyramid,
+                       int2 size)
+{
+    int2 texel = (int2)(get_global_id(0), get_global_id(1));
+
+    if (texel.x >= size.x || texel.y >= size.y) return;
+
+    int max_depth = 0;
+
+    for (int y = 0; y < HIZ_TILE_SIZE; ++y) {
+        for (int x = 0; x < HIZ_TILE_SIZE; ++x) {
+            int2 p = texel * HIZ_TILE_SIZE + (int2)(x, y);
+
+            if (p.x < FRAMEBUFFER_SIZE.x && p.y < FRAMEBUFFER_SIZE.y) {
+                max_depth = max(max_depth, depth_buffer[calc_framebuffer_pos(p)]);
+            }
+        }
+    }
+
+    pyramid[texel.x + texel.y * size.x] = max_depth;
+}
+
+
+// Base level from the per tile depth ranges of a tiled depth buffer, its
+// tiles are HIZ_TILE_SIZE pixels wide, so this is one read per texel.
+kernel void build_base_from_tiles(const global int4* depth_tiles,
+                                  global int* pyramid,
+                                  int2 size)
+{
+    int2 texel = (int2)(get_global_id(0), get_global_id(1));
+
+    if (texel.x >= size.x || texel.y >= size.y) return;
+
+    int4 tile = depth_tiles[texel.x + texel.y * size.x];
+
+    pyramid[texel.x + texel.y * size.x] = tile.x ? 0x7fffffff : tile.z;
+}
+
+
+kernel void reduce(global int* pyramid,
+                   int src_offset, int2 src_size,
+                   int dst_offset, int2 dst_size)
+{
+    int2 texel = (int2)(get_global_id(0), get_global_id(1));
+
+    if (texel.x >= dst_size.x || texel.y >= dst_size.y) return;
+
+    int max_depth = 0;
+
+    for (int y = 0; y < 2; ++y) {
+        for (int x = 0; x < 2; ++x) {
+            int2 s = texel * 2 + (int2)(x, y);
+
+            if (s.x < src_size.x && s.y < src_size.y) {
+                max_depth = max(max_depth, pyramid[src_offset + s.x + s.y * src_size.x]);
+            }
+        }
+    }
+
+    pyramid[dst_offset + texel.x + texel.y * dst_size.x] = max_depth;
+}
@@ -9,6 +9,8 @@
 // VIEWPORT_SIZE_PIXEL   - int2
 // MAX_BLOCK_ASSIGNMENTS - int
 // DISPLACEMENT          - int(bool)
+// ADAPTIVE_DICING       - int(bool)
+// DIAGSPLIT             - int(bool), snap edge vertices to the ranges' edge lattices
 
 #define BLOCKS_PER_LINE (PATCH_SIZE/8)
 #define BLOCKS_PER_PATCH (BLOCKS_PER_LINE*BLOCKS_PER_LINE)
@@ -18,9 +20,25 @@
 #define VIEWPORT_SIZE (VIEWPORT_SIZE_PIXEL << PXLCOORD_SHIFT)
 
 
-size_t calc_grid_pos(size_t nu, size_t nv, size_t patch)
+// Grids of ranges diced with less than PATCH_SIZE are packed at the
+// start of their slot
+size_t calc_grid_pos(size_t nu, size_t nv, size_t patch, int rate)
 {
-    return nu + nv * (PATCH_SIZE+1) + patch * (PATCH_SIZE+1)*(PATCH_SIZE+1);
+    return nu + nv * (rate+1) + patch * (PATCH_SIZE+1)*(PATCH_SIZE+1);
+}
+
+int range_dice_rate(int packed_pid)
+{
+    return ADAPTIVE_DICING ? min(1 << range_dice_level(packed_pid), PATCH_SIZE) : PATCH_SIZE;
+}
+
+
+// Nearest multiple of 2^-level, ties to even like
+// BoundNSplitCPU::snap_to_edges() does
+float snap_to_lattice(float t, int level)
+{
+    float cells = ldexp(1.0f, level);
+    return rint(t * cells) / cells;
 }
 
 
@@ -32,19 +50,38 @@ __kernel void dice (const global float4* patch_buffer,
                     global float4* pos_grid,
                     global int2* pxlpos_grid,
                     global float* depth_grid,
-                    float16 modelview,
-                    float16 proj)
+                    const global float16* instances,
+                    int instance_patch_count,
+                    float16 proj,
+                    int range_offset
+#if DIAGSPLIT
+                    , const global uint* edge_buffer
+#endif
+                    )
 {
     size_t nv = get_global_id(0), nu = get_global_id(1);
     size_t range_id = get_global_id(2);
-    size_t patch_id = pid_buffer[range_id];
+    size_t instance_pid = range_pid(pid_buffer[range_id]);
+    size_t patch_id = instance_pid % instance_patch_count;
+    int rate = range_dice_rate(pid_buffer[range_id]);
 
-    if (nv > PATCH_SIZE || nu > PATCH_SIZE) return;
+    if (nv > rate || nu > rate) return;
         
     float2 rmin = min_buffer[get_global_id(2)];
     float2 rmax = max_buffer[get_global_id(2)];
     
-    float2 uv = (float2)(mix(rmin, rmax, (float2)(nu/(float)PATCH_SIZE, nv/(float)PATCH_SIZE)));
+    float2 uv = (float2)(mix(rmin, rmax, (float2)(nu/(float)rate, nv/(float)rate)));
+
+#if DIAGSPLIT
+    // Edge lattices packed in the order y=min, x=max, y=max, x=min
+    uint edges = edge_buffer[range_id];
+    if (nv == 0)    uv.x = snap_to_lattice(uv.x,  edges        & 0xff);
+    if (nv == rate) uv.x = snap_to_lattice(uv.x, (edges >> 16) & 0xff);
+    if (nu == 0)    uv.y = snap_to_lattice(uv.y, (edges >> 24) & 0xff);
+    if (nu == rate) uv.y = snap_to_lattice(uv.y, (edges >>  8) & 0xff);
+#endif
+
+    float16 modelview = instances[instance_pid / instance_patch_count];
 
     float4 pos = mul_m44v4(modelview, eval_patch(patch_buffer, patch_id, uv));
 
@@ -72,7 +109,8 @@ __kernel void dice (const global float4* patch_buffer,
                         (int)(p.y/p.w * VIEWPORT_SIZE.y/2 + VIEWPORT_SIZE.y/2));
 
 
-    int grid_index = calc_grid_pos(nu, nv, range_id);
+    // Ranges of earlier objects may already occupy the first grid slots
+    int grid_index = calc_grid_pos(nu, nv, range_offset + range_id, rate);
     
     pos_grid[grid_index] = pos;
     pxlpos_grid[grid_index] = coord;
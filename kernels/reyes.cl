@@ -26,6 +26,10 @@
 // VIEWPORT_SIZE_PIXEL   - int2
 // MAX_BLOCK_ASSIGNMENTS - int
 // DISPLACEMENT          - int(bool)
+// ADAPTIVE_DICING       - int(bool)
+// DEFERRED_SHADING      - int(bool), sample writes a visibility buffer that resolve shades
+// TILED_DEPTH           - int(bool), sample keeps the cleared flag and depth range of each tile
+// LIGHT_COUNT           - int, number of lights in the light buffer
 
 #define BLOCKS_PER_LINE (PATCH_SIZE/8)
 #define BLOCKS_PER_PATCH (BLOCKS_PER_LINE*BLOCKS_PER_LINE)
@@ -44,9 +48,16 @@ int calc_framebuffer_pos(int2 pxlpos)
     return grid_id * TILE_SIZE * TILE_SIZE + locl_id;
 }
 
-size_t calc_grid_pos(size_t nu, size_t nv, size_t patch)
+// Grids of ranges diced with less than PATCH_SIZE are packed at the
+// start of their slot
+size_t calc_grid_pos(size_t nu, size_t nv, size_t patch, int rate)
 {
-    return nu + nv * (PATCH_SIZE+1) + patch * (PATCH_SIZE+1)*(PATCH_SIZE+1);
+    return nu + nv * (rate+1) + patch * (PATCH_SIZE+1)*(PATCH_SIZE+1);
+}
+
+int range_dice_rate(int packed_pid)
+{
+    return ADAPTIVE_DICING ? min(1 << range_dice_level(packed_pid), PATCH_SIZE) : PATCH_SIZE;
 }
 
 
@@ -74,18 +85,77 @@ int calc_block_pos(int u, int v, int range_id)
     return u + v * BLOCKS_PER_LINE + range_id * BLOCKS_PER_PATCH;
 }
 
-int calc_color_grid_pos(int u, int v, int range_id)
+int calc_color_grid_pos(int u, int v, int range_id, int rate)
 {
-    return u + v * PATCH_SIZE + range_id * (PATCH_SIZE*PATCH_SIZE);
+    return u + v * rate + range_id * (PATCH_SIZE*PATCH_SIZE);
+}
+
+
+// Light types, same as Reyes::Light::Type
+#define LIGHT_POINT       0
+#define LIGHT_DIRECTIONAL 1
+#define LIGHT_HEMI        2
+
+// Each light takes three entries of the light buffer in view space:
+// (position, type), (direction towards the light, 0), (color, 0)
+
+// V
+// |
+// 2 - 3
+// | / |
+// 0 - 1 - U
+float4 shade_micropolygon(const float4* pos, float4 diffuse_color, constant float4* lights)
+{
+    float3 du = (pos[1] - pos[0] +
+                 pos[3] - pos[2]).xyz * 0.5f;
+    float3 dv = (pos[2] - pos[0] +
+                 pos[3] - pos[1]).xyz * 0.5f;
+
+    float3 n = normalize(cross(dv,du));
+
+    float3 p = (pos[0]+pos[1]+pos[2]+pos[3]).xyz * 0.25f;
+    float3 v = -normalize(p);
+
+    float4 ac = (float4)(0.015,0.015,0.015,1);
+    float4 dc = diffuse_color;
+    float4 sc = (float4)(0,0,0,0);
+
+    float sh = 60.0f;
+
+    float4 c = ac * dc;
+
+    // LIGHT_COUNT is a compile time constant, so the loop is unrolled
+    for (int i = 0; i < LIGHT_COUNT; ++i) {
+        float4 light_pos = lights[i*3 + 0];
+        float3 light_dir = lights[i*3 + 1].xyz;
+        float4 light_col = (float4)(lights[i*3 + 2].xyz, 1);
+
+        int type = (int)light_pos.w;
+
+        // Point lights have no falloff, like the former fixed light
+        float3 l = (type == LIGHT_POINT) ? normalize(light_pos.xyz - p) : light_dir;
+        float3 h = normalize(l+v);
+
+        float n_dot_l = dot(n,l);
+        float diffuse = (type == LIGHT_HEMI) ? 0.5f + 0.5f * n_dot_l : max(n_dot_l, 0.0f);
+
+        c += light_col * (diffuse * dc + pow(max(dot(n,h), 0.0f), sh) * sc);
+    }
+
+    return c;
 }
 
 
 
-__kernel void shade(const global float4* pos_grid,
+__kernel void shade(const global int* pid_buffer,
+                    const global float4* pos_grid,
                     const global int2* pxlpos_grid,
                     global int4* block_index,
                     global float4* color_grid,
-                    float4 diffuse_color)
+                    global float4* range_colors,
+                    constant float4* lights,
+                    float4 diffuse_color,
+                    int range_offset)
 {
     volatile local int x_min;
     volatile local int y_min;
@@ -115,30 +185,48 @@ __kernel void shade(const global float4* pos_grid,
     int2 pxlpos[4];
 
     int nv = get_global_id(0), nu = get_global_id(1);
-    int range_id = get_global_id(2);
+    int range_id = range_offset + get_global_id(2);
+    int rate = range_dice_rate(pid_buffer[range_id]);
+
+    // Deferred shading looks the color up by range
+    if (DEFERRED_SHADING && get_global_id(0) == 0 && get_global_id(1) == 0) {
+        range_colors[range_id] = diffuse_color;
+    }
+
+    // Blocks that lie completely outside a smaller grid stay empty
+    if (get_group_id(0) * 8 >= rate || get_group_id(1) * 8 >= rate) {
+        if (get_local_id(0) == 0 && get_local_id(1) == 0) {
+            int i = calc_block_pos(get_group_id(0), get_group_id(1), range_id);
+            block_index[i] = (int4)(1, 1, -1, -1);
+        }
+        return;
+    }
+
+    int inside = nu < rate && nv < rate;
 
     int2 pmin = VIEWPORT_MAX;
     int2 pmax = VIEWPORT_MIN;
 
-    
-    for     (int vi = 0; vi < 2; ++vi) {
-        for (int ui = 0; ui < 2; ++ui) {
-            int i = ui + vi * 2;
-            pos[i] = pos_grid[calc_grid_pos(nu+ui, nv+vi, range_id)];
-            int2 p  = pxlpos_grid[calc_grid_pos(nu+ui, nv+vi, range_id)];
+    if (inside) {
+        for     (int vi = 0; vi < 2; ++vi) {
+            for (int ui = 0; ui < 2; ++ui) {
+                int i = ui + vi * 2;
+                pos[i] = pos_grid[calc_grid_pos(nu+ui, nv+vi, range_id, rate)];
+                int2 p  = pxlpos_grid[calc_grid_pos(nu+ui, nv+vi, range_id, rate)];
 
-            if (pos[i].z == 0) {
-                allnormal = 0;
-            }
+                if (pos[i].z == 0) {
+                    allnormal = 0;
+                }
             
-            pmin = min(pmin, p);
-            pmax = max(pmax, p);
+                pmin = min(pmin, p);
+                pmax = max(pmax, p);
 
-            pxlpos[i] = p;
+                pxlpos[i] = p;
+            }
         }
     }
 
-    if (is_front_facing(pxlpos)) {
+    if (inside && is_front_facing(pxlpos)) {
         atomic_min(&x_min, pmin.x);
         atomic_min(&y_min, pmin.y);
         atomic_max(&x_max, pmax.x);
@@ -161,47 +249,30 @@ __kernel void shade(const global float4* pos_grid,
             y_max = -1;
         }
         
-        int i = calc_block_pos(get_group_id(0), get_group_id(1), get_group_id(2));
+        int i = calc_block_pos(get_group_id(0), get_group_id(1), range_id);
         block_index[i] = (int4)(x_min, y_min, x_max, y_max);
     }
 
-    if (is_empty((int2)(x_min, y_min), (int2)(x_max, y_max))) {
+    if (DEFERRED_SHADING || !inside || is_empty((int2)(x_min, y_min), (int2)(x_max, y_max))) {
         return;
     }
 
-    float3 du = (pos[1] - pos[0] +
-                 pos[3] - pos[2]).xyz * 0.5f;
-    float3 dv = (pos[2] - pos[0] +
-                 pos[3] - pos[1]).xyz * 0.5f;
-
-    float3 n = normalize(cross(dv,du));
-
-    float3 l = normalize((float3)(4,3,8));
-
-    float3 v = -normalize((pos[0]+pos[1]+pos[2]+pos[3]).xyz);
-
-    float4 ac = (float4)(0.015,0.015,0.015,1);
-    float4 dc = diffuse_color;
-    float4 sc = (float4)(0,0,0,0);
-    
-    float3 h = normalize(l+v);
-        
-    float sh = 60.0f;
-
-    float4 c = ac * dc + max(dot(n,l),0.0f) * dc + pow(max(dot(n,h), 0.0f), sh) * sc;
+    float4 c = shade_micropolygon(pos, diffuse_color, lights);
 
     // Uncomment to visualize individual ranges
     //c *= (range_id % 4 + 1) / 4.0f;
     
-    color_grid[calc_color_grid_pos(nu, nv, range_id)] = c;
+    color_grid[calc_color_grid_pos(nu, nv, range_id, rate)] = c;
 
 
 }
 
 
+#define TILES_PER_LINE ((FRAMEBUFFER_SIZE.x+7)/8)
+
 int calc_tile_id(int tx, int ty)
 {
-    return tx + FRAMEBUFFER_SIZE.x/8 * ty;
+    return tx + TILES_PER_LINE * ty;
 }
 
 
@@ -267,132 +338,396 @@ int inside_triangle(int3 Px, int3 Py, int2 tp, float3 dv, float* depth)
 
 #define MAX_LOCAL_COORD  ((8<<PXLCOORD_SHIFT) - 1)
 
-__kernel void sample(global const int4* block_index,
+#define FAR_DEPTH 0x7fffffff
+
+// TODO: Replace this with a proper mapping function
+int map_depth(float depth)
+{
+    return (int)(clamp(depth / 200.0f, 0.0f, 1.0f) * FAR_DEPTH);
+}
+
+// Sort-middle binning of micropolygon blocks into 8x8 pixel tiles. Blocks
+// are counted per tile, the counts are prefix summed, block ids are
+// scattered into per-tile lists and each tile is then rasterized by a
+// single work group that owns it exclusively.
+
+void block_tile_range(int4 block_bound, int2* min_tile, int2* max_tile)
+{
+    *min_tile = block_bound.xy >> (PXLCOORD_SHIFT + 3);
+    *max_tile = block_bound.zw >> (PXLCOORD_SHIFT + 3);
+}
+
+
+__kernel void count_tile_blocks(global const int4* block_index,
+                                volatile global int* tile_counts,
+                                int block_count)
+{
+    int block_id = get_global_id(0);
+
+    if (block_id >= block_count) return;
+    
+    int4 block_bound = block_index[block_id];
+
+    if (is_empty(block_bound.xy, block_bound.zw)) {
+        return;
+    }
+
+    int2 min_tile, max_tile;
+    block_tile_range(block_bound, &min_tile, &max_tile);
+    
+    for     (int ty = min_tile.y; ty <= max_tile.y; ++ty) {
+        for (int tx = min_tile.x; tx <= max_tile.x; ++tx) {
+            atomic_inc(tile_counts + calc_tile_id(tx, ty));
+        }
+    }
+}
+
+
+__kernel void scatter_tile_blocks(global const int4* block_index,
+                                  volatile global int* tile_offsets,
+                                  global int* tile_blocks,
+                                  int tile_block_capacity,
+                                  int block_count)
+{
+    int block_id = get_global_id(0);
+
+    if (block_id >= block_count) return;
+
+    int4 block_bound = block_index[block_id];
+
+    if (is_empty(block_bound.xy, block_bound.zw)) {
+        return;
+    }
+
+    int2 min_tile, max_tile;
+    block_tile_range(block_bound, &min_tile, &max_tile);
+
+    // tile_offsets holds the inclusive prefix sum of the tile counts.
+    // Counting it down fills each list back to front and leaves the
+    // start of the list behind. Lists that run past the end of tile_blocks
+    // are only partly written, sample scans all blocks for their tiles.
+    for     (int ty = min_tile.y; ty <= max_tile.y; ++ty) {
+        for (int tx = min_tile.x; tx <= max_tile.x; ++tx) {
+            int pos = atomic_dec(tile_offsets + calc_tile_id(tx, ty)) - 1;
+            if (pos < tile_block_capacity) {
+                tile_blocks[pos] = block_id;
+            }
+        }
+    }
+}
+
+
+__kernel void sample(global const int* tile_counts,
+                     global const int* tile_offsets,
+                     global const int* tile_blocks,
+                     int tile_block_capacity,
+                     global const int4* block_index,
+                     int batch_block_count,
+                     global const int* pid_buffer,
                      global const int2* pxlpos_grid,
                      global const float4* color_grid,
                      global const float* depth_grid,
-                     volatile global int* tile_locks,
-                     volatile global float4* color_buffer,
-                     volatile global int* depth_buffer
+                     global float4* color_buffer,
+                     global int* depth_buffer,
+                     global int4* depth_tiles,
+                     global int2* visibility,
+                     int batch_id,
+                     float4 clear_color
                      )
 {
+#if DEFERRED_SHADING
+    // Micropolygon ids, see calc_color_grid_pos
+    local int ids[8][8];
+#else
     local float4 colors[8][8];
+#endif
     local int depths[8][8];
     volatile local int locks[8][8];
+#if TILED_DEPTH
+    local int tile_min, tile_max;
+#endif
 
     int2 l = (int2)(get_local_id(0), get_local_id(1));
-    int block_id = get_global_id(2);
-    int4 block_bound = block_index[block_id];
+    int tile_id = get_global_id(2);
+
+    int block_count = tile_counts[tile_id];
 
-    if (is_empty(block_bound.xy, block_bound.zx)) {
+    if (block_count == 0) {
         return;
     }
 
-    int2 min_tile = block_bound.xy >> (PXLCOORD_SHIFT + 3);
-    int2 max_tile = block_bound.zw >> (PXLCOORD_SHIFT + 3);
+    int block_start = tile_offsets[tile_id];
 
-    int head = all(l == 0);
+    // The list of this tile did not fit into tile_blocks, test all blocks
+    // of the batch against the tile instead
+    int scan_all = block_start + block_count > tile_block_capacity;
+    if (scan_all) {
+        block_count = batch_block_count;
+    }
     
-    // Prepare local position
-    float4 c;
-    int4 Px, Py;
-    float4 dv;
-    int2 min_gp = VIEWPORT_MAX+1;
-    int2 max_gp = VIEWPORT_MIN-1;
-    {
-    	int Pxa[4], Pya[4];
-    	float da[4];
-
-    	size_t range_id, u, v;
-        recover_patch_pos(block_id, l.x, l.y,  &u, &v, &range_id);
-	
-    	c = color_grid[calc_color_grid_pos(u, v, range_id)];
+    int2 tile_pos = (int2)(tile_id % TILES_PER_LINE, tile_id / TILES_PER_LINE);
+    int2 o = tile_pos * 8;
+    int2 os = o << PXLCOORD_SHIFT;
+    int2 fb_pos = l + o;
+    int fb_id = calc_framebuffer_pos(fb_pos);
+
+#if TILED_DEPTH
+    // x: depth and color of the tile are still cleared, y/z: min/max depth
+    int4 tile = depth_tiles[tile_id];
+    int far_depth = tile.x ? FAR_DEPTH : tile.z;
+#endif
+
+    depths[l.x][l.y] = FAR_DEPTH;
+#if DEFERRED_SHADING
+    ids[l.x][l.y] = -1;
+#else
+    colors[l.x][l.y] = (float4)(1,0,0,0);
+#endif
+    locks[l.x][l.y] = 1;
+
+#if TILED_DEPTH
+    // Pixels this batch doesn't touch keep their depth, which the range of
+    // a tile that isn't cleared still bounds
+    if (l.x == 0 && l.y == 0) {
+        tile_min = tile.x ? FAR_DEPTH : tile.y;
+        tile_max = tile.x ? 0 : tile.z;
+    }
+#endif
+    
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int b = 0; b < block_count; ++b) {
+        int block_id;
+
+        if (scan_all) {
+            int4 block_bound = block_index[b];
 
-        for (size_t idx = 0; idx < 4; ++idx) {
-            size_t p = calc_grid_pos(u+(idx&1), v+(idx>>1), range_id);
+            if (is_empty(block_bound.xy, block_bound.zw)) {
+                continue;
+            }
 
-            int2 pxlpos = pxlpos_grid[p];
-            Pxa[idx] = pxlpos.x;
-            Pya[idx] = pxlpos.y;
+            int2 min_tile, max_tile;
+            block_tile_range(block_bound, &min_tile, &max_tile);
 
-            min_gp = min(min_gp, pxlpos);
-            max_gp = max(max_gp, pxlpos);
+            if (any(tile_pos < min_tile) || any(tile_pos > max_tile)) {
+                continue;
+            }
 
-            float depth = depth_grid[p];
-            da[idx] = depth;
+            block_id = b;
+        } else {
+            block_id = tile_blocks[block_start + b];
         }
+        
+        // Prepare local position
+#if DEFERRED_SHADING
+        int c;
+#else
+        float4 c;
+#endif
+        int4 Px, Py;
+        float4 dv;
+        int2 min_gp = VIEWPORT_MAX+1;
+        int2 max_gp = VIEWPORT_MIN-1;
+        {
+            int Pxa[4], Pya[4];
+            float da[4];
+
+            size_t range_id, u, v;
+            recover_patch_pos(block_id, l.x, l.y,  &u, &v, &range_id);
+
+            int rate = range_dice_rate(pid_buffer[range_id]);
+
+            // This work item has no micropolygon in blocks of smaller grids
+            if (u >= rate || v >= rate) {
+                continue;
+            }
 	
-        Px = vload4(0, &Pxa[0]);
-        Py = vload4(0, &Pya[0]);
-        dv = vload4(0, &da[0]);
-    }
+#if DEFERRED_SHADING
+            c = calc_color_grid_pos(u, v, range_id, rate);
+#else
+            c = color_grid[calc_color_grid_pos(u, v, range_id, rate)];
+#endif
 
-    locks[l.x][l.y] = 1;
-    barrier(CLK_LOCAL_MEM_FENCE);
+            for (size_t idx = 0; idx < 4; ++idx) {
+                size_t p = calc_grid_pos(u+(idx&1), v+(idx>>1), range_id, rate);
 
-    for     (int ty = min_tile.y; ty <= max_tile.y; ++ty) {
-        for (int tx = min_tile.x; tx <= max_tile.x; ++tx) {
-            int2 o = (int2)(tx*8, ty*8);
-            int2 os = o << PXLCOORD_SHIFT;
-            int tile_id = calc_tile_id(tx,ty);
-            int2 fb_pos = l + o;
-            int fb_id = calc_framebuffer_pos(fb_pos);
+                int2 pxlpos = pxlpos_grid[p];
+                Pxa[idx] = pxlpos.x;
+                Pya[idx] = pxlpos.y;
+
+                min_gp = min(min_gp, pxlpos);
+                max_gp = max(max_gp, pxlpos);
 
-            depths[l.x][l.y] = 0x7fffffff;
-            colors[l.x][l.y] = (float4)(1,0,0,0);
+                float depth = depth_grid[p];
+                da[idx] = depth;
+            }
+	
+            Px = vload4(0, &Pxa[0]);
+            Py = vload4(0, &Pya[0]);
+            dv = vload4(0, &da[0]);
+        }
 
-            barrier(CLK_LOCAL_MEM_FENCE);
-	    
-            int2 min_p = clamp(min_gp - os, 0, MAX_LOCAL_COORD);
-            int2 max_p = clamp(max_gp - os, 0, MAX_LOCAL_COORD);
+#if TILED_DEPTH
+        // Sampled depths are interpolated from the corners and start at 1,
+        // a micropolygon behind the farthest pixel of the tile is hidden
+        if (map_depth(min(1.0f, min(min(dv.x, dv.y), min(dv.z, dv.w)))) >= far_depth) {
+            continue;
+        }
+#endif
 
-            min_p = min_p >> PXLCOORD_SHIFT;
-            max_p = max_p >> PXLCOORD_SHIFT;
+        int2 min_p = clamp(min_gp - os, 0, MAX_LOCAL_COORD);
+        int2 max_p = clamp(max_gp - os, 0, MAX_LOCAL_COORD);
 
-            //printf("%d %d %d %d\n", min_p.x, min_p.y, max_p.x, max_p.y);
+        min_p = min_p >> PXLCOORD_SHIFT;
+        max_p = max_p >> PXLCOORD_SHIFT;
 
-            for (int y = min_p.y; y <= max_p.y; ++y) {
-                for (int x = min_p.x; x <= max_p.x; ++x) {
+        for (int y = min_p.y; y <= max_p.y; ++y) {
+            for (int x = min_p.x; x <= max_p.x; ++x) {
 
-                    int2 tp = ((int2)(x,y) << PXLCOORD_SHIFT) + os;
+                int2 tp = ((int2)(x,y) << PXLCOORD_SHIFT) + os;
 
-                    float depth = 1;
-                    int inside1 = inside_triangle(Px.xyw, Py.xyw, tp, dv.xyw, &depth);
-                    int inside2 = inside_triangle(Px.xwz, Py.xwz, tp, dv.xwz, &depth);
+                float depth = 1;
+                int inside1 = inside_triangle(Px.xyw, Py.xyw, tp, dv.xyw, &depth);
+                int inside2 = inside_triangle(Px.xwz, Py.xwz, tp, dv.xwz, &depth);
 
-                    // TODO: Replace this with a proper mapping function
-                    int idepth = (int)(clamp(depth / 200.0f, 0.0f, 1.0f) * 0x7fffffff);
+                int idepth = map_depth(depth);
                     
-                    if (inside1 || inside2) {
+                if (inside1 || inside2) {
                         
-                        while (1) {
-                            if (atomic_xchg(&(locks[y][x]), 0)) continue;
-
-                            if (depths[y][x] > idepth) {
-                                depths[y][x] = idepth;
-                                colors[y][x] = c;
-                            }
-
-                            atomic_xchg(&(locks[y][x]), 1);
-                            break;
+                    while (1) {
+                        if (atomic_xchg(&(locks[y][x]), 0)) continue;
+
+                        if (depths[y][x] > idepth) {
+                            depths[y][x] = idepth;
+#if DEFERRED_SHADING
+                            ids[y][x] = c;
+#else
+                            colors[y][x] = c;
+#endif
                         }
+
+                        atomic_xchg(&(locks[y][x]), 1);
+                        break;
                     }
                 }
             }
-	    
+        }
+    }
 
-            // blit tile
-            if (head) while (!atomic_xchg(&(tile_locks[tile_id]), 0));
-            barrier(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-            int d = depths[l.y][l.x];
-            if (d < atomic_min(depth_buffer + fb_id, d)) {
-                color_buffer[fb_id] = colors[l.y][l.x];
-            }
-            
-            barrier(CLK_GLOBAL_MEM_FENCE | CLK_LOCAL_MEM_FENCE);
-            if (head) atomic_xchg(&(tile_locks[tile_id]), 1);
+    // blit tile, this work group is the only one writing to it
+    int d = depths[l.y][l.x];
+#if TILED_DEPTH
+    // Pixels of a cleared tile are read as cleared, and anything in front
+    // of the tile's min depth passes without reading the depth buffer
+    int old_depth = FAR_DEPTH;
+    if (!tile.x && d != FAR_DEPTH && d >= tile.y) {
+        old_depth = depth_buffer[fb_id];
+    }
+
+    int new_depth = min(d, old_depth);
+
+    if (d < old_depth || tile.x) {
+        depth_buffer[fb_id] = new_depth;
+    }
+
+    if (d < old_depth) {
+#if DEFERRED_SHADING
+        visibility[fb_id] = (int2)(ids[l.y][l.x], batch_id);
+#else
+        color_buffer[fb_id] = colors[l.y][l.x];
+#endif
+    } else if (tile.x) {
+        color_buffer[fb_id] = clear_color;
+    }
+
+    // Pixels past the framebuffer edge stay cleared and don't count, neither
+    // do untouched pixels of a tile that isn't cleared, whose depth wasn't read
+    if ((tile.x || d != FAR_DEPTH) &&
+        fb_pos.x < FRAMEBUFFER_SIZE.x && fb_pos.y < FRAMEBUFFER_SIZE.y) {
+        atomic_min(&tile_min, new_depth);
+        atomic_max(&tile_max, new_depth);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (l.x == 0 && l.y == 0) {
+        depth_tiles[tile_id] = (int4)(0, tile_min, tile_max, 0);
+    }
+#else
+    if (d < depth_buffer[fb_id]) {
+        depth_buffer[fb_id] = d;
+#if DEFERRED_SHADING
+        visibility[fb_id] = (int2)(ids[l.y][l.x], batch_id);
+#else
+        color_buffer[fb_id] = colors[l.y][l.x];
+#endif
+    }
+#endif
+}
+
+
+// Fills the tiles no batch of the frame sampled with the clear color,
+// every other tile got it from sample already.
+__kernel void fill_cleared_tiles(global const int4* depth_tiles,
+                                 global float4* color_buffer,
+                                 float4 clear_color)
+{
+    int tile_id = get_global_id(2);
+
+    if (!depth_tiles[tile_id].x) {
+        return;
+    }
+
+    int2 o = (int2)(tile_id % TILES_PER_LINE, tile_id / TILES_PER_LINE) * 8;
+    int2 fb_pos = (int2)(get_local_id(0), get_local_id(1)) + o;
+
+    color_buffer[calc_framebuffer_pos(fb_pos)] = clear_color;
+}
+
+
+// Shades the pixels whose visible micropolygon was sampled from the grid
+// set of batch_id, so each pixel is shaded at most once per sampled batch
+// instead of once per covering micropolygon.
+__kernel void resolve(global const int* tile_counts,
+                      global const int* pid_buffer,
+                      global const float4* pos_grid,
+                      global const float4* range_colors,
+                      constant float4* lights,
+                      global const int2* visibility,
+                      global float4* color_buffer,
+                      int batch_id)
+{
+    int tile_id = get_global_id(2);
+
+    if (tile_counts[tile_id] == 0) {
+        return;
+    }
+
+    int2 o = (int2)(tile_id % TILES_PER_LINE, tile_id / TILES_PER_LINE) * 8;
+    int2 fb_pos = (int2)(get_local_id(0), get_local_id(1)) + o;
+    int fb_id = calc_framebuffer_pos(fb_pos);
 
+    int2 vis = visibility[fb_id];
+
+    if (vis.y != batch_id || vis.x < 0) {
+        return;
+    }
+
+    int range_id = vis.x / (PATCH_SIZE*PATCH_SIZE);
+    int local_id = vis.x % (PATCH_SIZE*PATCH_SIZE);
+    int rate = range_dice_rate(pid_buffer[range_id]);
+
+    int u = local_id % rate;
+    int v = local_id / rate;
+
+    float4 pos[4];
+    for     (int vi = 0; vi < 2; ++vi) {
+        for (int ui = 0; ui < 2; ++ui) {
+            pos[ui + vi * 2] = pos_grid[calc_grid_pos(u+ui, v+vi, range_id, rate)];
         }
-    }    
+    }
+
+    color_buffer[fb_id] = shade_micropolygon(pos, range_colors[range_id], lights);
 }
@@ -0,0 +1,156 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#include "utility.h"
+
+// Compile time constants:
+// SPLIT_CACHE_LEAVES    - int, at most 32
+
+// Leaves of patch pid fill the slots from pid * SPLIT_CACHE_LEAVES onwards,
+// see record_split_leaf in bound_n_split.h. Bit 7 of a leaf depth flags
+// ranges that are small enough to be replaced by their parent.
+#define LEAF_MERGEABLE 0x80
+#define LEAF_DEPTH_MASK 0x7f
+
+
+// Replaces pairs of mergeable leaves of a seed patch by their union, one
+// level per frame, like BoundNSplitCPU::merge_split_leaves. The merged
+// list is compacted in place and its length written to seed_counts.
+// Patches without a complete list are seeded as a whole.
+kernel void merge_split_leaves(volatile global int* leaf_counts,
+                               global float4* leaf_ranges,
+                               global uchar* leaf_depths,
+                               const global int* seed_pids,
+                               int use_seed_pids,
+                               int seed_count,
+                               global int* seed_counts)
+{
+    int gid = get_global_id(0);
+
+    if (gid >= seed_count) return;
+
+    int pid = use_seed_pids ? seed_pids[gid] : gid;
+    int count = leaf_counts[pid];
+
+    if (count == 0 || count > SPLIT_CACHE_LEAVES) {
+        leaf_counts[pid] = 0;
+        seed_counts[gid] = 1;
+        return;
+    }
+
+    size_t base = (size_t)pid * SPLIT_CACHE_LEAVES;
+
+    uint consumed = 0;
+    int merged = 0;
+
+    for (int i = 0; i < count; ++i) {
+        if (consumed & (1u << i)) continue;
+
+        float4 r = leaf_ranges[base + i];
+        uchar d = leaf_depths[base + i];
+        uchar depth = d & LEAF_DEPTH_MASK;
+
+        if ((d & LEAF_MERGEABLE) && depth > 0) {
+            // The sibling doubles the shorter side, it has the same parent
+            // and shows up after this leaf if it was not consumed before
+            float w = r.z - r.x;
+            float h = r.w - r.y;
+
+            float4 parent = r;
+            float4 sibling = r;
+
+            if (w <= h) {
+                parent.x = floor(r.x / (2*w)) * (2*w);
+                parent.z = parent.x + 2*w;
+                sibling.x = (r.x == parent.x) ? r.z : parent.x;
+                sibling.z = sibling.x + w;
+            } else {
+                parent.y = floor(r.y / (2*h)) * (2*h);
+                parent.w = parent.y + 2*h;
+                sibling.y = (r.y == parent.y) ? r.w : parent.y;
+                sibling.w = sibling.y + h;
+            }
+
+            for (int j = i+1; j < count; ++j) {
+                if (!(consumed & (1u << j)) &&
+                    (leaf_depths[base + j] & LEAF_MERGEABLE) &&
+                    all(leaf_ranges[base + j] == sibling)) {
+
+                    consumed |= 1u << j;
+                    r = parent;
+                    depth -= 1;
+                    break;
+                }
+            }
+        }
+
+        // Slots up to i have been read already
+        leaf_ranges[base + merged] = r;
+        leaf_depths[base + merged] = depth;
+        ++merged;
+    }
+
+    leaf_counts[pid] = merged;
+    seed_counts[gid] = merged;
+}
+
+
+// Writes the merged leaves of every seed patch, or the whole patch, to the
+// seed ranges. seed_offsets holds the inclusive prefix sum of seed_counts.
+// The leaf lists of the seed patches are recorded from scratch afterwards.
+kernel void seed_split_leaves(volatile global int* leaf_counts,
+                              const global float4* leaf_ranges,
+                              const global uchar* leaf_depths,
+                              const global int* seed_pids,
+                              int use_seed_pids,
+                              int seed_count,
+                              const global int* seed_offsets,
+
+                              global int* pids,
+                              global uchar* depths,
+                              global float2* mins,
+                              global float2* maxs)
+{
+    int gid = get_global_id(0);
+
+    if (gid >= seed_count) return;
+
+    int pid = use_seed_pids ? seed_pids[gid] : gid;
+    int count = leaf_counts[pid];
+    int end = seed_offsets[gid];
+
+    if (count == 0) {
+        pids[end - 1] = pid;
+        depths[end - 1] = 0;
+        mins[end - 1] = (float2)(0,0);
+        maxs[end - 1] = (float2)(1,1);
+    }
+
+    size_t base = (size_t)pid * SPLIT_CACHE_LEAVES;
+
+    for (int i = 0; i < count; ++i) {
+        int pos = end - count + i;
+        float4 r = leaf_ranges[base + i];
+
+        pids[pos] = pid;
+        depths[pos] = leaf_depths[base + i];
+        mins[pos] = r.xy;
+        maxs[pos] = r.zw;
+    }
+
+    leaf_counts[pid] = 0;
+}
@@ -201,4 +201,21 @@ inline int round_up_by(int n, int d)
     return round_up_div(n,d) * n;
 }
 
+// Ranges that are sent to dicing carry the log2 of their dicing rate in
+// the 8 most significant bits of the patch id
+inline int pack_range_pid(int pid, int dice_level)
+{
+    return pid | (dice_level << 24);
+}
+
+inline int range_pid(int packed_pid)
+{
+    return packed_pid & 0xffffff;
+}
+
+inline int range_dice_level(int packed_pid)
+{
+    return (packed_pid >> 24) & 0xff;
+}
+
 #endif
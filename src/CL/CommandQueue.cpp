@@ -130,6 +130,23 @@ void CL::CommandQueue::wait_for_events(const CL::Event& events)
 
 }
 
+bool CL::CommandQueue::events_complete(const CL::Event& events)
+{
+    size_t num_events = _parent_device.setup_event_pad(events, _event_pad, _event_pad_ptr);
+
+    for (size_t i = 0; i < num_events; ++i) {
+        cl_int eventstatus;
+        cl_int status = clGetEventInfo(_event_pad_ptr[i],
+                                       CL_EVENT_COMMAND_EXECUTION_STATUS,
+                                       sizeof(cl_int), &eventstatus, NULL);
+        OPENCL_ASSERT(status);
+
+        if (eventstatus != CL_COMPLETE) return false;
+    }
+
+    return true;
+}
+
 
 
 CL::Event CL::CommandQueue::enq_GL_acquire(cl_mem mem, const string& name, const CL::Event& events)
@@ -258,3 +275,28 @@ CL::Event CL::CommandQueue::enq_read_buffer(Buffer& buffer, void* src, size_t le
 {
     return enq_read_buffer(buffer, src, len, 0, name, events);
 }
+
+
+CL::Event CL::CommandQueue::enq_copy_buffer(Buffer& src, Buffer& dst, size_t len,
+                                            size_t src_offset, size_t dst_offset,
+                                            const string& name, const CL::Event& events)
+{
+    cl_int status;
+        
+    size_t cnt = _parent_device.setup_event_pad(events, _event_pad, _event_pad_ptr);
+    cl_event e;
+
+    status = clEnqueueCopyBuffer(_queue, src.get(), dst.get(), src_offset, dst_offset, len,
+                                 cnt, _event_pad_ptr, &e);
+
+    OPENCL_ASSERT(status);
+
+    return _parent_device.insert_event(name, _name, e, events);
+}
+
+
+CL::Event CL::CommandQueue::enq_copy_buffer(Buffer& src, Buffer& dst, size_t len,
+                                            const string& name, const CL::Event& events)
+{
+    return enq_copy_buffer(src, dst, len, 0, 0, name, events);
+}
@@ -60,12 +60,20 @@ namespace CL
         Event enq_read_buffer (Buffer& buffer, void* dst, size_t length,
                                const string& name, const Event& events);
 
+        Event enq_copy_buffer (Buffer& src, Buffer& dst, size_t length, size_t src_offset, size_t dst_offset,
+                               const string& name, const Event& events);
+        Event enq_copy_buffer (Buffer& src, Buffer& dst, size_t length,
+                               const string& name, const Event& events);
+
         template<typename T>
         Event enq_fill_buffer(Buffer& buffer, const T& pattern, size_t length,
                               const string& name, const Event& events);
         
         void wait_for_events (const Event& events);
 
+        // Returns whether all events have completed, without waiting
+        bool events_complete (const Event& events);
+
         void finish();
         void flush();
 
@@ -5,7 +5,9 @@
 #include "Exception.h"
 
 #include <CL/cl_gl.h>
+#include <cstdio>
 #include <fstream>
+#include <limits>
 
 #include <signal.h>
 #include <sstream>
@@ -26,6 +28,8 @@ namespace
     cl_context create_context_with_GL(cl_platform_id platform, cl_device_id device);
     cl_context create_context_without_GL(cl_platform_id platform, cl_device_id device);
     bool is_GPU_device(cl_device_id device);
+    string get_device_string(cl_device_id device, cl_device_info param_enum);
+    string get_platform_string(cl_platform_id platform, cl_platform_info param_enum);
     template <typename T> void print_device_param(cl_device_id device,
                                                   cl_device_info param_enum,
                                                   string param_name, 
@@ -41,13 +45,17 @@ namespace
 
 CL::Device::Device(int platform_index, int device_index)
     : _id_count(0)
+    , _frame_event_id(-1)
     , _dump_trace(false)
+    , _event_times(nullptr)
+    , _chrome_trace_flow_count(0)
+    , _chrome_trace_frame_count(0)
 {
     cl_platform_id platform;
 
     get_opencl_device(platform_index, device_index, platform, _device);
 
-    if (!cl_config.disable_buffer_sharing() && is_GPU_device(_device)) {
+    if (!cl_config.disable_buffer_sharing() && !config.headless() && is_GPU_device(_device)) {
         try {
             _context = create_context_with_GL(platform, _device);
             _share_gl = true;
@@ -76,6 +84,10 @@ CL::Device::Device(int platform_index, int device_index)
 
 CL::Device::~Device()
 {
+    if (_chrome_trace.is_open()) {
+        _chrome_trace << endl << "]" << endl;
+    }
+
     clReleaseContext(_context);
 }                                               \
 
@@ -229,64 +241,39 @@ void CL::Device::dump_trace()
 }
 
 
+void CL::Device::mark_frame(const CL::Event& frame_event)
+{
+    assert(frame_event.get_id_count() == 1);
+
+    _frame_event_id = frame_event.get_ids()[0];
+}
+
+
 void CL::Device::release_events()
 {
     cl_int status;
     
+    std::unordered_map<int, EventTiming> timing;
+
+    if (_dump_trace || _event_times) {
+        timing = query_event_timing();
+    }
+
+    if (_event_times) {
+        for (auto i : _events) {
+            const EventTiming& t = timing.at(i.first);
+
+            (*_event_times)[i.second.name] += t.end - t.start;
+        }
+    }
+
     if (_dump_trace) {
         _dump_trace = false;
-        
-        std::ofstream fs(cl_config.trace_file().c_str());
 
-        for (auto i : _events) {
-            const EventIndex& idx = i.second;
-            
-            cl_ulong queued, submit, start, end;
+        write_text_trace(timing);
 
-            if (idx.is_user) {
-                queued = idx.user_begin;
-                submit = idx.user_begin;
-                start = idx.user_begin;
-                end = idx.user_end;
-            } else {
-                
-                // Wait for event to complete
-                cl_int eventstatus;
-                do {
-                    cl_int status = clGetEventInfo(idx.event, CL_EVENT_COMMAND_EXECUTION_STATUS,
-                                                   sizeof(cl_int), &eventstatus, NULL);
-                    OPENCL_ASSERT(status);		
-                } while (eventstatus != CL_COMPLETE);
-
-                // Query timing values
-                status = clGetEventProfilingInfo(idx.event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL);
-                OPENCL_ASSERT(status);
-            
-                status = clGetEventProfilingInfo(idx.event, CL_PROFILING_COMMAND_SUBMIT, sizeof(submit), &submit, NULL);
-                OPENCL_ASSERT(status);
-            
-                status = clGetEventProfilingInfo(idx.event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
-                OPENCL_ASSERT(status);
-            
-                status = clGetEventProfilingInfo(idx.event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
-                OPENCL_ASSERT(status);
-            }
-            
-            fs << idx.name << "@" << idx.queue_name << ":"
-               << queued << ":"
-               << submit << ":"
-               << start << ":"
-               << end << ":"
-               << idx.id << ":";
-
-            for (int i = 0; i < idx.dependency_count; ++i) {
-                fs << idx.dependency_ids[i];
-
-                if (i+1 < idx.dependency_count)
-                    fs << "|";
-            }
-            
-            fs << endl;
+        if (!cl_config.chrome_trace_file().empty()) {
+            write_chrome_trace(timing);
         }
 
         cout << endl << "OpenCL trace dumped." << endl << endl;
@@ -304,6 +291,192 @@ void CL::Device::release_events()
   
     _events.clear();
     _id_count = 0;
+    _frame_event_id = -1;
+}
+
+
+std::unordered_map<int, CL::Device::EventTiming> CL::Device::query_event_timing()
+{
+    cl_int status;
+
+    // Wait for all device events at once instead of polling them one by one
+    vector<cl_event> device_events;
+    for (auto i : _events) {
+        if (!i.second.is_user) {
+            device_events.push_back(i.second.event);
+        }
+    }
+
+    if (!device_events.empty()) {
+        status = clWaitForEvents(device_events.size(), device_events.data());
+        OPENCL_ASSERT(status);
+    }
+
+    std::unordered_map<int, EventTiming> timing;
+    
+    for (auto i : _events) {
+        const EventIndex& idx = i.second;
+        EventTiming& t = timing[idx.id];
+        
+        if (idx.is_user) {
+            t.queued = idx.user_begin;
+            t.submit = idx.user_begin;
+            t.start = idx.user_begin;
+            t.end = idx.user_end;
+        } else {
+            status = clGetEventProfilingInfo(idx.event, CL_PROFILING_COMMAND_QUEUED, sizeof(t.queued), &t.queued, NULL);
+            OPENCL_ASSERT(status);
+            
+            status = clGetEventProfilingInfo(idx.event, CL_PROFILING_COMMAND_SUBMIT, sizeof(t.submit), &t.submit, NULL);
+            OPENCL_ASSERT(status);
+            
+            status = clGetEventProfilingInfo(idx.event, CL_PROFILING_COMMAND_START, sizeof(t.start), &t.start, NULL);
+            OPENCL_ASSERT(status);
+            
+            status = clGetEventProfilingInfo(idx.event, CL_PROFILING_COMMAND_END, sizeof(t.end), &t.end, NULL);
+            OPENCL_ASSERT(status);
+        }
+    }
+
+    return timing;
+}
+
+
+void CL::Device::write_text_trace(const std::unordered_map<int, EventTiming>& timing)
+{
+    std::ofstream fs(cl_config.trace_file().c_str());
+
+    for (auto i : _events) {
+        const EventIndex& idx = i.second;
+        const EventTiming& t = timing.at(idx.id);
+            
+        fs << idx.name << "@" << idx.queue_name << ":"
+           << t.queued << ":"
+           << t.submit << ":"
+           << t.start << ":"
+           << t.end << ":"
+           << idx.id << ":";
+
+        for (int i = 0; i < idx.dependency_count; ++i) {
+            fs << idx.dependency_ids[i];
+
+            if (i+1 < idx.dependency_count)
+                fs << "|";
+        }
+            
+        fs << endl;
+    }
+}
+
+
+void CL::Device::write_chrome_trace(const std::unordered_map<int, EventTiming>& timing)
+{
+    if (!_chrome_trace.is_open()) {
+        _chrome_trace.open(cl_config.chrome_trace_file().c_str());
+        _chrome_trace << "[" << endl
+                      << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"micropolis\"}}";
+    }
+
+    // Device and host timestamps come from different clocks. Move the
+    // device events so the first queued command lines up with the start of
+    // the frame, which is close enough to show pipeline bubbles.
+    const cl_ulong unset = std::numeric_limits<uint64_t>::max();
+    cl_ulong host_begin = unset;
+    cl_ulong device_begin = unset;
+
+    for (auto i : _events) {
+        const EventTiming& t = timing.at(i.first);
+
+        if (i.second.is_user) {
+            host_begin = std::min(host_begin, t.queued);
+        } else {
+            device_begin = std::min(device_begin, t.queued);
+        }
+    }
+
+    if (_frame_event_id >= 0 && timing.count(_frame_event_id) > 0) {
+        host_begin = timing.at(_frame_event_id).start;
+    }
+
+    int64_t device_offset = 0;
+    if (host_begin != unset &&
+        device_begin != unset) {
+        device_offset = (int64_t)host_begin - (int64_t)device_begin;
+    }
+
+    auto time_us = [&](const EventIndex& idx, cl_ulong t) {
+        return ((int64_t)t + (idx.is_user ? 0 : device_offset)) * 0.001;
+    };
+
+    std::ostream& fs = _chrome_trace;
+    fs.precision(15);
+
+    if (host_begin != unset) {
+        fs << "," << endl
+           << "{\"name\":\"frame " << _chrome_trace_frame_count << "\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":0,"
+           << "\"ts\":" << host_begin * 0.001 << "}";
+    }
+    ++_chrome_trace_frame_count;
+
+    for (auto i : _events) {
+        const EventIndex& idx = i.second;
+        const EventTiming& t = timing.at(idx.id);
+
+        int tid = chrome_trace_track(idx.queue_name);
+
+        fs << "," << endl
+           << "{\"name\":\"" << idx.name << "\",\"cat\":\"" << (idx.is_user ? "host" : "device") << "\","
+           << "\"ph\":\"X\",\"pid\":1,\"tid\":" << tid << ","
+           << "\"ts\":" << time_us(idx, t.start) << ",\"dur\":" << (t.end - t.start) * 0.001 << ","
+           << "\"args\":{\"id\":" << idx.id << ",\"queued\":" << time_us(idx, t.queued)
+           << ",\"submit\":" << time_us(idx, t.submit) << "}}";
+
+        // Flow arrows from the end of each dependency to the start of this event
+        for (int j = 0; j < idx.dependency_count; ++j) {
+            auto dep = _events.find(idx.dependency_ids[j]);
+
+            if (dep == _events.end()) continue;
+
+            const EventIndex& dep_idx = dep->second;
+            size_t flow_id = _chrome_trace_flow_count++;
+
+            // May write the metadata of a new track, not within the record
+            int dep_tid = chrome_trace_track(dep_idx.queue_name);
+
+            fs << "," << endl
+               << "{\"name\":\"dependency\",\"cat\":\"dependency\",\"ph\":\"s\",\"id\":" << flow_id << ","
+               << "\"pid\":1,\"tid\":" << dep_tid << ","
+               << "\"ts\":" << time_us(dep_idx, timing.at(dep_idx.id).end) << "}";
+
+            fs << "," << endl
+               << "{\"name\":\"dependency\",\"cat\":\"dependency\",\"ph\":\"f\",\"bp\":\"e\",\"id\":" << flow_id << ","
+               << "\"pid\":1,\"tid\":" << tid << ","
+               << "\"ts\":" << time_us(idx, t.start) << "}";
+        }
+    }
+
+    // The trailing bracket is optional in the trace-event format, flushing
+    // each frame keeps the file loadable if the application is killed.
+    fs.flush();
+}
+
+
+int CL::Device::chrome_trace_track(const string& queue_name)
+{
+    auto track = _chrome_trace_tracks.find(queue_name);
+
+    if (track != _chrome_trace_tracks.end()) {
+        return track->second;
+    }
+
+    int tid = _chrome_trace_tracks.size() + 1;
+    _chrome_trace_tracks[queue_name] = tid;
+
+    _chrome_trace << "," << endl
+                  << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid << ","
+                  << "\"args\":{\"name\":\"" << queue_name << "\"}}";
+
+    return tid;
 }
 
 
@@ -333,6 +506,26 @@ size_t CL::Device::preferred_work_group_size_multiple() const
 
 
 
+string CL::Device::identifier() const
+{
+    cl_platform_id platform;
+
+    cl_int status = clGetDeviceInfo(_device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, nullptr);
+    OPENCL_ASSERT(status);
+
+    std::stringstream ss;
+
+    ss << get_platform_string(platform, CL_PLATFORM_VERSION) << ";"
+       << get_device_string(_device, CL_DEVICE_VENDOR) << ";"
+       << get_device_string(_device, CL_DEVICE_NAME) << ";"
+       << get_device_string(_device, CL_DEVICE_VERSION) << ";"
+       << get_device_string(_device, CL_DRIVER_VERSION);
+
+    return ss.str();
+}
+
+
+
 bool CL::Device::check_extension(const string& extension_name) const
 {
     return _supported_extensions.count(extension_name) > 0;
@@ -341,6 +534,20 @@ bool CL::Device::check_extension(const string& extension_name) const
 
 
 
+int CL::Device::opencl_c_version() const
+{
+    // Formatted as "OpenCL C <major>.<minor> <vendor specific>"
+    string version = get_device_string(_device, CL_DEVICE_OPENCL_C_VERSION);
+
+    int major = 1, minor = 0;
+    if (sscanf(version.c_str(), "OpenCL C %d.%d", &major, &minor) != 2) {
+        return 100;
+    }
+
+    return major * 100 + minor * 10;
+}
+
+
 void CL::Device::query_extensions()
 {
     const size_t N = 2000;
@@ -459,6 +666,38 @@ namespace
 
 
     
+    string get_device_string(cl_device_id device, cl_device_info param_enum)
+    {
+        size_t size;
+        cl_int status;
+
+        status = clGetDeviceInfo(device, param_enum, 0, NULL, &size);
+        OPENCL_ASSERT(status);
+
+        vector<char> buffer(size);
+        status = clGetDeviceInfo(device, param_enum, size, buffer.data(), NULL);
+        OPENCL_ASSERT(status);
+
+        return string(buffer.data());
+    }
+
+
+    string get_platform_string(cl_platform_id platform, cl_platform_info param_enum)
+    {
+        size_t size;
+        cl_int status;
+
+        status = clGetPlatformInfo(platform, param_enum, 0, NULL, &size);
+        OPENCL_ASSERT(status);
+
+        vector<char> buffer(size);
+        status = clGetPlatformInfo(platform, param_enum, size, buffer.data(), NULL);
+        OPENCL_ASSERT(status);
+
+        return string(buffer.data());
+    }
+
+
     template <typename T> void print_device_param(cl_device_id device,
                                                   cl_device_info param_enum,
                                                   string param_name, 
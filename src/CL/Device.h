@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include <CL/opencl.h>
+#include <fstream>
 #include <set>
 
 #include "Event.h"
@@ -52,10 +53,25 @@ namespace CL
             int dependency_ids[Event::MAX_ID_COUNT];
         };
 
+        struct EventTiming
+        {
+            cl_ulong queued, submit, start, end;
+        };
+
         std::unordered_map<int, EventIndex> _events;
         int _id_count;
+        int _frame_event_id;
         bool _dump_trace;
 
+        // Accumulated start to end time per event name, see collect_event_times
+        std::map<string, uint64_t>* _event_times;
+
+        // Chrome trace-event stream, spans all dumped frames
+        std::ofstream _chrome_trace;
+        std::map<string, int> _chrome_trace_tracks;
+        size_t _chrome_trace_flow_count;
+        size_t _chrome_trace_frame_count;
+
         
     public:
 
@@ -65,21 +81,39 @@ namespace CL
 
         int insert_user_event(const string& name, cl_event event, const Event& dependencies);
         void end_user_event(int id);
+
+        // Marks the user event spanning the current frame in the trace
+        void mark_frame(const Event& frame_event);
         
         void dump_trace();
         void release_events();
 
+        // Adds the duration of all events to times[name] whenever the events
+        // are released, until called with nullptr. Used by the benchmarks.
+        void collect_event_times(std::map<string, uint64_t>* times) { _event_times = times; }
+
         size_t max_compute_units() const;
         size_t preferred_work_group_size_multiple() const;
 
+        // Platform, device and driver versions, identifies compatible program binaries
+        string identifier() const;
+
         bool check_extension(const string& extension_name) const;
 
+        // Highest OpenCL C version the compiler accepts, e.g. 120 or 200
+        int opencl_c_version() const;
+
 
     private:
 
 
         void query_extensions();
 
+        std::unordered_map<int, EventTiming> query_event_timing();
+        void write_text_trace(const std::unordered_map<int, EventTiming>& timing);
+        void write_chrome_trace(const std::unordered_map<int, EventTiming>& timing);
+        int chrome_trace_track(const string& queue_name);
+
         
     };
 }
@@ -7,18 +7,33 @@
 #include "Config.h"
 #include "CLConfig.h"
 
+#include <cstdio>
 #include <fstream>
 #include <iomanip>
+#include <set>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace {
-    cl_program compile_program (CL::Device& device, const string& source, const string& filename);
+    string build_flags(int language_version);
+    cl_program compile_program (CL::Device& device, const string& source, const string& filename,
+                                int language_version);
+    void build_program (CL::Device& device, cl_program program, const string& filename, int language_version);
+
+    string calc_cache_path (CL::Device& device, const string& source, int language_version);
+    void hash_includes (const string& source, std::set<string>& visited, uint64_t& hash);
+    cl_program load_program_binary (CL::Device& device, const string& path, const string& filename,
+                                    int language_version);
+    void store_program_binary (cl_program program, const string& path);
 }
 
 
 
 CL::Program::Program() :
     _program(0),
-    _source_buffer(new std::stringstream())
+    _source_buffer(new std::stringstream()),
+    _language_version(120)
 {
     *_source_buffer << std::setiosflags(std::ios::fixed) << std::setprecision(10);
 }
@@ -70,6 +85,12 @@ void CL::Program::set_constant(const string& name, vec4 value)
                     << value.z << "f, " << value.w <<  "f))" << endl;
 }
 
+void CL::Program::set_language_version(int version)
+{
+    assert(_program == 0);
+    _language_version = version;
+}
+
 void CL::Program::compile(Device& device,  const string& filename)
 {
     assert(_program == 0);
@@ -87,7 +108,20 @@ void CL::Program::compile(Device& device,  const string& filename)
         fs << file_content << endl;
     }
 
-    _program = compile_program(device, file_content, filename);
+    string cache_path;
+
+    if (!cl_config.kernel_cache_dir().empty()) {
+        cache_path = calc_cache_path(device, file_content, _language_version);
+        _program = load_program_binary(device, cache_path, filename, _language_version);
+    }
+
+    if (_program == 0) {
+        _program = compile_program(device, file_content, filename, _language_version);
+
+        if (!cache_path.empty()) {
+            store_program_binary(_program, cache_path);
+        }
+    }
 
     delete _source_buffer;
     _source_buffer = 0;
@@ -102,7 +136,20 @@ CL::Kernel* CL::Program::get_kernel(const string& name)
 
 namespace {
 
-    cl_program compile_program (CL::Device& device, const string& source, const string& filename)
+    string build_flags(int language_version)
+    {
+        std::stringstream ss;
+        ss << "-I. -cl-fast-relaxed-math -cl-std=CL"
+           << language_version / 100 << "." << language_version / 10 % 10
+           << " -cl-mad-enable";
+        ss << " -I" << cl_config.kernel_dir();
+
+        return ss.str();
+    }
+
+    
+    cl_program compile_program (CL::Device& device, const string& source, const string& filename,
+                                int language_version)
     {
         const char* c_content = source.c_str();
         size_t content_size = source.size();
@@ -113,10 +160,18 @@ namespace {
                                                        &c_content, &content_size, &status);
         OPENCL_ASSERT(status);
 
+        build_program(device, program, filename, language_version);
+
+        return program;
+    }
+
+
+    void build_program (CL::Device& device, cl_program program, const string& filename, int language_version)
+    {
+        cl_int status;
         cl_device_id dev = device.get_device();
 
-        string flags = "-I. -cl-fast-relaxed-math -cl-std=CL1.2 -cl-mad-enable";
-        flags += " -I"+cl_config.kernel_dir();
+        string flags = build_flags(language_version);
 
         status = clBuildProgram(program, 1, &dev, flags.c_str(), NULL, NULL);
 
@@ -153,8 +208,147 @@ namespace {
         if (build_status != CL_BUILD_SUCCESS) {
             OPENCL_EXCEPTION("Failed to build program '" + filename + "'");
         }
+    }
+
+
+    // 64 bit FNV-1a
+    void hash_string (const string& str, uint64_t& hash)
+    {
+        for (unsigned char c : str) {
+            hash ^= c;
+            hash *= 0x100000001b3ull;
+        }
+    }
+
+    
+    // The cache key covers the device and driver, the build flags, the
+    // final source and every header it pulls in from the kernel directory.
+    string calc_cache_path (CL::Device& device, const string& source, int language_version)
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;
+
+        hash_string(device.identifier(), hash);
+        hash_string(build_flags(language_version), hash);
+        hash_string(source, hash);
+
+        std::set<string> visited;
+        hash_includes(source, visited, hash);
+
+        std::stringstream ss;
+        ss << cl_config.kernel_cache_dir() << "/"
+           << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+
+        return ss.str();
+    }
+
+    
+    void hash_includes (const string& source, std::set<string>& visited, uint64_t& hash)
+    {
+        std::istringstream lines(source);
+
+        for (string line; std::getline(lines, line); ) {
+            size_t pos = line.find_first_not_of(" \t");
+
+            if (pos == string::npos || line.compare(pos, 8, "#include") != 0) continue;
+
+            size_t begin = line.find('"', pos);
+            size_t end = line.find('"', begin+1);
+
+            if (begin == string::npos || end == string::npos) continue;
+
+            string header = line.substr(begin+1, end-begin-1);
+
+            if (!visited.insert(header).second) continue;
+
+            string content = read_file(cl_config.kernel_dir() + "/" + header);
+
+            hash_string(header, hash);
+            hash_string(content, hash);
+            hash_includes(content, visited, hash);
+        }
+    }
+
+    
+    cl_program load_program_binary (CL::Device& device, const string& path, const string& filename,
+                                    int language_version)
+    {
+        std::ifstream file(path.c_str(), std::ios::binary);
+
+        if (!file) {
+            return 0;
+        }
+
+        string binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+        const unsigned char* c_binary = (const unsigned char*)binary.data();
+        size_t binary_size = binary.size();
+
+        cl_int status, binary_status;
+        cl_device_id dev = device.get_device();
+
+        cl_program program = clCreateProgramWithBinary(device.get_context(), 1, &dev,
+                                                       &binary_size, &c_binary,
+                                                       &binary_status, &status);
+
+        if (status != CL_SUCCESS || binary_status != CL_SUCCESS) {
+            // Stale or foreign binary, rebuild from source and overwrite it
+            if (program != 0) {
+                clReleaseProgram(program);
+            }
+            return 0;
+        }
+
+        try {
+            build_program(device, program, filename, language_version);
+        } catch (CL::Exception& e) {
+            clReleaseProgram(program);
+            return 0;
+        }
+
+        if (config.verbosity_level() > 0) {
+            cout << "Loaded " << filename << " from " << path << endl;
+        }
 
         return program;
     }
 
+    
+    void store_program_binary (cl_program program, const string& path)
+    {
+        size_t binary_size;
+
+        cl_int status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+                                         sizeof(binary_size), &binary_size, NULL);
+        OPENCL_ASSERT(status);
+
+        if (binary_size == 0) {
+            return;
+        }
+
+        vector<unsigned char> binary(binary_size);
+        unsigned char* binary_ptr = binary.data();
+
+        status = clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                                  sizeof(binary_ptr), &binary_ptr, NULL);
+        OPENCL_ASSERT(status);
+
+        mkdir(cl_config.kernel_cache_dir().c_str(), 0755);
+
+        // Write to a private file first, concurrent runs only ever see complete binaries
+        string tmp_path = path + "." + std::to_string(getpid());
+
+        {
+            std::ofstream file(tmp_path.c_str(), std::ios::binary);
+
+            if (!file) {
+                cerr << "Could not write kernel cache file " << tmp_path << endl;
+                return;
+            }
+
+            file.write((const char*)binary.data(), binary.size());
+        }
+
+        std::rename(tmp_path.c_str(), path.c_str());
+    }
+
 }
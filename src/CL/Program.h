@@ -15,6 +15,7 @@ namespace CL
         cl_device_id _device;
         cl_program _program;
         std::stringstream* _source_buffer;
+        int _language_version;
 
         public:
 
@@ -29,6 +30,9 @@ namespace CL
         void set_constant(const string& name, ivec2 value);
         void set_constant(const string& name, vec4 value);
 
+        // OpenCL C version to build with, e.g. 120 or 200
+        void set_language_version(int version);
+
         void compile(Device& device, const string& filename);
 
         Kernel* get_kernel(const string& name);
@@ -20,10 +20,15 @@ namespace Reyes
         size_t patch_count;
         PatchType patch_type;
         CL::Buffer& patch_buffer;
+        CL::Buffer& instance_buffer;
+        size_t instance_patch_count;
         CL::Buffer& patch_ids;
         CL::Buffer& patch_min;
         CL::Buffer& patch_max;
         CL::Event transfer_done;
+
+        // Packed PatchRange::edges per range, only with diagsplit
+        CL::Buffer* patch_edges;
     };
     
     class BoundNSplitCL
@@ -35,7 +40,17 @@ namespace Reyes
         
     public:
 
-        virtual void init(void* patches_handle, const mat4& matrix, const Projection* projection) = 0;
+        /**
+         * Start bound & split of one or more instances of a mesh.
+         * @param instances Modelview matrix of each instance. Patch ids
+         *                  count the patches of all instances, instance
+         *                  after instance.
+         * @param patch_ids Patches to start from, nullptr for all patches
+         *                  of all instances.
+         * @param ready     Earlier batches are no longer diced.
+         */
+        virtual void init(void* patches_handle, const vector<mat4>& instances, const Projection* projection,
+                          const vector<int>* patch_ids, const CL::Event& ready) = 0;
         virtual bool done() = 0;
         virtual void finish() = 0;
 
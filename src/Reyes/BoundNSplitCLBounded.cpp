@@ -1,6 +1,6 @@
 #include "BoundNSplitCLBounded.h"
 
-#include "CL/PrefixSum.h"
+#include "DepthPyramid.h"
 #include "ReyesConfig.h"
 #include "PatchIndex.h"
 #include "PatchType.h"
@@ -24,9 +24,11 @@ struct cl_projection
 
 Reyes::BoundNSplitCLBounded::BoundNSplitCLBounded(CL::Device& device,
                                                   CL::CommandQueue& queue,
-                                                  shared_ptr<PatchIndex>& patch_index)
+                                                  shared_ptr<PatchIndex>& patch_index,
+                                                  shared_ptr<DepthPyramid>& depth_pyramid)
     : _queue(queue)
     , _patch_index(patch_index)
+    , _depth_pyramid(depth_pyramid)
 
     , _pid_stack(device, 0, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
     , _depth_stack(device, 0, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
@@ -40,64 +42,106 @@ Reyes::BoundNSplitCLBounded::BoundNSplitCLBounded(CL::Device& device,
     , _out_maxs_buffer(device, BATCH_SIZE * sizeof(cl_float2) , CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
     , _out_range_cnt_buffer(device, sizeof(cl_int) , CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, "bound&split")
 
-    , _bound_flags(device, BATCH_SIZE * sizeof(cl_uchar), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
-    , _draw_flags(device, BATCH_SIZE * sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
-    , _split_flags(device, BATCH_SIZE * sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
-
-    , _pid_pad(device, BATCH_SIZE * sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
-    , _depth_pad(device, BATCH_SIZE * sizeof(cl_uchar), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
-    , _min_pad(device, BATCH_SIZE * sizeof(cl_float2), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
-    , _max_pad(device, BATCH_SIZE * sizeof(cl_float2), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
+    , _pid_pad(device, 2 * BATCH_SIZE * sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
+    , _depth_pad(device, 2 * BATCH_SIZE * sizeof(cl_uchar), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
+    , _min_pad(device, 2 * BATCH_SIZE * sizeof(cl_float2), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
+    , _max_pad(device, 2 * BATCH_SIZE * sizeof(cl_float2), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
     
     , _projection_buffer(device, sizeof(cl_projection)*2, CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
-
-    , _prefix_sum(device, BATCH_SIZE, "bound&split")
+    , _seed_pids_buffer(device, sizeof(cl_int), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
+    , _instance_buffer(device, sizeof(mat4), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
+    , _split_cache(device)
 
     , _user_event(device, "bound&split")
 {
     _patch_index->enable_load_opencl_buffer(device, queue);
 
+    bool collectives = reyes_config.work_group_collectives() && device.opencl_c_version() >= 200;
+
+    for (CL::Program* program : {&_bound_n_split_program_bezier, &_bound_n_split_program_gregory}) {
+        program->set_constant("WORK_GROUP_COLLECTIVES", (int)collectives);
+        if (collectives) {
+            program->set_language_version(200);
+        }
+    }
     
+    bool cone_culling = reyes_config.normal_cone_culling() && reyes_config.backface_culling();
+
     _bound_n_split_program_bezier.set_constant("BOUND_SAMPLE_RATE", reyes_config.bound_sample_rate());
     _bound_n_split_program_bezier.set_constant("CULL_RIBBON", reyes_config.cull_ribbon());
+    _bound_n_split_program_bezier.set_constant("HULL_BOUNDS", (int)reyes_config.hull_bounds());
+    _bound_n_split_program_bezier.set_constant("NORMAL_CONE_CULLING", (int)cone_culling);
     _bound_n_split_program_bezier.set_constant("MAX_SPLIT_DEPTH", reyes_config.max_split_depth());
+    _bound_n_split_program_bezier.set_constant("PATCH_SIZE", (int)reyes_config.reyes_patch_size());
+    _depth_pyramid->set_constants(_bound_n_split_program_bezier);
+    _split_cache.set_constants(_bound_n_split_program_bezier);
 
     _bound_n_split_program_bezier.define("eval_patch", "eval_bezier_patch");
     _bound_n_split_program_bezier.compile(device, "bound_n_split_multipass.cl");
     
     _bound_n_split_program_gregory.set_constant("BOUND_SAMPLE_RATE", reyes_config.bound_sample_rate());
     _bound_n_split_program_gregory.set_constant("CULL_RIBBON", reyes_config.cull_ribbon());
+    _bound_n_split_program_gregory.set_constant("HULL_BOUNDS", 0);
+    _bound_n_split_program_gregory.set_constant("NORMAL_CONE_CULLING", 0);
     _bound_n_split_program_gregory.set_constant("MAX_SPLIT_DEPTH", reyes_config.max_split_depth());
+    _bound_n_split_program_gregory.set_constant("PATCH_SIZE", (int)reyes_config.reyes_patch_size());
+    _depth_pyramid->set_constants(_bound_n_split_program_gregory);
+    _split_cache.set_constants(_bound_n_split_program_gregory);
 
     _bound_n_split_program_gregory.define("eval_patch", "eval_gregory_patch");
     _bound_n_split_program_gregory.compile(device, "bound_n_split_multipass.cl");
 
     _bound_kernel_bezier.reset(_bound_n_split_program_bezier.get_kernel("bound_kernel"));
     _bound_kernel_gregory.reset(_bound_n_split_program_gregory.get_kernel("bound_kernel"));
-    _move_kernel.reset(_bound_n_split_program_bezier.get_kernel("move"));
+    _push_kernel.reset(_bound_n_split_program_bezier.get_kernel("push_split_ranges"));
     _init_ranges_kernel.reset(_bound_n_split_program_bezier.get_kernel("init_ranges"));
     _init_projection_buffer_kernel.reset(_bound_n_split_program_bezier.get_kernel("init_projection_buffer"));
 
     _ready = CL::Event();
-
-    _ready = _queue.enq_fill_buffer(_bound_flags, (cl_uchar)0, BATCH_SIZE, "Init bound flags buffer", _ready);
-    _ready = _queue.enq_fill_buffer(_draw_flags, (cl_int)0, BATCH_SIZE, "Init bound flags buffer", _ready);
-    _ready = _queue.enq_fill_buffer(_split_flags, (cl_int)0, BATCH_SIZE, "Init bound flags buffer", _ready);
 }
 
 
-void Reyes::BoundNSplitCLBounded::init(void* patches_handle, const mat4& matrix, const Projection* projection)
+void Reyes::BoundNSplitCLBounded::init(void* patches_handle, const vector<mat4>& instances, const Projection* projection,
+                                  const vector<int>* patch_ids, const CL::Event& ready)
 {
     _active_handle = patches_handle;
     _active_patch_buffer = _patch_index->get_opencl_buffer(patches_handle);
-    _active_matrix = matrix;
+    _instance_patch_count = _patch_index->get_patch_count(patches_handle);
     _active_patch_type = _patch_index->get_patch_type(patches_handle);
     
-    size_t patch_count = _patch_index->get_patch_count(patches_handle);
+    size_t patch_count = patch_ids ? patch_ids->size() : _instance_patch_count * instances.size();
+
+    if (patch_ids) {
+        // Only seed with the patches that survived culling of the mesh
+        if (_seed_pids_buffer.get_size() < patch_count * sizeof(cl_int)) {
+            _seed_pids_buffer.resize(patch_count * sizeof(cl_int));
+        }
 
-    size_t stack_size = patch_count + PROCESS_CNT * (MAX_SPLIT_DEPTH-1);
+        _ready = _queue.enq_write_buffer(_seed_pids_buffer, (void*)patch_ids->data(), patch_count * sizeof(cl_int),
+                                         "upload visible patches", _ready);
+    }
+
+    // With the split cache, bound & split starts from the previous frame's leaves
+    size_t range_count = patch_count;
+    if (_split_cache.enabled()) {
+        range_count = _split_cache.count_seeds(_queue, patches_handle, _instance_patch_count * instances.size(),
+                                               _seed_pids_buffer, patch_ids != nullptr, patch_count, _ready);
+    }
+
+    {
+        // Earlier batches may still be diced with the previous instances
+        size_t instance_size = instances.size() * sizeof(mat4);
+        if (_instance_buffer.get_size() < instance_size) {
+            _instance_buffer.resize(instance_size);
+        }
+
+        _ready = _queue.enq_write_buffer(_instance_buffer, (void*)instances.data(), instance_size,
+                                         "upload instances", _ready | ready);
+    }
+
+    size_t stack_size = range_count + PROCESS_CNT * (MAX_SPLIT_DEPTH-1);
     
-    _stack_height = patch_count;
+    _stack_height = range_count;
 
     if (_depth_stack.get_size() < stack_size) {
         _pid_stack.resize(stack_size * sizeof(cl_int));
@@ -120,9 +164,18 @@ void Reyes::BoundNSplitCLBounded::init(void* patches_handle, const mat4& matrix,
         _ready = _queue.enq_kernel(*_init_projection_buffer_kernel, 1,1, "initialize projection buffer", _ready);
     }
 
-    //_queue.finish();
-    _init_ranges_kernel->set_args((cl_int)patch_count, _pid_stack, _depth_stack, _min_stack, _max_stack);
-    _ready = _queue.enq_kernel(*_init_ranges_kernel, round_up_by((int)patch_count, 64), 64, "init patch ranges", _ready);
+    if (_split_cache.enabled()) {
+        _ready = _split_cache.seed_ranges(_queue, _seed_pids_buffer, patch_ids != nullptr, patch_count, _ready);
+
+        _init_ranges_kernel->set_args((cl_int)range_count, _split_cache.pids(), (cl_int)1,
+                                      _split_cache.depths(), _split_cache.mins(), _split_cache.maxs(), (cl_int)1,
+                                      _pid_stack, _depth_stack, _min_stack, _max_stack);
+    } else {
+        _init_ranges_kernel->set_args((cl_int)range_count, _seed_pids_buffer, (cl_int)(patch_ids != nullptr),
+                                      _split_cache.depths(), _split_cache.mins(), _split_cache.maxs(), (cl_int)0,
+                                      _pid_stack, _depth_stack, _min_stack, _max_stack);
+    }
+    _ready = _queue.enq_kernel(*_init_ranges_kernel, round_up_by((int)range_count, 64), 64, "init patch ranges", _ready);
 }
 
 
@@ -138,6 +191,8 @@ void Reyes::BoundNSplitCLBounded::finish()
 {
     _queue.wait_for_events(_ready);
     _ready = CL::Event();    
+
+    _split_cache.finish();
 }
 
 
@@ -145,50 +200,37 @@ Reyes::Batch Reyes::BoundNSplitCLBounded::do_bound_n_split(CL::Event& ready)
 {
     
     //_user_event.begin(CL::Event());
-    CL::Event prefix_sum_ready, mapping_ready;
+    CL::Event mapping_ready;
     
     statistics.update_max_patches(_stack_height);
     
     int batch_size = std::min((int)_stack_height, (int)BATCH_SIZE);
     _stack_height -= batch_size;
 
-    switch(_active_patch_type) {
-    case Reyes::BEZIER:
-        _bound_kernel_bezier->set_args(*_active_patch_buffer,
-                                       batch_size, _stack_height,
-                                       _pid_stack, _depth_stack, _min_stack, _max_stack,
-                                       _bound_flags, _split_flags, _draw_flags,
-                                       _pid_pad, _depth_pad, _min_pad, _max_pad,
-                                       _active_matrix, _projection_buffer, reyes_config.bound_n_split_limit());
-        _ready = _queue.enq_kernel(*_bound_kernel_bezier, round_up_by(batch_size, 64), 64, "bound patches", ready | _ready);
-        break;
-    case Reyes::GREGORY:
-        _bound_kernel_gregory->set_args(*_active_patch_buffer, 
-                                        batch_size, _stack_height,
-                                        _pid_stack, _depth_stack, _min_stack, _max_stack,
-                                        _bound_flags, _split_flags, _draw_flags,
-                                        _pid_pad, _depth_pad, _min_pad, _max_pad,
-                                        _active_matrix, _projection_buffer, reyes_config.bound_n_split_limit());
-        _ready = _queue.enq_kernel(*_bound_kernel_gregory, round_up_by(batch_size, 64), 64, "bound patches", ready | _ready);
-        break;
-    }
+    // The previous batch may still be diced from the out buffers
+    _ready = _queue.enq_fill_buffer(_out_range_cnt_buffer, (cl_int)0, 1, "clear range counts", _ready | ready);
+    _ready = _queue.enq_fill_buffer(_split_ranges_cnt_buffer, (cl_int)0, 1, "clear range counts", _ready);
+
+    // Bound, compaction and scatter of drawn and split ranges in one launch
+    CL::Kernel& bound_kernel = (_active_patch_type == Reyes::GREGORY) ? *_bound_kernel_gregory : *_bound_kernel_bezier;
 
-    prefix_sum_ready = _prefix_sum.apply(batch_size, _queue,
-                                         _split_flags, _split_flags, _split_ranges_cnt_buffer,
-                                         _ready);
-    prefix_sum_ready = _prefix_sum.apply(batch_size, _queue,
-                                         _draw_flags, _draw_flags, _out_range_cnt_buffer,
-                                         prefix_sum_ready);
+    bound_kernel.set_args(*_active_patch_buffer,
+                          batch_size, _stack_height,
+                          _pid_stack, _depth_stack, _min_stack, _max_stack,
+                          _pid_pad, _depth_pad, _min_pad, _max_pad, _split_ranges_cnt_buffer,
+                          _out_pids_buffer, _out_mins_buffer, _out_maxs_buffer, _out_range_cnt_buffer,
+                          _split_cache.leaf_counts(), _split_cache.leaf_ranges(), _split_cache.leaf_depths(),
+                          _instance_buffer, (cl_int)_instance_patch_count, _projection_buffer,
+                          _depth_pyramid->get_buffer(), reyes_config.bound_n_split_limit());
+    _ready = _queue.enq_kernel(bound_kernel, round_up_by(batch_size, 64), 64, "bound patches", _ready);
 
-    mapping_ready = _queue.enq_map_buffer(_out_range_cnt_buffer, CL_MAP_READ, "buffer map", prefix_sum_ready);
+    mapping_ready = _queue.enq_map_buffer(_out_range_cnt_buffer, CL_MAP_READ, "buffer map", _ready);
     mapping_ready = _queue.enq_map_buffer(_split_ranges_cnt_buffer, CL_MAP_READ, "buffer map", mapping_ready);
     
-    _move_kernel->set_args(batch_size, _stack_height,
+    _push_kernel->set_args(_stack_height, _split_ranges_cnt_buffer,
                            _pid_pad, _depth_pad, _min_pad, _max_pad,
-                           _bound_flags, _draw_flags, _split_flags,
-                           _pid_stack, _depth_stack, _min_stack, _max_stack,
-                           _out_pids_buffer, _out_mins_buffer, _out_maxs_buffer);
-    _ready = _queue.enq_kernel(*_move_kernel, round_up_by(batch_size, 64), 64, "split patches", _ready | prefix_sum_ready);
+                           _pid_stack, _depth_stack, _min_stack, _max_stack);
+    _ready = _queue.enq_kernel(*_push_kernel, round_up_by(2 * batch_size, 64), 64, "push split ranges", _ready);
 
 
     statistics.add_bounds(batch_size);
@@ -208,7 +250,7 @@ Reyes::Batch Reyes::BoundNSplitCLBounded::do_bound_n_split(CL::Event& ready)
     //_user_event.end();
     
     return {(size_t)draw_count,
-            _active_patch_type, *_active_patch_buffer,
+            _active_patch_type, *_active_patch_buffer, _instance_buffer, _instance_patch_count,
             _out_pids_buffer, _out_mins_buffer, _out_maxs_buffer,
-            _ready};
+            _ready, nullptr};
 }
@@ -5,6 +5,7 @@
 
 
 #include "BoundNSplitCL.h"
+#include "SplitCacheCL.h"
 
 
 namespace Reyes
@@ -12,6 +13,7 @@ namespace Reyes
 
     
     class PatchIndex;    
+    class DepthPyramid;
 
 
     class BoundNSplitCLBounded : public BoundNSplitCL
@@ -19,19 +21,20 @@ namespace Reyes
 
         CL::CommandQueue& _queue;
         shared_ptr<PatchIndex> _patch_index;
+        shared_ptr<DepthPyramid> _depth_pyramid;
         
         CL::Program _bound_n_split_program_bezier;
         CL::Program _bound_n_split_program_gregory;
 
         shared_ptr<CL::Kernel> _bound_kernel_bezier;
         shared_ptr<CL::Kernel> _bound_kernel_gregory;
-        shared_ptr<CL::Kernel> _move_kernel;
+        shared_ptr<CL::Kernel> _push_kernel;
         shared_ptr<CL::Kernel> _init_ranges_kernel;
         shared_ptr<CL::Kernel> _init_projection_buffer_kernel;
         
         void* _active_handle;
         CL::Buffer* _active_patch_buffer;
-        mat4 _active_matrix;
+        size_t _instance_patch_count;
         PatchType _active_patch_type;
         int _stack_height;
         
@@ -47,20 +50,19 @@ namespace Reyes
         CL::Buffer _out_maxs_buffer;
         CL::TransferBuffer _out_range_cnt_buffer;
 
-        CL::Buffer _bound_flags;
-        CL::Buffer _draw_flags;
-        CL::Buffer _split_flags;
-        
+        // Halves of split ranges, until they are pushed back onto the stack
         CL::Buffer _pid_pad;
         CL::Buffer _depth_pad;
         CL::Buffer _min_pad;
         CL::Buffer _max_pad;
 
         CL::Buffer _projection_buffer;
+        CL::Buffer _seed_pids_buffer;
+        CL::Buffer _instance_buffer;
 
-        CL::Event _ready;
+        SplitCacheCL _split_cache;
 
-        CL::PrefixSum _prefix_sum;
+        CL::Event _ready;
 
         CL::UserEvent _user_event;
         
@@ -68,11 +70,13 @@ namespace Reyes
 
         
         BoundNSplitCLBounded(CL::Device& device, CL::CommandQueue& queue,
-                             shared_ptr<PatchIndex>& patch_index);
+                             shared_ptr<PatchIndex>& patch_index,
+                             shared_ptr<DepthPyramid>& depth_pyramid);
         
 
         virtual void init(void* patches_handle,
-                          const mat4& matrix, const Projection* projection);
+                          const vector<mat4>& instances, const Projection* projection,
+                          const vector<int>* patch_ids, const CL::Event& ready);
         virtual bool done();
         virtual void finish();
 
@@ -1,6 +1,7 @@
 #include "BoundNSplitCLBreadth.h"
 
 #include "CL/PrefixSum.h"
+#include "DepthPyramid.h"
 #include "ReyesConfig.h"
 #include "PatchIndex.h"
 #include "Statistics.h"
@@ -74,9 +75,11 @@ void Reyes::BoundNSplitCLBreadth::FlagBuffer::grow_to(size_t new_size)
 
 Reyes::BoundNSplitCLBreadth::BoundNSplitCLBreadth(CL::Device& device,
                                                   CL::CommandQueue& queue,
-                                                  shared_ptr<PatchIndex>& patch_index)
+                                                  shared_ptr<PatchIndex>& patch_index,
+                                                  shared_ptr<DepthPyramid>& depth_pyramid)
     : _queue(queue)
     , _patch_index(patch_index)
+    , _depth_pyramid(depth_pyramid)
 
     , _read_buffers(new PatchBuffer(device))
     , _write_buffers(new PatchBuffer(device))
@@ -91,6 +94,9 @@ Reyes::BoundNSplitCLBreadth::BoundNSplitCLBreadth(CL::Device& device,
     , _out_range_cnt_buffer(device, sizeof(cl_int) , CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, "bound&split")
 
     , _projection_buffer(device, sizeof(cl_projection), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
+    , _seed_pids_buffer(device, sizeof(cl_int), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
+    , _instance_buffer(device, sizeof(mat4), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
+    , _split_cache(device)
 
     , _user_event(device, "bound&split")
 {
@@ -98,16 +104,28 @@ Reyes::BoundNSplitCLBreadth::BoundNSplitCLBreadth(CL::Device& device,
 
 
     
+    bool cone_culling = reyes_config.normal_cone_culling() && reyes_config.backface_culling();
+
     _bound_n_split_program_bezier.set_constant("BOUND_SAMPLE_RATE", reyes_config.bound_sample_rate());
     _bound_n_split_program_bezier.set_constant("CULL_RIBBON", reyes_config.cull_ribbon());
+    _bound_n_split_program_bezier.set_constant("HULL_BOUNDS", (int)reyes_config.hull_bounds());
+    _bound_n_split_program_bezier.set_constant("NORMAL_CONE_CULLING", (int)cone_culling);
     _bound_n_split_program_bezier.set_constant("MAX_SPLIT_DEPTH", reyes_config.max_split_depth());
+    _bound_n_split_program_bezier.set_constant("PATCH_SIZE", (int)reyes_config.reyes_patch_size());
+    _depth_pyramid->set_constants(_bound_n_split_program_bezier);
+    _split_cache.set_constants(_bound_n_split_program_bezier);
 
     _bound_n_split_program_bezier.define("eval_patch", "eval_bezier_patch");
     _bound_n_split_program_bezier.compile(device, "bound_n_split_breadthfirst.cl");
     
     _bound_n_split_program_gregory.set_constant("BOUND_SAMPLE_RATE", reyes_config.bound_sample_rate());
     _bound_n_split_program_gregory.set_constant("CULL_RIBBON", reyes_config.cull_ribbon());
+    _bound_n_split_program_gregory.set_constant("HULL_BOUNDS", 0);
+    _bound_n_split_program_gregory.set_constant("NORMAL_CONE_CULLING", 0);
     _bound_n_split_program_gregory.set_constant("MAX_SPLIT_DEPTH", reyes_config.max_split_depth());
+    _bound_n_split_program_gregory.set_constant("PATCH_SIZE", (int)reyes_config.reyes_patch_size());
+    _depth_pyramid->set_constants(_bound_n_split_program_gregory);
+    _split_cache.set_constants(_bound_n_split_program_gregory);
 
     _bound_n_split_program_gregory.define("eval_patch", "eval_gregory_patch");
     _bound_n_split_program_gregory.compile(device, "bound_n_split_breadthfirst.cl");
@@ -123,14 +141,43 @@ Reyes::BoundNSplitCLBreadth::BoundNSplitCLBreadth(CL::Device& device,
 }
 
 
-void Reyes::BoundNSplitCLBreadth::init(void* patches_handle, const mat4& matrix, const Projection* projection)
+void Reyes::BoundNSplitCLBreadth::init(void* patches_handle, const vector<mat4>& instances, const Projection* projection,
+                                  const vector<int>* patch_ids, const CL::Event& ready)
 {
     _active_handle = patches_handle;
     _active_patch_buffer = _patch_index->get_opencl_buffer(patches_handle);
-    _active_matrix = matrix;
+    _instance_patch_count = _patch_index->get_patch_count(patches_handle);
     _active_patch_type = _patch_index->get_patch_type(patches_handle);
 
-    _patch_count = _patch_index->get_patch_count(patches_handle);
+    size_t patch_count = patch_ids ? patch_ids->size() : _instance_patch_count * instances.size();
+
+    if (patch_ids) {
+        // Only seed with the patches that survived culling of the mesh
+        if (_seed_pids_buffer.get_size() < patch_count * sizeof(cl_int)) {
+            _seed_pids_buffer.resize(patch_count * sizeof(cl_int));
+        }
+
+        _ready = _queue.enq_write_buffer(_seed_pids_buffer, (void*)patch_ids->data(), patch_count * sizeof(cl_int),
+                                         "upload visible patches", _ready);
+    }
+
+    // With the split cache, bound & split starts from the previous frame's leaves
+    _patch_count = patch_count;
+    if (_split_cache.enabled()) {
+        _patch_count = _split_cache.count_seeds(_queue, patches_handle, _instance_patch_count * instances.size(),
+                                                _seed_pids_buffer, patch_ids != nullptr, patch_count, _ready);
+    }
+
+    {
+        // Earlier batches may still be diced with the previous instances
+        size_t instance_size = instances.size() * sizeof(mat4);
+        if (_instance_buffer.get_size() < instance_size) {
+            _instance_buffer.resize(instance_size);
+        }
+
+        _ready = _queue.enq_write_buffer(_instance_buffer, (void*)instances.data(), instance_size,
+                                         "upload instances", _ready | ready);
+    }
     
     {
         // TODO: Redo this only when projection has changed
@@ -147,9 +194,18 @@ void Reyes::BoundNSplitCLBreadth::init(void* patches_handle, const mat4& matrix,
     }
 
     _read_buffers->grow_to(_patch_count);
-    
-    _init_ranges_kernel->set_args((cl_int)_patch_count,
-                                  _read_buffers->pids, _read_buffers->depths, _read_buffers->mins, _read_buffers->maxs);
+
+    if (_split_cache.enabled()) {
+        _ready = _split_cache.seed_ranges(_queue, _seed_pids_buffer, patch_ids != nullptr, patch_count, _ready);
+
+        _init_ranges_kernel->set_args((cl_int)_patch_count, _split_cache.pids(), (cl_int)1,
+                                      _split_cache.depths(), _split_cache.mins(), _split_cache.maxs(), (cl_int)1,
+                                      _read_buffers->pids, _read_buffers->depths, _read_buffers->mins, _read_buffers->maxs);
+    } else {
+        _init_ranges_kernel->set_args((cl_int)_patch_count, _seed_pids_buffer, (cl_int)(patch_ids != nullptr),
+                                      _split_cache.depths(), _split_cache.mins(), _split_cache.maxs(), (cl_int)0,
+                                      _read_buffers->pids, _read_buffers->depths, _read_buffers->mins, _read_buffers->maxs);
+    }
     _ready = _queue.enq_kernel(*_init_ranges_kernel, round_up_by((int)_patch_count, 64), 64, "init patch ranges", _ready);
 }
 
@@ -164,6 +220,8 @@ void Reyes::BoundNSplitCLBreadth::finish()
 {
     _queue.wait_for_events(_ready);
     _ready = CL::Event();    
+
+    _split_cache.finish();
 }
 
 
@@ -198,14 +256,18 @@ Reyes::Batch Reyes::BoundNSplitCLBreadth::do_bound_n_split(CL::Event& ready)
         _bound_kernel_bezier->set_args(*_active_patch_buffer, _patch_count,
                                        _read_buffers->pids, _read_buffers->depths, _read_buffers->mins, _read_buffers->maxs,
                                        _flag_buffers.bound_flags, _flag_buffers.split_flags, _flag_buffers.draw_flags,
-                                       _active_matrix, _projection_buffer, reyes_config.bound_n_split_limit());
+                                       _split_cache.leaf_counts(), _split_cache.leaf_ranges(), _split_cache.leaf_depths(),
+                          _instance_buffer, (cl_int)_instance_patch_count, _projection_buffer,
+                                       _depth_pyramid->get_buffer(), reyes_config.bound_n_split_limit());
         _ready = _queue.enq_kernel(*_bound_kernel_bezier, round_up_by(_patch_count, 64), 64, "bound patches", ready | _ready);
         break;
     case Reyes::GREGORY:
         _bound_kernel_gregory->set_args(*_active_patch_buffer, _patch_count,
                                         _read_buffers->pids, _read_buffers->depths, _read_buffers->mins, _read_buffers->maxs,
                                         _flag_buffers.bound_flags, _flag_buffers.split_flags, _flag_buffers.draw_flags,
-                                        _active_matrix, _projection_buffer, reyes_config.bound_n_split_limit());
+                                        _split_cache.leaf_counts(), _split_cache.leaf_ranges(), _split_cache.leaf_depths(),
+                          _instance_buffer, (cl_int)_instance_patch_count, _projection_buffer,
+                                       _depth_pyramid->get_buffer(), reyes_config.bound_n_split_limit());
         _ready = _queue.enq_kernel(*_bound_kernel_gregory, round_up_by(_patch_count, 64), 64, "bound patches", ready | _ready);
         break;
     }
@@ -250,7 +312,7 @@ Reyes::Batch Reyes::BoundNSplitCLBreadth::do_bound_n_split(CL::Event& ready)
     std::swap(_read_buffers, _write_buffers);
     
     return {reyes_config.dummy_render() ? 0 : (size_t)draw_count,
-            _active_patch_type, *_active_patch_buffer,
+            _active_patch_type, *_active_patch_buffer, _instance_buffer, _instance_patch_count,
             _out_pids_buffer, _out_mins_buffer, _out_maxs_buffer,
-            _ready};
+            _ready, nullptr};
 }
@@ -5,6 +5,7 @@
 
 
 #include "BoundNSplitCL.h"
+#include "SplitCacheCL.h"
 
 
 namespace Reyes
@@ -12,6 +13,7 @@ namespace Reyes
 
     
     class PatchIndex;    
+    class DepthPyramid;
 
 
     class BoundNSplitCLBreadth : public BoundNSplitCL
@@ -49,7 +51,7 @@ namespace Reyes
         
         void* _active_handle;
         CL::Buffer* _active_patch_buffer;
-        mat4 _active_matrix;
+        size_t _instance_patch_count;
         PatchType _active_patch_type;
         
         int _patch_count;
@@ -62,6 +64,7 @@ namespace Reyes
 
         CL::CommandQueue& _queue;
         shared_ptr<PatchIndex> _patch_index;
+        shared_ptr<DepthPyramid> _depth_pyramid;
         
         shared_ptr<PatchBuffer> _read_buffers;
         shared_ptr<PatchBuffer> _write_buffers;
@@ -76,6 +79,10 @@ namespace Reyes
         CL::TransferBuffer _out_range_cnt_buffer;
 
         CL::Buffer _projection_buffer;
+        CL::Buffer _seed_pids_buffer;
+        CL::Buffer _instance_buffer;
+
+        SplitCacheCL _split_cache;
 
         CL::Event _ready;
 
@@ -86,11 +93,13 @@ namespace Reyes
 
         
         BoundNSplitCLBreadth(CL::Device& device, CL::CommandQueue& queue,
-                             shared_ptr<PatchIndex>& patch_index);
+                             shared_ptr<PatchIndex>& patch_index,
+                             shared_ptr<DepthPyramid>& depth_pyramid);
         
 
         virtual void init(void* patches_handle,
-                          const mat4& matrix, const Projection* projection);
+                          const vector<mat4>& instances, const Projection* projection,
+                          const vector<int>* patch_ids, const CL::Event& ready);
         virtual bool done();
         virtual void finish();
 
@@ -6,7 +6,6 @@
 #include "Statistics.h"
 
 
-
 Reyes::BoundNSplitCLCPU::BoundNSplitCLCPU(CL::Device& device,
                                           CL::CommandQueue& queue,
                                           shared_ptr<PatchIndex>& patch_index)
@@ -14,43 +13,43 @@ Reyes::BoundNSplitCLCPU::BoundNSplitCLCPU(CL::Device& device,
     , _patch_index(patch_index)
     , _active_handle(nullptr)
     , _active_patch_buffer(nullptr)
-    , _patch_type(Reyes::BEZIER)
+    , _threads(reyes_config.cpu_bns_threads())
+    , _bound_n_split(_threads, *_patch_index)
+    , _ranges(reyes_config.reyes_patches_per_pass())
+    , _dice_levels(reyes_config.reyes_patches_per_pass())
+    , _instance_buffer(device, sizeof(mat4), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
     , _bound_n_split_event(device, "CPU bound & split")
     , _next_batch_record(0)
 {
-    _patch_index->enable_retain_vector();
     _patch_index->enable_load_opencl_buffer(device, queue);
 
-
     for (int i : irange(0, reyes_config.bns_pipeline_length())) {
         _batch_records.emplace_back(reyes_config.reyes_patches_per_pass(), device, queue);
     }
 }
 
 
-void Reyes::BoundNSplitCLCPU::init(void* patches_handle, const mat4& matrix, const Projection* projection)
+void Reyes::BoundNSplitCLCPU::init(void* patches_handle, const vector<mat4>& instances, const Projection* projection,
+                                  const vector<int>* patch_ids, const CL::Event& ready)
 {
     statistics.start_bound_n_split();
     
     _active_handle = patches_handle;
     _active_patch_buffer = _patch_index->get_opencl_buffer(patches_handle);
-    
-    size_t patch_count = _patch_index->get_patch_count(_active_handle);
-    PatchType patch_type = _patch_index->get_patch_type(_active_handle);
-    
-    _stack.resize(patch_count);
-    for (size_t i = 0; i < patch_count; ++i) {
-        _stack[i] = PatchRange{Bound(0,0,1,1), 0, i};
+
+    // The upload still reads the host copy of the previous instances
+    _queue.wait_for_events(_instances_uploaded);
+
+    _bound_n_split.init(patches_handle, instances, projection, patch_ids);
+
+    const vector<mat4>& host_instances = _bound_n_split.instances();
+    size_t instance_size = host_instances.size() * sizeof(mat4);
+    if (_instance_buffer.get_size() < instance_size) {
+        _instance_buffer.resize(instance_size);
     }
 
-    _projection = projection;
-    
-    mat4 proj;
-    _projection->calc_projection_with_aspect_correction(proj);
-    
-    _mvp = proj * matrix;
-    _mv = matrix;
-    _patch_type = patch_type;
+    _instances_uploaded = _queue.enq_write_buffer(_instance_buffer, (void*)host_instances.data(), instance_size,
+                                                  "upload instances", ready);
 
     statistics.stop_bound_n_split();
 }
@@ -58,9 +57,7 @@ void Reyes::BoundNSplitCLCPU::init(void* patches_handle, const mat4& matrix, con
 
 bool Reyes::BoundNSplitCLCPU::done()
 {
-    if (_stack.size() > 0) return false;
-
-    return true;
+    return _bound_n_split.done();
 }
 
 void Reyes::BoundNSplitCLCPU::finish()
@@ -69,6 +66,8 @@ void Reyes::BoundNSplitCLCPU::finish()
         record.finish(_queue);
     }
     _next_batch_record = 0;
+
+    _bound_n_split.finish();
 }
 
 
@@ -86,76 +85,32 @@ Reyes::Batch Reyes::BoundNSplitCLCPU::do_bound_n_split(CL::Event& ready)
     _bound_n_split_event.begin(waited_for);
     statistics.start_bound_n_split();
     
-    const vector<vec3>& patches = _patch_index->get_patch_vector(_active_handle);
-    PatchType type = _patch_index->get_patch_type(_active_handle);
-    
-    size_t patch_count = 0;
+    size_t patch_count = _bound_n_split.run(_ranges.data(), _dice_levels.data(), _ranges.size());
+
     int*  pids = record.patch_ids.host_ptr<int>();
     vec2* mins = record.patch_min.host_ptr<vec2>();
     vec2* maxs = record.patch_max.host_ptr<vec2>();
-    
-    BBox box;
-    float vlen, hlen;
-
-    float s = reyes_config.bound_n_split_limit();
-
-    while (!_stack.empty()) {
-
-        PatchRange r = _stack.back();
-        _stack.pop_back();
-
-        switch (type) {
-        case BEZIER:
-            bound_patch_range(r, *((BezierPatch*)&patches[16*r.patch_id]), _mv, _mvp, box, vlen, hlen);
-            break;
-        case GREGORY:
-            bound_gregory_patch_range(r, &patches[20*r.patch_id], _mv, _mvp, box, vlen, hlen);
-            break;
-         
-        }
-
-        vec2 size;
-        bool cull;
-        _projection->bound(box, size, cull);
-
-        if (cull) continue;
-
-        if (box.min.z < 0 && size.x < s && size.y < s) {
-            
-            const Bound& pr = r.range;
-            const size_t pid = r.patch_id;
-
-            pids[patch_count] = pid;
-            mins[patch_count] = r.range.min;
-            maxs[patch_count] = r.range.max;
-            
-            ++patch_count;
-            statistics.inc_patch_count();
-            
-            if (patch_count >= reyes_config.reyes_patches_per_pass()) {
-                break; // buffer full, end this batch
-            }
-
-        } else if (r.depth > reyes_config.max_split_depth()) {
-            // TODO: Add low-overhead warning mechanism for this
-            // cout << "Warning: Split limit reached" << endl
-        } else {
-            if (vlen < hlen) {
-                vsplit_range(r, _stack);
-            } else {
-                hsplit_range(r, _stack);
-            }
-        }
+    unsigned* edges = record.patch_edges.host_ptr<unsigned>();
 
+    for (size_t i = 0; i < patch_count; ++i) {
+        // Pack the dicing rate like bound_n_split.h does
+        pids[i] = _ranges[i].patch_id | (_dice_levels[i] << 24);
+        mins[i] = _ranges[i].range.min;
+        maxs[i] = _ranges[i].range.max;
+        edges[i] = _ranges[i].edges;
     }
 
-    record.transfer(_queue, patch_count, CL::Event());
+    statistics.add_patches(patch_count);
+
+    record.transfer(_queue, patch_count, _instances_uploaded);
     
     statistics.stop_bound_n_split();
     _bound_n_split_event.end();
     
-    return {reyes_config.dummy_render() ? 0 : patch_count, _patch_type,
-            *_active_patch_buffer, record.patch_ids, record.patch_min, record.patch_max, record.transferred};
+    return {reyes_config.dummy_render() ? 0 : patch_count, _bound_n_split.patch_type(),
+            *_active_patch_buffer, _instance_buffer, _bound_n_split.instance_patch_count(),
+            record.patch_ids, record.patch_min, record.patch_max, record.transferred,
+            reyes_config.diagsplit() ? &record.patch_edges : nullptr};
 }
 
 
@@ -164,6 +119,7 @@ Reyes::BoundNSplitCLCPU::BatchRecord::BatchRecord(size_t batch_size, CL::Device&
     , patch_ids(device, batch_size * sizeof(int), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
     , patch_min(device, batch_size * sizeof(vec2), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
     , patch_max(device, batch_size * sizeof(vec2), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
+    , patch_edges(device, batch_size * sizeof(unsigned), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
     , transferred()
     , rasterizer_done()
 {
@@ -176,6 +132,7 @@ Reyes::BoundNSplitCLCPU::BatchRecord::BatchRecord(BatchRecord&& other)
     , patch_ids(std::move(other.patch_ids))
     , patch_min(std::move(other.patch_min))
     , patch_max(std::move(other.patch_max))
+    , patch_edges(std::move(other.patch_edges))
     , transferred(std::move(other.transferred))
     , rasterizer_done(std::move(other.rasterizer_done))
 {
@@ -185,17 +142,22 @@ Reyes::BoundNSplitCLCPU::BatchRecord::BatchRecord(BatchRecord&& other)
 
 void Reyes::BoundNSplitCLCPU::BatchRecord::transfer(CL::CommandQueue& queue, size_t patch_count, const CL::Event& events)
 {
-    CL::Event a,b,c;
+    CL::Event a,b,c,d;
 
     if (patch_count > 0) {
         a = queue.enq_write_buffer(patch_ids, patch_ids.void_ptr(), patch_count * sizeof(int), "write patch data" , events);
         b = queue.enq_write_buffer(patch_min, patch_min.void_ptr(), patch_count * sizeof(vec2), "write patch data", events);
         c = queue.enq_write_buffer(patch_max, patch_max.void_ptr(), patch_count * sizeof(vec2), "write patch data", events);
 
+        if (reyes_config.diagsplit()) {
+            d = queue.enq_write_buffer(patch_edges, patch_edges.void_ptr(), patch_count * sizeof(unsigned),
+                                       "write patch data", events);
+        }
+
         //queue.flush();
         status = SET_UP;
     }
-    transferred = a|b|c;
+    transferred = a|b|c|d;
 }
 
 
@@ -226,111 +188,3 @@ CL::Event Reyes::BoundNSplitCLCPU::BatchRecord::finish(CL::CommandQueue& queue)
 
     return waited_for;
 }
-
-
-void Reyes::BoundNSplitCLCPU::vsplit_range(const PatchRange& r, vector<PatchRange>& stack)
-{
-    float cy = (r.range.min.y + r.range.max.y) * 0.5f;
-
-    stack.emplace_back(r.range.min.x, r.range.min.y, r.range.max.x, cy,    r.depth + 1, r.patch_id);
-    stack.emplace_back(r.range.min.x, cy, r.range.max.x, r.range.max.y,    r.depth + 1, r.patch_id);
-}
-    
-void Reyes::BoundNSplitCLCPU::hsplit_range(const PatchRange& r, vector<PatchRange>& stack)
-{
-    float cx = (r.range.min.x + r.range.max.x) * 0.5f;
-    
-    stack.emplace_back(r.range.min.x, r.range.min.y, cx, r.range.max.y,    r.depth + 1, r.patch_id);   
-    stack.emplace_back(cx, r.range.min.y, r.range.max.x, r.range.max.y,    r.depth + 1, r.patch_id); 
-}
-
-
-
-void Reyes::BoundNSplitCLCPU::bound_patch_range (const PatchRange& r, const BezierPatch& p,
-                                                 const mat4& mv, const mat4& mvp,
-                                                 BBox& box, float& vlen, float& hlen)
-{
-    const size_t RES = 3;
-        
-    //vec2 pp[RES][RES];
-    vec3 ps[RES][RES];
-    vec3 pos;
-     
-    box.clear();
-        
-    for (size_t iu = 0; iu < RES; ++iu) {
-        for (size_t iv = 0; iv < RES; ++iv) {
-            float v = r.range.min.x + (r.range.max.x - r.range.min.x) * iu * (1.0f / (RES-1));
-            float u = r.range.min.y + (r.range.max.y - r.range.min.y) * iv * (1.0f / (RES-1));
-
-            eval_patch(p, u, v, pos);
-
-            vec3 pt = vec3(mv * vec4(pos,1));
-                
-            box.add_point(pt);
-
-            // pp[iu][iv] = project(mvp * vec4(pos,1));
-            ps[iu][iv] = pt;
-        }
-    }
-
-    vlen = 0;
-    hlen = 0;
-
-    for (size_t i = 0; i < RES; ++i) {
-        float h = 0, v = 0;
-        for (size_t j = 0; j < RES-1; ++j) {
-            // v += glm::distance(pp[j][i], pp[j+1][i]);
-            // h += glm::distance(pp[i][j], pp[i][j+1]);
-            v += glm::distance(ps[j][i], ps[j+1][i]);
-            h += glm::distance(ps[i][j], ps[i][j+1]);
-        }
-        vlen = maximum(v, vlen);
-        hlen = maximum(h, hlen);
-    }
-}
-
-
-void Reyes::BoundNSplitCLCPU::bound_gregory_patch_range (const PatchRange& r, const vec3* p,
-                                                         const mat4& mv, const mat4& mvp,
-                                                         BBox& box, float& vlen, float& hlen)
-{
-    const size_t RES = 3;
-        
-    //vec2 pp[RES][RES];
-    vec3 ps[RES][RES];
-    vec3 pos;
-     
-    box.clear();
-        
-    for (size_t iu = 0; iu < RES; ++iu) {
-        for (size_t iv = 0; iv < RES; ++iv) {
-            float v = r.range.min.x + (r.range.max.x - r.range.min.x) * iu * (1.0f / (RES-1));
-            float u = r.range.min.y + (r.range.max.y - r.range.min.y) * iv * (1.0f / (RES-1));
-
-            eval_gregory_patch(p, u, v, pos);
-
-            vec3 pt = vec3(mv * vec4(pos,1));
-                
-            box.add_point(pt);
-
-            // pp[iu][iv] = project(mvp * vec4(pos,1));
-            ps[iu][iv] = pt;
-        }
-    }
-
-    vlen = 0;
-    hlen = 0;
-
-    for (size_t i = 0; i < RES; ++i) {
-        float h = 0, v = 0;
-        for (size_t j = 0; j < RES-1; ++j) {
-            // v += glm::distance(pp[j][i], pp[j+1][i]);
-            // h += glm::distance(pp[i][j], pp[i][j+1]);
-            v += glm::distance(ps[j][i], ps[j+1][i]);
-            h += glm::distance(ps[i][j], ps[i][j+1]);
-        }
-        vlen = maximum(v, vlen);
-        hlen = maximum(h, hlen);
-    }
-}
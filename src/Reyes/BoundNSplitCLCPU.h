@@ -3,6 +3,8 @@
 #include "common.h"
 
 #include "BoundNSplitCL.h"
+#include "BoundNSplitCPU.h"
+#include "ThreadPool.h"
 
 
 namespace Reyes
@@ -21,12 +23,16 @@ namespace Reyes
 
         void* _active_handle;
         CL::Buffer* _active_patch_buffer;
-        vector<PatchRange> _stack;
 
-        mat4 _mv;
-        mat4 _mvp;
-        const Projection* _projection;
-        PatchType _patch_type;
+        ThreadPool _threads;
+        BoundNSplitCPU _bound_n_split;
+
+        // Output of _bound_n_split, packed into a BatchRecord
+        vector<PatchRange> _ranges;
+        vector<int> _dice_levels;
+
+        CL::Buffer _instance_buffer;
+        CL::Event _instances_uploaded;
 
         
     public:
@@ -36,7 +42,8 @@ namespace Reyes
                              shared_ptr<PatchIndex>& patch_index);
 
         virtual void init(void* patches_handle,
-                          const mat4& matrix, const Projection* projection);
+                          const vector<mat4>& instances, const Projection* projection,
+                          const vector<int>* patch_ids, const CL::Event& ready);
         virtual bool done();
         virtual void finish();
 
@@ -62,6 +69,7 @@ namespace Reyes
             CL::TransferBuffer patch_ids;
             CL::TransferBuffer patch_min;
             CL::TransferBuffer patch_max;
+            CL::TransferBuffer patch_edges;
             
             CL::Event transferred;
             CL::Event rasterizer_done;
@@ -80,20 +88,6 @@ namespace Reyes
         vector<BatchRecord> _batch_records;
         size_t _next_batch_record;
 
-
-    private:
-
-        
-        static void vsplit_range(const PatchRange& r, vector<PatchRange>& stack);
-        static void hsplit_range(const PatchRange& r, vector<PatchRange>& stack);
-        static void bound_patch_range (const PatchRange& r, const BezierPatch& p,
-                                       const mat4& mv, const mat4& mvp,
-                                       BBox& box, float& vlen, float& hlen);
-        static void bound_gregory_patch_range (const PatchRange& r, const vec3* p,
-                                               const mat4& mv, const mat4& mvp,
-                                               BBox& box, float& vlen, float& hlen);
-
-        
     };
 
     
@@ -1,6 +1,7 @@
 #include "BoundNSplitCLLocal.h"
 
 
+#include "DepthPyramid.h"
 #include "PatchIndex.h"
 #include "ReyesConfig.h"
 #include "Statistics.h"
@@ -25,9 +26,12 @@ struct cl_projection
 
 Reyes::BoundNSplitCLLocal::BoundNSplitCLLocal(CL::Device& device,
                                               CL::CommandQueue& queue,
-                                              shared_ptr<PatchIndex>& patch_index)
+                                              shared_ptr<PatchIndex>& patch_index,
+                                              shared_ptr<DepthPyramid>& depth_pyramid,
+                                              bool work_stealing)
     : _queue(queue)
     , _patch_index(patch_index)
+    , _depth_pyramid(depth_pyramid)
 
     , _active_handle(nullptr)
     , _active_patch_buffer(nullptr)
@@ -46,7 +50,14 @@ Reyes::BoundNSplitCLLocal::BoundNSplitCLLocal(CL::Device& device,
 
     , _processed_count_buffer(device, WORK_GROUP_CNT * sizeof(int), CL_MEM_READ_WRITE, "bound&split")
 
+    , _work_stealing(work_stealing)
+    , _queue_locks_buffer(device, WORK_GROUP_CNT * sizeof(int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
+    , _idle_count_buffer(device, sizeof(int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "bound&split")
+
     , _projection_buffer(device, sizeof(cl_projection), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
+    , _seed_pids_buffer(device, sizeof(cl_int), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
+    , _instance_buffer(device, sizeof(mat4), CL_MEM_READ_ONLY | CL_MEM_HOST_WRITE_ONLY, "bound&split")
+    , _split_cache(device)
 {
     _patch_index->enable_load_opencl_buffer(device, queue);
 
@@ -57,8 +68,19 @@ Reyes::BoundNSplitCLLocal::BoundNSplitCLLocal(CL::Device& device,
         program->set_constant("BOUND_SAMPLE_RATE", reyes_config.bound_sample_rate());
         program->set_constant("CULL_RIBBON", reyes_config.cull_ribbon());
         program->set_constant("MAX_SPLIT_DEPTH", reyes_config.max_split_depth());
+        program->set_constant("PATCH_SIZE", (int)reyes_config.reyes_patch_size());
+        program->set_constant("WORK_STEALING", (int)_work_stealing);
+        _depth_pyramid->set_constants(*program);
+        _split_cache.set_constants(*program);
     }
 
+    bool cone_culling = reyes_config.normal_cone_culling() && reyes_config.backface_culling();
+
+    // Gregory patches have no de Casteljau subdivision, always sample them
+    _bound_n_split_program_bezier.set_constant("HULL_BOUNDS", (int)reyes_config.hull_bounds());
+    _bound_n_split_program_bezier.set_constant("NORMAL_CONE_CULLING", (int)cone_culling);
+    _bound_n_split_program_gregory.set_constant("HULL_BOUNDS", 0);
+    _bound_n_split_program_gregory.set_constant("NORMAL_CONE_CULLING", 0);
 
     _bound_n_split_program_bezier.define("eval_patch", "eval_bezier_patch");
     _bound_n_split_program_bezier.compile(device, "bound_n_split_local.cl");
@@ -75,20 +97,54 @@ Reyes::BoundNSplitCLLocal::BoundNSplitCLLocal(CL::Device& device,
 }
 
 
-void Reyes::BoundNSplitCLLocal::init(void* patches_handle, const mat4& matrix, const Projection* projection)
+void Reyes::BoundNSplitCLLocal::init(void* patches_handle, const vector<mat4>& instances, const Projection* projection,
+                                  const vector<int>* patch_ids, const CL::Event& ready)
 {
     _active_handle = patches_handle;
     _active_patch_buffer = _patch_index->get_opencl_buffer(patches_handle);
-    _active_matrix = matrix;
+    _instance_patch_count = _patch_index->get_patch_count(patches_handle);
     _active_patch_type = _patch_index->get_patch_type(patches_handle);
     
-    size_t patch_count = _patch_index->get_patch_count(patches_handle);
+    size_t patch_count = patch_ids ? patch_ids->size() : _instance_patch_count * instances.size();
+
+    if (patch_ids) {
+        // Only seed with the patches that survived culling of the mesh
+        if (_seed_pids_buffer.get_size() < patch_count * sizeof(cl_int)) {
+            _seed_pids_buffer.resize(patch_count * sizeof(cl_int));
+        }
 
-    if (_in_buffers_size < patch_count) {
-        _in_buffers_size = patch_count;
+        _ready = _queue.enq_write_buffer(_seed_pids_buffer, (void*)patch_ids->data(), patch_count * sizeof(cl_int),
+                                         "upload visible patches", _ready);
+    }
+
+    // With the split cache, bound & split starts from the previous frame's leaves
+    size_t range_count = patch_count;
+    if (_split_cache.enabled()) {
+        range_count = _split_cache.count_seeds(_queue, patches_handle, _instance_patch_count * instances.size(),
+                                               _seed_pids_buffer, patch_ids != nullptr, patch_count, _ready);
+    }
+
+    {
+        // Earlier batches may still be diced with the previous instances
+        size_t instance_size = instances.size() * sizeof(mat4);
+        if (_instance_buffer.get_size() < instance_size) {
+            _instance_buffer.resize(instance_size);
+        }
+
+        _ready = _queue.enq_write_buffer(_instance_buffer, (void*)instances.data(), instance_size,
+                                         "upload instances", _ready | ready);
+    }
+
+    if (_in_buffers_size < range_count) {
+        _in_buffers_size = range_count;
 
         size_t item_count = round_up_by(_in_buffers_size, WORK_GROUP_CNT) + MAX_SPLIT_DEPTH * WORK_GROUP_SIZE * WORK_GROUP_CNT;
 
+        // Donated ranges and write-backs of stolen work need extra room
+        if (_work_stealing) {
+            item_count += 2 * WORK_GROUP_SIZE * WORK_GROUP_CNT;
+        }
+
         assert(item_count % WORK_GROUP_CNT == 0);        
         _in_buffer_stride = item_count / WORK_GROUP_CNT;
         
@@ -114,15 +170,27 @@ void Reyes::BoundNSplitCLLocal::init(void* patches_handle, const mat4& matrix, c
 
     _init_count_buffers_kernel->set_args(_in_range_cnt_buffer, _out_range_cnt_buffer,
                                          _processed_count_buffer,
-                                         (cl_int)patch_count);
+                                         _queue_locks_buffer, _idle_count_buffer,
+                                         (cl_int)range_count);
     _ready = _queue.enq_kernel(*_init_count_buffers_kernel, WORK_GROUP_CNT, WORK_GROUP_CNT,
                                "initialize counter buffers", _ready);
     
     
-    _init_range_buffers_kernel->set_args(_in_pids_buffer, _in_mins_buffer, _in_maxs_buffer,
-                                         (cl_int)patch_count, (cl_int)_in_buffer_stride);
+    if (_split_cache.enabled()) {
+        _ready = _split_cache.seed_ranges(_queue, _seed_pids_buffer, patch_ids != nullptr, patch_count, _ready);
+
+        _init_range_buffers_kernel->set_args(_in_pids_buffer, _in_mins_buffer, _in_maxs_buffer,
+                                             _split_cache.pids(), (cl_int)1,
+                                             _split_cache.depths(), _split_cache.mins(), _split_cache.maxs(), (cl_int)1,
+                                             (cl_int)range_count, (cl_int)_in_buffer_stride);
+    } else {
+        _init_range_buffers_kernel->set_args(_in_pids_buffer, _in_mins_buffer, _in_maxs_buffer,
+                                             _seed_pids_buffer, (cl_int)(patch_ids != nullptr),
+                                             _split_cache.depths(), _split_cache.mins(), _split_cache.maxs(), (cl_int)0,
+                                             (cl_int)range_count, (cl_int)_in_buffer_stride);
+    }
     _ready = _queue.enq_kernel(*_init_range_buffers_kernel,
-                               (int)round_up_by(patch_count, WORK_GROUP_SIZE), WORK_GROUP_SIZE,
+                               (int)round_up_by(range_count, WORK_GROUP_SIZE), WORK_GROUP_SIZE,
                                "initialize range buffers", _ready);
     
     //_queue.flush();
@@ -159,6 +227,8 @@ void Reyes::BoundNSplitCLLocal::finish()
     _queue.wait_for_events(_ready);
     _ready = CL::Event();
 
+    _split_cache.finish();
+
     // if (reyes_config.debug_work_group_balance()) {
         
     //     CL::Event ready = _queue.enq_read_buffer(_processed_count_buffer,
@@ -188,6 +258,11 @@ Reyes::Batch Reyes::BoundNSplitCLLocal::do_bound_n_split(CL::Event& ready)
 
     _ready = _queue.enq_fill_buffer(_out_range_cnt_buffer, (cl_int)0, 1, "Clear out_range_cnt", _ready | ready);
 
+    if (_work_stealing) {
+        // Work groups that ran out of ranges stay idle until the launch ends
+        _ready = _queue.enq_fill_buffer(_idle_count_buffer, (cl_int)0, 1, "Clear idle count", _ready);
+    }
+
     switch(_active_patch_type) {
     case Reyes::BEZIER:
         _bound_n_split_kernel_bezier->set_args(*_active_patch_buffer,
@@ -195,7 +270,9 @@ Reyes::Batch Reyes::BoundNSplitCLLocal::do_bound_n_split(CL::Event& ready)
                                                _in_pids_buffer, _in_mins_buffer, _in_maxs_buffer, _in_range_cnt_buffer,
                                                _out_pids_buffer, _out_mins_buffer, _out_maxs_buffer, _out_range_cnt_buffer,
                                                _processed_count_buffer,
-                                               _active_matrix, _projection_buffer,
+                                               _queue_locks_buffer, _idle_count_buffer,
+                                               _split_cache.leaf_counts(), _split_cache.leaf_ranges(), _split_cache.leaf_depths(),
+                                               _instance_buffer, (cl_int)_instance_patch_count, _projection_buffer, _depth_pyramid->get_buffer(),
                                                reyes_config.bound_n_split_limit());
         _ready = _queue.enq_kernel(*_bound_n_split_kernel_bezier,
                                    ivec2(WORK_GROUP_SIZE,  WORK_GROUP_CNT), ivec2(WORK_GROUP_SIZE, 1),
@@ -207,7 +284,9 @@ Reyes::Batch Reyes::BoundNSplitCLLocal::do_bound_n_split(CL::Event& ready)
                                                 _in_pids_buffer, _in_mins_buffer, _in_maxs_buffer, _in_range_cnt_buffer,
                                                 _out_pids_buffer, _out_mins_buffer, _out_maxs_buffer, _out_range_cnt_buffer,
                                                 _processed_count_buffer,
-                                                _active_matrix, _projection_buffer,
+                                                _queue_locks_buffer, _idle_count_buffer,
+                                                _split_cache.leaf_counts(), _split_cache.leaf_ranges(), _split_cache.leaf_depths(),
+                                                _instance_buffer, (cl_int)_instance_patch_count, _projection_buffer, _depth_pyramid->get_buffer(),
                                                 reyes_config.bound_n_split_limit());
         _ready = _queue.enq_kernel(*_bound_n_split_kernel_gregory,
                                    ivec2(WORK_GROUP_SIZE,  WORK_GROUP_CNT), ivec2(WORK_GROUP_SIZE, 1),
@@ -239,7 +318,7 @@ Reyes::Batch Reyes::BoundNSplitCLLocal::do_bound_n_split(CL::Event& ready)
     }
     
     return {reyes_config.dummy_render() ? 0 : (size_t)out_range_cnt,
-            _active_patch_type, *_active_patch_buffer,
+            _active_patch_type, *_active_patch_buffer, _instance_buffer, _instance_patch_count,
             _out_pids_buffer, _out_mins_buffer, _out_maxs_buffer,
-            _ready};
+            _ready, nullptr};
 }
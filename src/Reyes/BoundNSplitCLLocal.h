@@ -3,6 +3,7 @@
 #include "common.h"
 
 #include "BoundNSplitCL.h"
+#include "SplitCacheCL.h"
 
 
 namespace Reyes
@@ -10,6 +11,7 @@ namespace Reyes
         
 
     class PatchIndex;    
+    class DepthPyramid;
 
     
     class BoundNSplitCLLocal : public BoundNSplitCL
@@ -17,6 +19,7 @@ namespace Reyes
         
         CL::CommandQueue& _queue;                
         shared_ptr<PatchIndex> _patch_index;
+        shared_ptr<DepthPyramid> _depth_pyramid;
         
         CL::Program _bound_n_split_program_bezier;
         CL::Program _bound_n_split_program_gregory;
@@ -29,7 +32,7 @@ namespace Reyes
 
         void* _active_handle;
         CL::Buffer* _active_patch_buffer;
-        mat4 _active_matrix;
+        size_t _instance_patch_count;
         Reyes::PatchType _active_patch_type;
 
         size_t _in_buffers_size;
@@ -46,7 +49,15 @@ namespace Reyes
 
         CL::TransferBuffer _processed_count_buffer;
 
+        bool _work_stealing;
+        CL::Buffer _queue_locks_buffer;
+        CL::Buffer _idle_count_buffer;
+
         CL::Buffer _projection_buffer;
+        CL::Buffer _seed_pids_buffer;
+        CL::Buffer _instance_buffer;
+
+        SplitCacheCL _split_cache;
 
         CL::Event _ready;
 
@@ -57,11 +68,14 @@ namespace Reyes
 
 
         BoundNSplitCLLocal(CL::Device& device, CL::CommandQueue& queue,
-                           shared_ptr<PatchIndex>& patch_index);
+                           shared_ptr<PatchIndex>& patch_index,
+                           shared_ptr<DepthPyramid>& depth_pyramid,
+                           bool work_stealing=false);
         
 
         virtual void init(void* patches_handle,
-                          const mat4& matrix, const Projection* projection);
+                          const vector<mat4>& instances, const Projection* projection,
+                          const vector<int>* patch_ids, const CL::Event& ready);
         virtual bool done();
         virtual void finish();
 
@@ -0,0 +1,965 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#include "BoundNSplitCPU.h"
+
+#include "PatchIndex.h"
+#include "ReyesConfig.h"
+
+#include <algorithm>
+#include <thread>
+#include <tuple>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+// Number of ranges bounded together
+#define BOUND_SIMD_WIDTH 4
+
+
+Reyes::BoundNSplitCPU::BoundNSplitCPU(ThreadPool& threads, PatchIndex& patch_index)
+    : _threads(threads)
+    , _patch_index(patch_index)
+    , _active_handle(nullptr)
+    , _stacks(_threads.size())
+    , _out_count(0)
+    , _batch_full(false)
+    , _busy_workers(0)
+    , _instance_patch_count(0)
+    , _projection(nullptr)
+    , _patch_type(Reyes::BEZIER)
+{
+    _patch_index.enable_retain_vector();
+
+    if (use_normal_cones()) {
+        _patch_index.enable_build_normal_cones();
+    }
+}
+
+
+void Reyes::BoundNSplitCPU::init(void* patches_handle, const vector<mat4>& instances, const Projection* projection,
+                                 const vector<int>* patch_ids)
+{
+    _active_handle = patches_handle;
+    _instance_patch_count = _patch_index.get_patch_count(_active_handle);
+    _patch_type = _patch_index.get_patch_type(_active_handle);
+
+    size_t patch_count = patch_ids ? patch_ids->size() : _instance_patch_count * instances.size();
+
+    if (use_split_cache()) {
+        // Leaves of the previous call of this frame are complete now
+        store_split_leaves();
+        _next_split_cache.push_back(SplitCache{patches_handle, instances.size(), vector<PatchRange>()});
+    }
+
+    for (WorkerStack& stack : _stacks) {
+        stack.ranges.clear();
+    }
+
+    seed_ranges(patch_ids, patch_count, instances.size());
+
+    _projection = projection;
+    _projection->calc_projection_with_aspect_correction(_proj);
+
+    _instances = instances;
+
+    if (use_normal_cones()) {
+        _instance_eyes.clear();
+        for (const mat4& mv : _instances) {
+            _instance_eyes.push_back(object_space_eye(mv));
+        }
+    }
+}
+
+
+bool Reyes::BoundNSplitCPU::done()
+{
+    for (WorkerStack& stack : _stacks) {
+        if (stack.ranges.size() > 0) return false;
+    }
+
+    return true;
+}
+
+void Reyes::BoundNSplitCPU::finish()
+{
+    if (use_split_cache()) {
+        store_split_leaves();
+
+        _split_cache.swap(_next_split_cache);
+        _next_split_cache.clear();
+    } else {
+        _split_cache.clear();
+    }
+}
+
+
+void Reyes::BoundNSplitCPU::seed_ranges(const vector<int>* patch_ids, size_t patch_count, size_t instance_count)
+{
+    // The n-th call of a frame reuses the leaves of the n-th call of the
+    // previous frame, as long as it draws the same mesh
+    size_t call = _next_split_cache.size() - 1;
+    const SplitCache* cache = nullptr;
+
+    if (use_split_cache() && call < _split_cache.size() &&
+        _split_cache[call].patches_handle == _active_handle &&
+        _split_cache[call].instance_count == instance_count) {
+        cache = &_split_cache[call];
+    }
+
+    auto by_patch = [](const PatchRange& a, const PatchRange& b) { return a.patch_id < b.patch_id; };
+
+    for (size_t i = 0; i < patch_count; ++i) {
+        size_t pid = patch_ids ? (*patch_ids)[i] : i;
+        vector<PatchRange>& ranges = _stacks[i % _stacks.size()].ranges;
+
+        if (cache) {
+            PatchRange key(Bound(0,0,1,1), 0, pid);
+            auto leaves = std::equal_range(cache->leaves.begin(), cache->leaves.end(), key, by_patch);
+
+            if (leaves.first != leaves.second) {
+                ranges.insert(ranges.end(), leaves.first, leaves.second);
+                continue;
+            }
+        }
+
+        ranges.push_back(PatchRange{Bound(0,0,1,1), 0, pid});
+    }
+}
+
+
+void Reyes::BoundNSplitCPU::store_split_leaves()
+{
+    if (_next_split_cache.empty()) return;
+
+    _split_leaves.clear();
+    for (WorkerStack& stack : _stacks) {
+        _split_leaves.insert(_split_leaves.end(), stack.leaves.begin(), stack.leaves.end());
+        stack.leaves.clear();
+    }
+
+    merge_split_leaves(_split_leaves, _next_split_cache.back().leaves);
+}
+
+
+/**
+ * Replaces pairs of mergeable leaves by their union, one level per frame.
+ * The sibling of a leaf is found by doubling its shorter side. After
+ * alternating splits, the union does not have to be a range that the
+ * previous frame's split tree contained. It is still a dyadic range, and
+ * both halves are consumed together, so the leaves keep covering each
+ * patch exactly once.
+ */
+void Reyes::BoundNSplitCPU::merge_split_leaves(vector<CachedRange>& leaves, vector<PatchRange>& merged)
+{
+    typedef std::tuple<size_t, float, float, float, float> Key;
+
+    auto key = [](const Bound& b, size_t patch_id) {
+        return Key(patch_id, b.min.x, b.min.y, b.max.x, b.max.y);
+    };
+
+    map<Key, size_t> index;
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        if (leaves[i].mergeable) {
+            index[key(leaves[i].range.range, leaves[i].range.patch_id)] = i;
+        }
+    }
+
+    vector<bool> consumed(leaves.size(), false);
+
+    merged.clear();
+
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        if (consumed[i]) continue;
+        consumed[i] = true;
+
+        const PatchRange& r = leaves[i].range;
+
+        if (!leaves[i].mergeable || r.depth == 0) {
+            merged.push_back(r);
+            continue;
+        }
+
+        float w = r.range.max.x - r.range.min.x;
+        float h = r.range.max.y - r.range.min.y;
+
+        Bound parent = r.range;
+        Bound sibling = r.range;
+
+        if (w <= h) {
+            parent.min.x = floorf(r.range.min.x / (2*w)) * (2*w);
+            parent.max.x = parent.min.x + 2*w;
+            sibling.min.x = (r.range.min.x == parent.min.x) ? r.range.max.x : parent.min.x;
+            sibling.max.x = sibling.min.x + w;
+        } else {
+            parent.min.y = floorf(r.range.min.y / (2*h)) * (2*h);
+            parent.max.y = parent.min.y + 2*h;
+            sibling.min.y = (r.range.min.y == parent.min.y) ? r.range.max.y : parent.min.y;
+            sibling.max.y = sibling.min.y + h;
+        }
+
+        auto s = index.find(key(sibling, r.patch_id));
+
+        if (s == index.end() || consumed[s->second]) {
+            merged.push_back(r);
+            continue;
+        }
+
+        consumed[s->second] = true;
+
+        merged.push_back(PatchRange(parent, r.depth - 1, r.patch_id));
+    }
+
+    std::sort(merged.begin(), merged.end(),
+              [](const PatchRange& a, const PatchRange& b) { return a.patch_id < b.patch_id; });
+}
+
+
+size_t Reyes::BoundNSplitCPU::run(PatchRange* ranges, int* dice_levels, size_t max_count)
+{
+    const vector<vec3>& patches = _patch_index.get_patch_vector(_active_handle);
+
+    _out_count = 0;
+    _batch_full = false;
+    _busy_workers = _threads.size();
+
+    _threads.run([&](size_t index) {
+            run_worker(index, patches, _patch_type, ranges, dice_levels, max_count);
+        });
+
+    return minimum(_out_count.load(), max_count);
+}
+
+
+void Reyes::BoundNSplitCPU::run_worker(size_t index, const vector<vec3>& patches, PatchType type,
+                                       PatchRange* ranges, int* dice_levels, size_t max_count)
+{
+    const size_t max_split_depth = reyes_config.max_split_depth();
+    const float s = reyes_config.bound_n_split_limit();
+    const bool record_leaves = use_split_cache();
+    const bool cone_culling = use_normal_cones() && type == BEZIER;
+    const vector<NormalCone>* cones = cone_culling ? &_patch_index.get_normal_cones(_active_handle) : nullptr;
+    const bool diagsplit = reyes_config.diagsplit();
+    const size_t patch_stride = (type == BEZIER) ? 16 : 20;
+
+    WorkerStack& stack = _stacks[index];
+    vector<PatchRange> split;
+
+    PatchRange r[BOUND_SIMD_WIDTH];
+    const BezierPatch* p[BOUND_SIMD_WIDTH];
+    BBox box[BOUND_SIMD_WIDTH];
+    float vlen[BOUND_SIMD_WIDTH], hlen[BOUND_SIMD_WIDTH];
+
+    while (!_batch_full) {
+
+        size_t count = pop_ranges(stack, r, BOUND_SIMD_WIDTH);
+
+        if (count == 0) {
+            if (steal_ranges(index)) continue;
+
+            // Wait for other workers to share their ranges. Once no worker
+            // is busy all stacks are empty.
+            --_busy_workers;
+            while (true) {
+                if (_busy_workers == 0 || _batch_full) return;
+
+                ++_busy_workers;
+                if (steal_ranges(index)) break;
+                --_busy_workers;
+                
+                std::this_thread::yield();
+            }
+            continue;
+        }
+
+        switch (type) {
+        case BEZIER:
+            for (size_t i = 0; i < count; ++i) {
+                p[i] = (const BezierPatch*)&patches[16*(r[i].patch_id % _instance_patch_count)];
+            }
+
+            if (reyes_config.hull_bounds()) {
+                for (size_t i = 0; i < count; ++i) {
+                    bound_patch_range_hull(r[i], *p[i], _instances[r[i].patch_id / _instance_patch_count],
+                                           box[i], vlen[i], hlen[i]);
+                }
+                break;
+            }
+
+            // Ranges of the same instance share one modelview
+            for (size_t i = 0; i < count;) {
+                size_t instance = r[i].patch_id / _instance_patch_count;
+                size_t n = 1;
+                while (i + n < count && r[i+n].patch_id / _instance_patch_count == instance) ++n;
+
+                bound_patch_ranges(r+i, n, p+i, _instances[instance], box+i, vlen+i, hlen+i);
+                i += n;
+            }
+            break;
+        case GREGORY:
+            for (size_t i = 0; i < count; ++i) {
+                const mat4& mv = _instances[r[i].patch_id / _instance_patch_count];
+                bound_gregory_patch_range(r[i], &patches[20*(r[i].patch_id % _instance_patch_count)],
+                                          mv, _proj * mv, box[i], vlen[i], hlen[i]);
+            }
+            break;
+        }
+
+        split.clear();
+        
+        for (size_t i = 0; i < count; ++i) {
+            const vec3* patch = &patches[patch_stride * (r[i].patch_id % _instance_patch_count)];
+            const mat4& mv = _instances[r[i].patch_id / _instance_patch_count];
+
+            if (diagsplit && r[i].depth == 0) {
+                init_edge_levels(r[i], patch, type, mv, _projection);
+            }
+
+            // Edges with more segments than a grid has vertices force a split
+            int forced = diagsplit ? forced_split(r[i]) : 0;
+
+            vec2 size;
+            bool cull;
+            _projection->bound(box[i], size, cull);
+
+            if (!cull && cone_culling) {
+                size_t instance = r[i].patch_id / _instance_patch_count;
+                size_t pid = r[i].patch_id % _instance_patch_count;
+                cull = is_backfacing_range(r[i], *p[i], (*cones)[pid], _instances[instance], _instance_eyes[instance]);
+            }
+
+            if (cull) {
+                if (record_leaves) stack.leaves.push_back(CachedRange{r[i], true});
+                continue;
+            }
+
+            if (box[i].min.z < 0 && size.x < s && size.y < s && !forced) {
+
+                size_t slot = _out_count++;
+
+                if (slot >= max_count) {
+                    // buffer full, keep the range for the next batch
+                    _batch_full = true;
+                    split.push_back(r[i]);
+                    continue;
+                }
+
+                int level = dice_level(size);
+                if (diagsplit) {
+                    // Every lattice vertex on an edge needs a grid vertex
+                    level = maximum(level, max_edge_factor_level(r[i]));
+                }
+
+                ranges[slot] = r[i];
+                dice_levels[slot] = level;
+
+                if (record_leaves) {
+                    // Only merge ranges whose parent stays below the limit
+                    bool mergeable = size.x < 0.5f * s && size.y < 0.5f * s;
+                    stack.leaves.push_back(CachedRange{r[i], mergeable});
+                }
+
+            } else if (r[i].depth > max_split_depth) {
+                // TODO: Add low-overhead warning mechanism for this
+                // cout << "Warning: Split limit reached" << endl
+                if (record_leaves) stack.leaves.push_back(CachedRange{r[i], false});
+            } else {
+                bool split_x = forced ? forced == 1 : vlen[i] >= hlen[i];
+
+                if (diagsplit) {
+                    split_range(r[i], split_x, patch, type, mv, _projection, split);
+                } else if (split_x) {
+                    hsplit_range(r[i], split);
+                } else {
+                    vsplit_range(r[i], split);
+                }
+            }
+        }
+
+        if (!split.empty()) {
+            std::lock_guard<std::mutex> lock(stack.mutex);
+            stack.ranges.insert(stack.ranges.end(), split.begin(), split.end());
+        }
+    }
+}
+
+
+size_t Reyes::BoundNSplitCPU::pop_ranges(WorkerStack& stack, PatchRange* ranges, size_t max_count)
+{
+    std::lock_guard<std::mutex> lock(stack.mutex);
+
+    size_t count = minimum(max_count, stack.ranges.size());
+
+    for (size_t i = 0; i < count; ++i) {
+        ranges[i] = stack.ranges.back();
+        stack.ranges.pop_back();
+    }
+
+    return count;
+}
+
+
+bool Reyes::BoundNSplitCPU::steal_ranges(size_t thief)
+{
+    vector<PatchRange> stolen;
+    
+    for (size_t i = 1; i < _stacks.size() && stolen.empty(); ++i) {
+        WorkerStack& victim = _stacks[(thief + i) % _stacks.size()];
+
+        std::lock_guard<std::mutex> lock(victim.mutex);
+
+        // Take the bottom half, these are the largest ranges
+        size_t count = (victim.ranges.size() + 1) / 2;
+        stolen.assign(victim.ranges.begin(), victim.ranges.begin() + count);
+        victim.ranges.erase(victim.ranges.begin(), victim.ranges.begin() + count);
+    }
+
+    if (stolen.empty()) return false;
+
+    WorkerStack& stack = _stacks[thief];
+    std::lock_guard<std::mutex> lock(stack.mutex);
+    stack.ranges.insert(stack.ranges.end(), stolen.begin(), stolen.end());
+
+    return true;
+}
+
+
+// Both halves keep the lattices of the parent's edges, the new edge
+// between them gets split_level
+void Reyes::BoundNSplitCPU::vsplit_range(const PatchRange& r, vector<PatchRange>& stack, int split_level)
+{
+    float cy = (r.range.min.y + r.range.max.y) * 0.5f;
+
+    stack.emplace_back(r.range.min.x, r.range.min.y, r.range.max.x, cy,    r.depth + 1, r.patch_id);
+    stack.back().edges = r.edges;
+    stack.back().set_edge_level(EDGE_YMAX, split_level);
+
+    stack.emplace_back(r.range.min.x, cy, r.range.max.x, r.range.max.y,    r.depth + 1, r.patch_id);
+    stack.back().edges = r.edges;
+    stack.back().set_edge_level(EDGE_YMIN, split_level);
+}
+    
+void Reyes::BoundNSplitCPU::hsplit_range(const PatchRange& r, vector<PatchRange>& stack, int split_level)
+{
+    float cx = (r.range.min.x + r.range.max.x) * 0.5f;
+    
+    stack.emplace_back(r.range.min.x, r.range.min.y, cx, r.range.max.y,    r.depth + 1, r.patch_id);   
+    stack.back().edges = r.edges;
+    stack.back().set_edge_level(EDGE_XMAX, split_level);
+
+    stack.emplace_back(cx, r.range.min.y, r.range.max.x, r.range.max.y,    r.depth + 1, r.patch_id); 
+    stack.back().edges = r.edges;
+    stack.back().set_edge_level(EDGE_XMIN, split_level);
+}
+
+
+/**
+ * DiagSplit style edge lattices: an edge is measured once, when the range
+ * whose boundary it is gets created, and all ranges later split off along
+ * it keep that measurement. Ranges on both sides of an edge therefore
+ * agree on where its vertices are, no matter how differently they are
+ * split and diced, and dice moves the grid vertices on the edge there.
+ */
+int Reyes::BoundNSplitCPU::edge_level(const vec3* patch, PatchType type, const vec2& a, const vec2& b,
+                                        const mat4& mv, const Projection* projection)
+{
+    const int samples = 5;
+    const int max_factor_level = (int)floorf(log2f((float)reyes_config.reyes_patch_size()));
+
+    // Same micropolygon size as dice_level() aims for
+    const float target = reyes_config.bound_n_split_limit() / reyes_config.reyes_patch_size();
+
+    const vec2 f = projection->f();
+
+    vec3 pos[samples];
+
+    for (int i = 0; i < samples; ++i) {
+        vec2 uv = glm::mix(a, b, i / (float)(samples - 1));
+
+        switch (type) {
+        case BEZIER:
+            eval_patch(*(const BezierPatch*)patch, uv.y, uv.x, pos[i]);
+            break;
+        case GREGORY:
+            eval_gregory_patch(patch, uv.y, uv.x, pos[i]);
+            break;
+        }
+    }
+
+    // The neighbor across a patch boundary may run along the edge the other
+    // way. Summing from the endpoint that comes first in object space gives
+    // both the same length, bit for bit.
+    bool reverse = std::make_tuple(pos[samples-1].x, pos[samples-1].y, pos[samples-1].z) <
+                   std::make_tuple(pos[0].x, pos[0].y, pos[0].z);
+
+    float length = 0;
+    vec2 last;
+    int factor_level = -1;
+
+    for (int j = 0; j < samples; ++j) {
+        int i = reverse ? samples - 1 - j : j;
+        vec4 p = mv * vec4(pos[i], 1);
+
+        if (-p.z < projection->near()) {
+            // No meaningful screen length, use the finest lattice a grid allows
+            factor_level = max_factor_level;
+            break;
+        }
+
+        vec2 s = vec2(p.x * f.x, p.y * f.y) / -p.z;
+
+        if (j > 0) length += glm::distance(last, s);
+        last = s;
+    }
+
+    if (factor_level < 0) {
+        factor_level = (int)ceilf(log2f(maximum(length / target, 1.0f)));
+    }
+
+    // The edge spans 2^-k of the parameter
+    int k = -ilogbf(maximum(fabsf(b.x - a.x), fabsf(b.y - a.y)));
+
+    return minimum(factor_level + k, 255);
+}
+
+
+// Patch boundary edges get at least two lattice segments. With a single
+// one, a vertex at the middle of the edge is a tie that no rounding rule
+// breaks the same way from both directions.
+void Reyes::BoundNSplitCPU::init_edge_levels(PatchRange& r, const vec3* patch, PatchType type,
+                                             const mat4& mv, const Projection* projection)
+{
+    const vec2& lo = r.range.min;
+    const vec2& hi = r.range.max;
+
+    auto level = [&](const vec2& a, const vec2& b) {
+        return maximum(edge_level(patch, type, a, b, mv, projection), 1);
+    };
+
+    r.set_edge_level(EDGE_YMIN, level(vec2(lo.x, lo.y), vec2(hi.x, lo.y)));
+    r.set_edge_level(EDGE_XMAX, level(vec2(hi.x, lo.y), vec2(hi.x, hi.y)));
+    r.set_edge_level(EDGE_YMAX, level(vec2(lo.x, hi.y), vec2(hi.x, hi.y)));
+    r.set_edge_level(EDGE_XMIN, level(vec2(lo.x, lo.y), vec2(lo.x, hi.y)));
+}
+
+
+// log2 of the number of lattice segments along the edge of the range,
+// negative if the whole edge lies within one segment
+int Reyes::BoundNSplitCPU::edge_factor_level(const PatchRange& r, RangeEdge edge)
+{
+    bool along_x = (edge == EDGE_YMIN || edge == EDGE_YMAX);
+    float length = along_x ? r.range.max.x - r.range.min.x : r.range.max.y - r.range.min.y;
+
+    return r.edge_level(edge) + ilogbf(length);
+}
+
+
+int Reyes::BoundNSplitCPU::max_edge_factor_level(const PatchRange& r)
+{
+    int level = 0;
+    for (RangeEdge edge : {EDGE_YMIN, EDGE_XMAX, EDGE_YMAX, EDGE_XMIN}) {
+        level = maximum(level, edge_factor_level(r, edge));
+    }
+    return level;
+}
+
+
+// 1 if an edge along x needs a split in x, 2 for y, 0 if the range can be
+// diced as is
+int Reyes::BoundNSplitCPU::forced_split(const PatchRange& r)
+{
+    const int max_factor_level = (int)floorf(log2f((float)reyes_config.reyes_patch_size()));
+
+    int x = maximum(edge_factor_level(r, EDGE_YMIN), edge_factor_level(r, EDGE_YMAX));
+    int y = maximum(edge_factor_level(r, EDGE_XMIN), edge_factor_level(r, EDGE_XMAX));
+
+    if (x <= max_factor_level && y <= max_factor_level) {
+        return 0;
+    }
+
+    return x >= y ? 1 : 2;
+}
+
+
+void Reyes::BoundNSplitCPU::split_range(const PatchRange& r, bool split_x, const vec3* patch, PatchType type,
+                                          const mat4& mv, const Projection* projection,
+                                          vector<PatchRange>& stack)
+{
+    const vec2& lo = r.range.min;
+    const vec2& hi = r.range.max;
+
+    if (split_x) {
+        float cx = (lo.x + hi.x) * 0.5f;
+        hsplit_range(r, stack, edge_level(patch, type, vec2(cx, lo.y), vec2(cx, hi.y), mv, projection));
+    } else {
+        float cy = (lo.y + hi.y) * 0.5f;
+        vsplit_range(r, stack, edge_level(patch, type, vec2(lo.x, cy), vec2(hi.x, cy), mv, projection));
+    }
+}
+
+
+// Moves a diced vertex on an edge of the range to the nearest vertex of the
+// edge's lattice. Ties go to the even lattice vertex, which is the same one
+// when a neighbor counts the vertices from the other end of the edge.
+vec2 Reyes::BoundNSplitCPU::snap_to_edges(const PatchRange& r, int nu, int nv, int rate, vec2 uv)
+{
+    auto snap = [](float t, int level) {
+        float cells = ldexpf(1.0f, level);
+        return rintf(t * cells) / cells;
+    };
+
+    if (nv == 0)    uv.x = snap(uv.x, r.edge_level(EDGE_YMIN));
+    if (nv == rate) uv.x = snap(uv.x, r.edge_level(EDGE_YMAX));
+    if (nu == 0)    uv.y = snap(uv.y, r.edge_level(EDGE_XMIN));
+    if (nu == rate) uv.y = snap(uv.y, r.edge_level(EDGE_XMAX));
+
+    return uv;
+}
+
+
+int Reyes::BoundNSplitCPU::dice_level(const vec2& size)
+{
+    float rate = maximum(size.x, size.y) / reyes_config.bound_n_split_limit() * reyes_config.reyes_patch_size();
+
+    return minimum((int)ceilf(log2f(maximum(rate, 1.0f))), 15);
+}
+
+
+
+// The edge lattices depend on the order ranges were split in, which the
+// cache does not keep
+bool Reyes::BoundNSplitCPU::use_split_cache()
+{
+    return reyes_config.split_cache() && !reyes_config.diagsplit();
+}
+
+
+bool Reyes::BoundNSplitCPU::use_normal_cones()
+{
+    return reyes_config.normal_cone_culling() && reyes_config.backface_culling();
+}
+
+
+vec4 Reyes::BoundNSplitCPU::object_space_eye(const mat4& mv)
+{
+    vec4 eye = glm::inverse(mv) * vec4(0,0,0,1);
+    float det = glm::dot(glm::cross(vec3(mv[0]), vec3(mv[1])), vec3(mv[2]));
+
+    return vec4(vec3(eye) / eye.w, det < 0 ? -1.0f : 1.0f);
+}
+
+
+/**
+ * Tests the cone of the whole patch first, which needs no work per range.
+ * Split ranges have narrower cones, those are computed from the range's
+ * eye space control points when the patch cone is not conclusive.
+ */
+bool Reyes::BoundNSplitCPU::is_backfacing_range(const PatchRange& r, const BezierPatch& p,
+                                                  const NormalCone& patch_cone,
+                                                  const mat4& mv, const vec4& eye)
+{
+    if (is_backfacing(patch_cone, vec3(eye), eye.w < 0)) {
+        return true;
+    }
+
+    if (r.depth == 0) {
+        return false;
+    }
+
+    BezierPatch sub;
+    restrict_patch(p, r.range.min, r.range.max, sub);
+
+    for (size_t i = 0; i < 4; ++i) {
+        for (size_t j = 0; j < 4; ++j) {
+            sub.P[i][j] = vec3(mv * vec4(sub.P[i][j], 1));
+        }
+    }
+
+    NormalCone cone;
+    calc_normal_cone(sub, cone);
+
+    return is_backfacing(cone, vec3(0));
+}
+
+
+void Reyes::BoundNSplitCPU::bound_patch_range (const PatchRange& r, const BezierPatch& p,
+                                                 const mat4& mv, const mat4& mvp,
+                                                 BBox& box, float& vlen, float& hlen)
+{
+    const size_t RES = 3;
+        
+    //vec2 pp[RES][RES];
+    vec3 ps[RES][RES];
+    vec3 pos;
+     
+    box.clear();
+        
+    for (size_t iu = 0; iu < RES; ++iu) {
+        for (size_t iv = 0; iv < RES; ++iv) {
+            float v = r.range.min.x + (r.range.max.x - r.range.min.x) * iu * (1.0f / (RES-1));
+            float u = r.range.min.y + (r.range.max.y - r.range.min.y) * iv * (1.0f / (RES-1));
+
+            eval_patch(p, u, v, pos);
+
+            vec3 pt = vec3(mv * vec4(pos,1));
+                
+            box.add_point(pt);
+
+            // pp[iu][iv] = project(mvp * vec4(pos,1));
+            ps[iu][iv] = pt;
+        }
+    }
+
+    vlen = 0;
+    hlen = 0;
+
+    for (size_t i = 0; i < RES; ++i) {
+        float h = 0, v = 0;
+        for (size_t j = 0; j < RES-1; ++j) {
+            // v += glm::distance(pp[j][i], pp[j+1][i]);
+            // h += glm::distance(pp[i][j], pp[i][j+1]);
+            v += glm::distance(ps[j][i], ps[j+1][i]);
+            h += glm::distance(ps[i][j], ps[i][j+1]);
+        }
+        vlen = maximum(v, vlen);
+        hlen = maximum(h, hlen);
+    }
+}
+
+
+void Reyes::BoundNSplitCPU::bound_gregory_patch_range (const PatchRange& r, const vec3* p,
+                                                         const mat4& mv, const mat4& mvp,
+                                                         BBox& box, float& vlen, float& hlen)
+{
+    const size_t RES = 3;
+        
+    //vec2 pp[RES][RES];
+    vec3 ps[RES][RES];
+    vec3 pos;
+     
+    box.clear();
+        
+    for (size_t iu = 0; iu < RES; ++iu) {
+        for (size_t iv = 0; iv < RES; ++iv) {
+            float v = r.range.min.x + (r.range.max.x - r.range.min.x) * iu * (1.0f / (RES-1));
+            float u = r.range.min.y + (r.range.max.y - r.range.min.y) * iv * (1.0f / (RES-1));
+
+            eval_gregory_patch(p, u, v, pos);
+
+            vec3 pt = vec3(mv * vec4(pos,1));
+                
+            box.add_point(pt);
+
+            // pp[iu][iv] = project(mvp * vec4(pos,1));
+            ps[iu][iv] = pt;
+        }
+    }
+
+    vlen = 0;
+    hlen = 0;
+
+    for (size_t i = 0; i < RES; ++i) {
+        float h = 0, v = 0;
+        for (size_t j = 0; j < RES-1; ++j) {
+            // v += glm::distance(pp[j][i], pp[j+1][i]);
+            // h += glm::distance(pp[i][j], pp[i][j+1]);
+            v += glm::distance(ps[j][i], ps[j+1][i]);
+            h += glm::distance(ps[i][j], ps[i][j+1]);
+        }
+        vlen = maximum(v, vlen);
+        hlen = maximum(h, hlen);
+    }
+}
+
+
+/**
+ * Bounds the convex hull of the range's control points, which contains
+ * the surface, so unlike the sampled bound nothing can stick out of it.
+ * The lengths are those of the longest control polygon row and column,
+ * which are upper bounds of the lengths of the iso-curves.
+ */
+void Reyes::BoundNSplitCPU::bound_patch_range_hull(const PatchRange& r, const BezierPatch& p, const mat4& mv,
+                                                     BBox& box, float& vlen, float& hlen)
+{
+    BezierPatch sub;
+    restrict_patch(p, r.range.min, r.range.max, sub);
+
+    box.clear();
+
+    for (size_t i = 0; i < 4; ++i) {
+        for (size_t j = 0; j < 4; ++j) {
+            sub.P[i][j] = vec3(mv * vec4(sub.P[i][j], 1));
+            box.add_point(sub.P[i][j]);
+        }
+    }
+
+    vlen = 0;
+    hlen = 0;
+
+    for (size_t i = 0; i < 4; ++i) {
+        float h = 0, v = 0;
+        for (size_t j = 0; j < 3; ++j) {
+            v += glm::distance(sub.P[j][i], sub.P[j+1][i]);
+            h += glm::distance(sub.P[i][j], sub.P[i][j+1]);
+        }
+        vlen = maximum(v, vlen);
+        hlen = maximum(h, hlen);
+    }
+}
+
+
+void Reyes::BoundNSplitCPU::bound_patch_ranges(const PatchRange* r, size_t count,
+                                                 const BezierPatch* const* p, const mat4& mv,
+                                                 BBox* box, float* vlen, float* hlen)
+{
+#ifdef __SSE__
+    // Bound four ranges at once, one per SSE lane. Unused lanes repeat
+    // the first range.
+    const size_t RES = 3;
+
+    size_t l[4];
+    for (size_t k = 0; k < 4; ++k) {
+        l[k] = k < count ? k : 0;
+    }
+
+    __m128 cx[4][4], cy[4][4], cz[4][4];
+
+    for (size_t i = 0; i < 4; ++i) {
+        for (size_t j = 0; j < 4; ++j) {
+            cx[i][j] = _mm_setr_ps(p[l[0]]->P[i][j].x, p[l[1]]->P[i][j].x, p[l[2]]->P[i][j].x, p[l[3]]->P[i][j].x);
+            cy[i][j] = _mm_setr_ps(p[l[0]]->P[i][j].y, p[l[1]]->P[i][j].y, p[l[2]]->P[i][j].y, p[l[3]]->P[i][j].y);
+            cz[i][j] = _mm_setr_ps(p[l[0]]->P[i][j].z, p[l[1]]->P[i][j].z, p[l[2]]->P[i][j].z, p[l[3]]->P[i][j].z);
+        }
+    }
+
+    const __m128 rminx = _mm_setr_ps(r[l[0]].range.min.x, r[l[1]].range.min.x, r[l[2]].range.min.x, r[l[3]].range.min.x);
+    const __m128 rminy = _mm_setr_ps(r[l[0]].range.min.y, r[l[1]].range.min.y, r[l[2]].range.min.y, r[l[3]].range.min.y);
+    const __m128 rmaxx = _mm_setr_ps(r[l[0]].range.max.x, r[l[1]].range.max.x, r[l[2]].range.max.x, r[l[3]].range.max.x);
+    const __m128 rmaxy = _mm_setr_ps(r[l[0]].range.max.y, r[l[1]].range.max.y, r[l[2]].range.max.y, r[l[3]].range.max.y);
+
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 three = _mm_set1_ps(3.0f);
+
+    __m128 px[RES][RES], py[RES][RES], pz[RES][RES];
+
+    for (size_t iu = 0; iu < RES; ++iu) {
+        for (size_t iv = 0; iv < RES; ++iv) {
+            __m128 v = _mm_add_ps(rminx, _mm_mul_ps(_mm_sub_ps(rmaxx, rminx), _mm_set1_ps(iu * (1.0f / (RES-1)))));
+            __m128 u = _mm_add_ps(rminy, _mm_mul_ps(_mm_sub_ps(rmaxy, rminy), _mm_set1_ps(iv * (1.0f / (RES-1)))));
+
+            // Bernstein weights, same parametrization as eval_patch(p, u, v)
+            __m128 ui = _mm_sub_ps(one, u);
+            __m128 vi = _mm_sub_ps(one, v);
+            
+            __m128 bu[4] = {_mm_mul_ps(_mm_mul_ps(ui, ui), ui),
+                            _mm_mul_ps(_mm_mul_ps(three, ui), _mm_mul_ps(ui, u)),
+                            _mm_mul_ps(_mm_mul_ps(three, ui), _mm_mul_ps(u, u)),
+                            _mm_mul_ps(_mm_mul_ps(u, u), u)};
+            __m128 bv[4] = {_mm_mul_ps(_mm_mul_ps(vi, vi), vi),
+                            _mm_mul_ps(_mm_mul_ps(three, vi), _mm_mul_ps(vi, v)),
+                            _mm_mul_ps(_mm_mul_ps(three, vi), _mm_mul_ps(v, v)),
+                            _mm_mul_ps(_mm_mul_ps(v, v), v)};
+
+            __m128 x = _mm_setzero_ps();
+            __m128 y = _mm_setzero_ps();
+            __m128 z = _mm_setzero_ps();
+
+            for (size_t i = 0; i < 4; ++i) {
+                __m128 rx = _mm_setzero_ps();
+                __m128 ry = _mm_setzero_ps();
+                __m128 rz = _mm_setzero_ps();
+
+                for (size_t j = 0; j < 4; ++j) {
+                    rx = _mm_add_ps(rx, _mm_mul_ps(bu[j], cx[i][j]));
+                    ry = _mm_add_ps(ry, _mm_mul_ps(bu[j], cy[i][j]));
+                    rz = _mm_add_ps(rz, _mm_mul_ps(bu[j], cz[i][j]));
+                }
+
+                x = _mm_add_ps(x, _mm_mul_ps(bv[i], rx));
+                y = _mm_add_ps(y, _mm_mul_ps(bv[i], ry));
+                z = _mm_add_ps(z, _mm_mul_ps(bv[i], rz));
+            }
+
+            // Transform to eye space
+            __m128* dst[3] = {&px[iu][iv], &py[iu][iv], &pz[iu][iv]};
+            for (int row = 0; row < 3; ++row) {
+                *dst[row] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(mv[0][row]), x),
+                                                  _mm_mul_ps(_mm_set1_ps(mv[1][row]), y)),
+                                       _mm_add_ps(_mm_mul_ps(_mm_set1_ps(mv[2][row]), z),
+                                                  _mm_set1_ps(mv[3][row])));
+            }
+        }
+    }
+
+    __m128 minx = px[0][0], miny = py[0][0], minz = pz[0][0];
+    __m128 maxx = px[0][0], maxy = py[0][0], maxz = pz[0][0];
+
+    for (size_t iu = 0; iu < RES; ++iu) {
+        for (size_t iv = 0; iv < RES; ++iv) {
+            minx = _mm_min_ps(minx, px[iu][iv]);
+            miny = _mm_min_ps(miny, py[iu][iv]);
+            minz = _mm_min_ps(minz, pz[iu][iv]);
+            maxx = _mm_max_ps(maxx, px[iu][iv]);
+            maxy = _mm_max_ps(maxy, py[iu][iv]);
+            maxz = _mm_max_ps(maxz, pz[iu][iv]);
+        }
+    }
+
+    auto distance = [](__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+        __m128 dx = _mm_sub_ps(ax, bx);
+        __m128 dy = _mm_sub_ps(ay, by);
+        __m128 dz = _mm_sub_ps(az, bz);
+        return _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+    };
+
+    __m128 vl = _mm_setzero_ps();
+    __m128 hl = _mm_setzero_ps();
+    
+    for (size_t i = 0; i < RES; ++i) {
+        __m128 h = _mm_setzero_ps();
+        __m128 v = _mm_setzero_ps();
+        for (size_t j = 0; j < RES-1; ++j) {
+            v = _mm_add_ps(v, distance(px[j][i], py[j][i], pz[j][i], px[j+1][i], py[j+1][i], pz[j+1][i]));
+            h = _mm_add_ps(h, distance(px[i][j], py[i][j], pz[i][j], px[i][j+1], py[i][j+1], pz[i][j+1]));
+        }
+        vl = _mm_max_ps(v, vl);
+        hl = _mm_max_ps(h, hl);
+    }
+
+    float out[8][4];
+    _mm_storeu_ps(out[0], minx);
+    _mm_storeu_ps(out[1], miny);
+    _mm_storeu_ps(out[2], minz);
+    _mm_storeu_ps(out[3], maxx);
+    _mm_storeu_ps(out[4], maxy);
+    _mm_storeu_ps(out[5], maxz);
+    _mm_storeu_ps(out[6], vl);
+    _mm_storeu_ps(out[7], hl);
+
+    for (size_t k = 0; k < count; ++k) {
+        box[k].min = vec3(out[0][k], out[1][k], out[2][k]);
+        box[k].max = vec3(out[3][k], out[4][k], out[5][k]);
+        vlen[k] = out[6][k];
+        hlen[k] = out[7][k];
+    }
+#else
+    for (size_t k = 0; k < count; ++k) {
+        bound_patch_range(r[k], *p[k], mv, mv, box[k], vlen[k], hlen[k]);
+    }
+#endif
+}
@@ -0,0 +1,180 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#pragma once
+
+#include "common.h"
+
+#include "Patch.h"
+#include "PatchRange.h"
+#include "PatchType.h"
+#include "Projection.h"
+#include "ThreadPool.h"
+
+#include <atomic>
+#include <mutex>
+
+
+namespace Reyes
+{
+
+    class PatchIndex;
+
+
+    /**
+     * Bound & split on the host, without any OpenCL objects. Each worker
+     * of the thread pool splits ranges from its own stack and steals from
+     * the others when it runs dry. Used by BoundNSplitCLCPU, which uploads
+     * the ranges for the OpenCL rasterization stages, and by RendererCPU.
+     */
+    class BoundNSplitCPU : public noncopyable
+    {
+
+        ThreadPool& _threads;
+        PatchIndex& _patch_index;
+
+        void* _active_handle;
+
+        // Range that was drawn, culled or not split further. Mergeable
+        // ranges are small enough to be replaced by their parent.
+        struct CachedRange
+        {
+            PatchRange range;
+            bool mergeable;
+        };
+
+        // Leaf ranges of one init() call, seeds the same call of the next
+        // frame, see reyes_config.split_cache
+        struct SplitCache
+        {
+            void* patches_handle;
+            size_t instance_count;
+
+            // Sorted by patch id
+            vector<PatchRange> leaves;
+        };
+
+        vector<SplitCache> _split_cache;
+        vector<SplitCache> _next_split_cache;
+        vector<CachedRange> _split_leaves;
+
+        struct WorkerStack
+        {
+            std::mutex mutex;
+            vector<PatchRange> ranges;
+
+            // Ranges that ended in this worker, only touched by its thread
+            vector<CachedRange> leaves;
+        };
+
+        vector<WorkerStack> _stacks;
+
+        std::atomic<size_t> _out_count;
+        std::atomic<bool> _batch_full;
+        std::atomic<int> _busy_workers;
+
+        vector<mat4> _instances;
+        size_t _instance_patch_count;
+
+        // Object space eye position per instance, w < 0 for mirroring
+        // transforms, see reyes_config.normal_cone_culling
+        vector<vec4> _instance_eyes;
+
+        mat4 _proj;
+        const Projection* _projection;
+        PatchType _patch_type;
+
+    public:
+
+        BoundNSplitCPU(ThreadPool& threads, PatchIndex& patch_index);
+
+        /**
+         * Start bound & split of one or more instances of a mesh.
+         * @param instances Modelview matrix of each instance. Patch ids
+         *                  count the patches of all instances, instance
+         *                  after instance.
+         * @param patch_ids Patches to start from, nullptr for all patches
+         *                  of all instances.
+         */
+        void init(void* patches_handle, const vector<mat4>& instances, const Projection* projection,
+                  const vector<int>* patch_ids);
+        bool done();
+        void finish();
+
+        /**
+         * Split until max_count ranges are small enough to be diced or
+         * nothing is left to split.
+         * @param ranges      Ranges to dice, in no particular order.
+         * @param dice_levels log2 of the dicing rate of each range.
+         * @return Number of ranges written.
+         */
+        size_t run(PatchRange* ranges, int* dice_levels, size_t max_count);
+
+        const vector<mat4>& instances() const { return _instances; }
+        PatchType patch_type() const { return _patch_type; }
+        size_t instance_patch_count() const { return _instance_patch_count; }
+
+    private:
+
+        void run_worker(size_t index, const vector<vec3>& patches, PatchType type,
+                        PatchRange* ranges, int* dice_levels, size_t max_count);
+        size_t pop_ranges(WorkerStack& stack, PatchRange* ranges, size_t max_count);
+        bool steal_ranges(size_t thief);
+
+        void seed_ranges(const vector<int>* patch_ids, size_t patch_count, size_t instance_count);
+        void store_split_leaves();
+        static void merge_split_leaves(vector<CachedRange>& leaves, vector<PatchRange>& merged);
+
+    public:
+
+        static bool use_split_cache();
+        static bool use_normal_cones();
+
+        // Bounding and splitting helpers
+        static void vsplit_range(const PatchRange& r, vector<PatchRange>& stack, int split_level=0);
+        static void hsplit_range(const PatchRange& r, vector<PatchRange>& stack, int split_level=0);
+        static void bound_patch_range (const PatchRange& r, const BezierPatch& p,
+                                       const mat4& mv, const mat4& mvp,
+                                       BBox& box, float& vlen, float& hlen);
+        static void bound_gregory_patch_range (const PatchRange& r, const vec3* p,
+                                               const mat4& mv, const mat4& mvp,
+                                               BBox& box, float& vlen, float& hlen);
+        static void bound_patch_ranges(const PatchRange* r, size_t count,
+                                       const BezierPatch* const* p, const mat4& mv,
+                                       BBox* box, float* vlen, float* hlen);
+        static void bound_patch_range_hull(const PatchRange& r, const BezierPatch& p, const mat4& mv,
+                                           BBox& box, float& vlen, float& hlen);
+        static int dice_level(const vec2& size);
+        static vec4 object_space_eye(const mat4& mv);
+        static bool is_backfacing_range(const PatchRange& r, const BezierPatch& p, const NormalCone& patch_cone,
+                                        const mat4& mv, const vec4& eye);
+
+        // Edge lattices for reyes_config.diagsplit
+        static int edge_level(const vec3* patch, PatchType type, const vec2& a, const vec2& b,
+                              const mat4& mv, const Projection* projection);
+        static void init_edge_levels(PatchRange& r, const vec3* patch, PatchType type,
+                                     const mat4& mv, const Projection* projection);
+        static int edge_factor_level(const PatchRange& r, RangeEdge edge);
+        static int max_edge_factor_level(const PatchRange& r);
+        static int forced_split(const PatchRange& r);
+        static void split_range(const PatchRange& r, bool split_x, const vec3* patch, PatchType type,
+                                const mat4& mv, const Projection* projection, vector<PatchRange>& stack);
+        static vec2 snap_to_edges(const PatchRange& r, int nu, int nv, int rate, vec2 uv);
+
+    };
+
+}
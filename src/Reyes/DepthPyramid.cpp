@@ -0,0 +1,107 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#include "DepthPyramid.h"
+
+#include "ReyesConfig.h"
+
+#define HIZ_TILE_SIZE 8
+
+Reyes::DepthPyramid::DepthPyramid(CL::Device& device,
+                                  const ivec2& framebuffer_size, int tile_size, const ivec2& grid_size)
+    : _enabled(reyes_config.hiz_culling() && !reyes_config.dummy_render())
+    , _framebuffer_size(framebuffer_size)
+    , _size(round_up_div(framebuffer_size.x, HIZ_TILE_SIZE), round_up_div(framebuffer_size.y, HIZ_TILE_SIZE))
+    , _buffer(device, sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "depth pyramid")
+{
+    int item_count = 0;
+    ivec2 size = _size;
+
+    while (true) {
+        _level_sizes.push_back(size);
+        _level_offsets.push_back(item_count);
+        item_count += size.x * size.y;
+
+        if (size.x == 1 && size.y == 1) break;
+
+        size = ivec2(round_up_div(size.x, 2), round_up_div(size.y, 2));
+    }
+
+    _buffer.resize(item_count * sizeof(cl_int));
+
+    _program.set_constant("TILE_SIZE", tile_size);
+    _program.set_constant("GRID_SIZE", grid_size);
+    _program.set_constant("FRAMEBUFFER_SIZE", _framebuffer_size);
+    _program.set_constant("HIZ_TILE_SIZE", HIZ_TILE_SIZE);
+    _program.compile(device, "depth_pyramid.cl");
+
+    _build_base_kernel.reset(_program.get_kernel("build_base"));
+    _build_base_from_tiles_kernel.reset(_program.get_kernel("build_base_from_tiles"));
+    _reduce_kernel.reset(_program.get_kernel("reduce"));
+}
+
+
+CL::Event Reyes::DepthPyramid::build(CL::CommandQueue& queue, CL::Buffer& depth_buffer, const CL::Event& ready)
+{
+    _build_base_kernel->set_args(depth_buffer, _buffer, _size);
+    CL::Event e = queue.enq_kernel(*_build_base_kernel,
+                                   ivec2(round_up_by(_size.x, 8), round_up_by(_size.y, 8)), ivec2(8, 8),
+                                   "build depth pyramid", ready);
+
+    return reduce(queue, e);
+}
+
+
+CL::Event Reyes::DepthPyramid::build_from_tiles(CL::CommandQueue& queue, CL::Buffer& depth_tiles, const CL::Event& ready)
+{
+    _build_base_from_tiles_kernel->set_args(depth_tiles, _buffer, _size);
+    CL::Event e = queue.enq_kernel(*_build_base_from_tiles_kernel,
+                                   ivec2(round_up_by(_size.x, 8), round_up_by(_size.y, 8)), ivec2(8, 8),
+                                   "build depth pyramid", ready);
+
+    return reduce(queue, e);
+}
+
+
+CL::Event Reyes::DepthPyramid::reduce(CL::CommandQueue& queue, const CL::Event& base_built)
+{
+    CL::Event e = base_built;
+
+    for (size_t level = 1; level < _level_sizes.size(); ++level) {
+        const ivec2& size = _level_sizes[level];
+
+        _reduce_kernel->set_args(_buffer,
+                                 _level_offsets[level-1], _level_sizes[level-1],
+                                 _level_offsets[level], size);
+        e = queue.enq_kernel(*_reduce_kernel,
+                             ivec2(round_up_by(size.x, 8), round_up_by(size.y, 8)), ivec2(8, 8),
+                             "reduce depth pyramid", e);
+    }
+
+    return e;
+}
+
+
+void Reyes::DepthPyramid::set_constants(CL::Program& program) const
+{
+    // Without rendering the depth buffer is never written, so there is nothing to test against
+    program.set_constant("HIZ_CULLING", (int)_enabled);
+    program.set_constant("HIZ_SIZE", _size);
+    program.set_constant("HIZ_LEVELS", (int)_level_sizes.size());
+    program.set_constant("HIZ_TILE_SIZE", HIZ_TILE_SIZE);
+}
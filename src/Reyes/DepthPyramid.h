@@ -0,0 +1,69 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#pragma once
+
+#include "common.h"
+
+#include "CL/OpenCL.h"
+
+namespace Reyes
+{
+
+    /**
+     * Max-depth mip pyramid over the depth buffer. Level 0 stores the
+     * farthest depth of every 8x8 pixel block, each further level the
+     * maximum of 2x2 texels of the level below, down to a single texel.
+     * All levels are packed into one buffer, finest level first.
+     */
+    class DepthPyramid : public noncopyable
+    {
+        bool _enabled;
+
+        ivec2 _framebuffer_size;
+        ivec2 _size;
+        vector<ivec2> _level_sizes;
+        vector<int> _level_offsets;
+
+        CL::Buffer _buffer;
+
+        CL::Program _program;
+        shared_ptr<CL::Kernel> _build_base_kernel;
+        shared_ptr<CL::Kernel> _build_base_from_tiles_kernel;
+        shared_ptr<CL::Kernel> _reduce_kernel;
+
+        CL::Event reduce(CL::CommandQueue& queue, const CL::Event& base_built);
+
+    public:
+
+        DepthPyramid(CL::Device& device, const ivec2& framebuffer_size, int tile_size, const ivec2& grid_size);
+
+        CL::Event build(CL::CommandQueue& queue, CL::Buffer& depth_buffer, const CL::Event& ready);
+
+        // Builds from the cleared flags and max depths of 8x8 pixel tiles
+        // instead of the depth buffer, see the tiled_depth option
+        CL::Event build_from_tiles(CL::CommandQueue& queue, CL::Buffer& depth_tiles, const CL::Event& ready);
+
+        // Sets the HIZ_* constants of a program that tests against the pyramid
+        void set_constants(CL::Program& program) const;
+
+        bool enabled() const { return _enabled; }
+        CL::Buffer& get_buffer() { return _buffer; }
+    };
+
+}
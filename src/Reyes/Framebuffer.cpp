@@ -22,6 +22,8 @@
 #include "CL/OpenCL.h"
 #include "ReyesConfig.h"
 
+#include <boost/format.hpp>
+
 
 namespace Reyes
 {
@@ -31,24 +33,12 @@ namespace Reyes
         _tile_size(tile_size),
         _grid_size(ceil((float)size.x/tile_size), ceil((float)size.y/tile_size)),
         _act_size(_grid_size * tile_size), 
-        _shader("tex_draw"),
         //_clear_kernel(device, "framebuffer.cl", "clear"),
-        _cl_buffer(0),
-		_screen_quad(6)
+        _cl_buffer(0)
     {
         _framebuffer_program.compile(device, "framebuffer.cl");
 
         _clear_kernel.reset(_framebuffer_program.get_kernel("clear"));
-        
-        _screen_quad.vertex(-1,-1);
-        _screen_quad.vertex( 1,-1);
-        _screen_quad.vertex( 1, 1);
-
-        _screen_quad.vertex(-1,-1);
-        _screen_quad.vertex( 1, 1);
-        _screen_quad.vertex(-1, 1);
-
-		_screen_quad.send_data(false);
     }
 
     Framebuffer::~Framebuffer()
@@ -62,24 +52,73 @@ namespace Reyes
 
     CL::Event Framebuffer::clear(CL::CommandQueue& queue, const CL::Event& e)
     {
-        vec4 clear_color = reyes_config.clear_color();
-        clear_color = vec4(powf(clear_color.x, 2.2), 
-                           powf(clear_color.y, 2.2),
-                           powf(clear_color.z, 2.2), 1000);
-        _clear_kernel->set_args(*_cl_buffer, clear_color);
+        _clear_kernel->set_args(*_cl_buffer, get_clear_color());
         return queue.enq_kernel(*_clear_kernel, _size.x * _size.y, 64,
                                 "clear framebuffer", e);
     }
 
 
+    vec4 Framebuffer::get_clear_color()
+    {
+        vec4 clear_color = reyes_config.clear_color();
+        return vec4(powf(clear_color.x, 2.2), 
+                    powf(clear_color.y, 2.2),
+                    powf(clear_color.z, 2.2), 1000);
+    }
+
+
+    void Framebuffer::read_pixels(CL::CommandQueue& queue, vector<vec4>& pixels)
+    {
+        vector<vec4> tiled(_act_size.x * _act_size.y);
+
+        CL::Event e = acquire(queue, CL::Event());
+        e = queue.enq_read_buffer(*_cl_buffer, tiled.data(), tiled.size() * sizeof(vec4),
+                                  "read framebuffer", e);
+        e = release(queue, e);
+        queue.wait_for_events(e);
+
+        untile(tiled, pixels);
+    }
+
+
+    void Framebuffer::untile(const vector<vec4>& tiled, vector<vec4>& pixels) const
+    {
+        pixels.resize(_size.x * _size.y);
+
+        // Same mapping as the tex_draw shader
+        for (int y = 0; y < _size.y; ++y) {
+            for (int x = 0; x < _size.x; ++x) {
+                ivec2 gridpos = ivec2(x, y) / _tile_size;
+                int   grid_id = gridpos.x + _grid_size.x * gridpos.y;
+                ivec2 loclpos = ivec2(x, y) - gridpos * _tile_size;
+                int   locl_id = loclpos.x + _tile_size * loclpos.y;
+
+                pixels[x + y * _size.x] = tiled[grid_id * _tile_size * _tile_size + locl_id];
+            }
+        }
+    }
+
+
     OGLSharedFramebuffer::OGLSharedFramebuffer(CL::Device& device,
                                                const ivec2& size, int tile_size, GLFWwindow* window) :
         Framebuffer(device, size, tile_size),
+        _shader("tex_draw"),
+		_screen_quad(6),
         _tex_buffer(_act_size.x * _act_size.y * sizeof(vec4), GL_RGBA32F),
         _shared(device.share_gl()),
         _local(0),
 		_glfw_window(window)
     {
+        _screen_quad.vertex(-1,-1);
+        _screen_quad.vertex( 1,-1);
+        _screen_quad.vertex( 1, 1);
+
+        _screen_quad.vertex(-1,-1);
+        _screen_quad.vertex( 1, 1);
+        _screen_quad.vertex(-1, 1);
+
+		_screen_quad.send_data(false);
+
         if (_shared) {
             _cl_buffer = new CL::Buffer(device, _tex_buffer.get_buffer().get_id());
         } else {
@@ -142,4 +181,55 @@ namespace Reyes
         
         _tex_buffer.unbind();
     }
+
+
+    HeadlessFramebuffer::HeadlessFramebuffer(CL::Device& device, const ivec2& size, int tile_size,
+                                             const string& output_pattern) :
+        Framebuffer(device, size, tile_size),
+        _output_pattern(output_pattern),
+        _frame_no(0)
+    {
+        _cl_buffer = new CL::Buffer(device, _act_size.x * _act_size.y * sizeof(vec4), CL_MEM_READ_WRITE, "framebuffer");
+
+        if (!_output_pattern.empty()) {
+            _local.resize(_act_size.x * _act_size.y);
+            _writer.reset(new ImageWriter(2));
+        }
+    }
+
+    CL::Event HeadlessFramebuffer::acquire(CL::CommandQueue& queue, const CL::Event& e)
+    {
+        return e;
+    }
+
+    CL::Event HeadlessFramebuffer::release(CL::CommandQueue& queue, const CL::Event& evt)
+    {
+        if (!_writer) {
+            queue.wait_for_events(evt);
+            return CL::Event();
+        }
+
+        CL::Event e = queue.enq_read_buffer(*_cl_buffer, _local.data(), _local.size() * sizeof(vec4),
+                                            "read framebuffer", evt);
+        queue.wait_for_events(e);
+
+        return CL::Event();
+    }
+
+    void HeadlessFramebuffer::show()
+    {
+        if (!_writer) return;
+
+        vector<vec4> pixels;
+        untile(_local, pixels);
+
+        // Patterns without a frame number overwrite the same file
+        boost::format filename_format(_output_pattern);
+        filename_format.exceptions(boost::io::all_error_bits ^ boost::io::too_many_args_bit);
+
+        string filename = (filename_format % _frame_no).str();
+        ++_frame_no;
+
+        _writer->write(filename, _size, std::move(pixels));
+    }
 }
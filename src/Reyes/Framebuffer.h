@@ -23,6 +23,7 @@
 
 #include "CL/OpenCL.h"
 #include "GL/Shader.h"
+#include "ImageWriter.h"
 #include "GL/Texture.h"
 #include "GL/VBO.h"
 
@@ -39,17 +40,17 @@ namespace Reyes
         ivec2 _grid_size;
         ivec2 _act_size;
 
-        GL::Shader _shader;
         CL::Program _framebuffer_program;
         scoped_ptr<CL::Kernel> _clear_kernel;
 
 
         CL::Buffer* _cl_buffer;
-       
-		GL::VBO _screen_quad;
 
         Framebuffer(CL::Device& device, const ivec2& size, int tile_size);
 
+        // Reorders the tiled buffer layout into rows of pixels, bottom to top
+        void untile(const vector<vec4>& tiled, vector<vec4>& pixels) const;
+
 
         public:
 
@@ -58,6 +59,16 @@ namespace Reyes
 
         CL::Event clear(CL::CommandQueue& queue, const CL::Event& e);
 
+        // Configured clear color as stored in the buffer
+        vec4 get_clear_color();
+
+        /**
+         * Read back the last finished frame, for example to compare it
+         * against a reference image. Blocks until the pixels arrived.
+         * @param pixels Linear RGBA values, rows from bottom to top.
+         */
+        void read_pixels(CL::CommandQueue& queue, vector<vec4>& pixels);
+
 
         const CL::Buffer& get_buffer() { return *_cl_buffer; }
         ivec2 size() {return _size; }
@@ -74,6 +85,9 @@ namespace Reyes
     class OGLSharedFramebuffer : public Framebuffer
     {
 
+        GL::Shader _shader;
+		GL::VBO _screen_quad;
+
         GL::TextureBuffer _tex_buffer;
         bool _shared;
         void* _local;
@@ -91,6 +105,35 @@ namespace Reyes
         virtual CL::Event release(CL::CommandQueue& queue, const CL::Event& e);
                              
 
+        void show();
+    };
+
+
+    /**
+     * Framebuffer without OpenGL. Frames are read back from the OpenCL
+     * buffer and handed to an ImageWriter, if an output file is set.
+     */
+    class HeadlessFramebuffer : public Framebuffer
+    {
+
+        string _output_pattern;
+        size_t _frame_no;
+
+        vector<vec4> _local;
+        scoped_ptr<ImageWriter> _writer;
+
+        public:
+
+        /**
+         * @param output_pattern boost::format pattern for the frame files,
+         *                       taking the frame number. Empty to discard
+         *                       frames.
+         */
+        HeadlessFramebuffer(CL::Device& device, const ivec2& size, int tile_size, const string& output_pattern);
+
+        virtual CL::Event acquire(CL::CommandQueue& queue, const CL::Event& e);
+        virtual CL::Event release(CL::CommandQueue& queue, const CL::Event& e);
+
         void show();
     };
 }
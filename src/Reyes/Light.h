@@ -0,0 +1,45 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#pragma once
+
+#include "common.h"
+
+namespace Reyes
+{
+
+    /**
+     * Light source as handed to the renderers. Positions and directions
+     * are in view space.
+     */
+    struct Light
+    {
+        // Same order as LightSource.Type of the scene format
+        enum Type
+        {
+            POINT,
+            DIRECTIONAL,
+            HEMI
+        };
+
+        Type type;
+        vec3 position;  // Point lights
+        vec3 direction; // Unit vector towards directional and hemi lights
+        vec3 color;     // Multiplied with the intensity
+    };
+
+}
@@ -0,0 +1,139 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#include "PatchBVH.h"
+
+#include "Projection.h"
+
+#include <algorithm>
+
+
+namespace
+{
+    const int LEAF_SIZE = 4;
+}
+
+
+Reyes::PatchBVH::PatchBVH(const vec3* points, size_t stride, size_t patch_count, size_t points_per_patch)
+{
+    vector<BBox> patch_boxes(patch_count);
+
+    for (size_t i = 0; i < patch_count; ++i) {
+        for (size_t j = 0; j < points_per_patch; ++j) {
+            const vec3& p = *(const vec3*)((const char*)points + (i * points_per_patch + j) * stride);
+            patch_boxes[i].add_point(p);
+        }
+    }
+
+    _patch_ids.resize(patch_count);
+    for (size_t i = 0; i < patch_count; ++i) {
+        _patch_ids[i] = i;
+    }
+
+    _nodes.reserve(2 * round_up_div(patch_count, (size_t)LEAF_SIZE));
+
+    if (patch_count > 0) {
+        build(patch_boxes, 0, patch_count);
+    }
+}
+
+
+int Reyes::PatchBVH::build(const vector<BBox>& patch_boxes, int first, int count)
+{
+    int id = _nodes.size();
+    _nodes.push_back(Node());
+
+    BBox box, centers;
+    for (int i = first; i < first + count; ++i) {
+        const BBox& pbox = patch_boxes[_patch_ids[i]];
+        box.add_point(pbox.min);
+        box.add_point(pbox.max);
+        centers.add_point((pbox.min + pbox.max) * 0.5f);
+    }
+
+    _nodes[id].box = box;
+
+    if (count <= LEAF_SIZE) {
+        _nodes[id].first = first;
+        _nodes[id].count = count;
+        return id;
+    }
+
+    // Median split along the axis with the largest spread of centers
+    vec3 extent = centers.size();
+    int axis = 0;
+    if (extent.y > extent[axis]) axis = 1;
+    if (extent.z > extent[axis]) axis = 2;
+
+    int half = count / 2;
+    std::nth_element(_patch_ids.begin() + first, _patch_ids.begin() + first + half, _patch_ids.begin() + first + count,
+                     [&](int a, int b) {
+                         return (patch_boxes[a].min[axis] + patch_boxes[a].max[axis]) <
+                             (patch_boxes[b].min[axis] + patch_boxes[b].max[axis]);
+                     });
+
+    build(patch_boxes, first, half);
+    int right = build(patch_boxes, first + half, count - half);
+
+    _nodes[id].first = right;
+    _nodes[id].count = 0;
+
+    return id;
+}
+
+
+void Reyes::PatchBVH::cull(const mat4& modelview, const Projection& projection, float margin,
+                           vector<int>& visible_patches) const
+{
+    if (_nodes.empty()) return;
+
+    int stack[64];
+    int stack_height = 0;
+
+    stack[stack_height++] = 0;
+
+    while (stack_height > 0) {
+        const Node& node = _nodes[stack[--stack_height]];
+
+        BBox eye_box;
+        for (int i = 0; i < 8; ++i) {
+            vec4 corner((i & 1) ? node.box.max.x : node.box.min.x,
+                        (i & 2) ? node.box.max.y : node.box.min.y,
+                        (i & 4) ? node.box.max.z : node.box.min.z, 1);
+            eye_box.add_point(vec3(modelview * corner));
+        }
+
+        eye_box.min = eye_box.min - vec3(margin);
+        eye_box.max = eye_box.max + vec3(margin);
+
+        vec2 size;
+        bool cull;
+        projection.bound(eye_box, size, cull);
+
+        if (cull) continue;
+
+        if (node.count > 0) {
+            visible_patches.insert(visible_patches.end(),
+                                   _patch_ids.begin() + node.first, _patch_ids.begin() + node.first + node.count);
+        } else {
+            // The left child directly follows its parent
+            int id = &node - _nodes.data();
+            stack[stack_height++] = node.first;
+            stack[stack_height++] = id + 1;
+        }
+    }
+}
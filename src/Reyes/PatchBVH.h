@@ -0,0 +1,62 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#pragma once
+
+#include "common.h"
+
+namespace Reyes
+{
+    class Projection;
+
+    /**
+     * Bounding volume hierarchy over the control point hulls of a mesh's
+     * patches. Patches lie inside the convex hull of their control points,
+     * so a node outside the view frustum contains no visible patch.
+     */
+    class PatchBVH : public noncopyable
+    {
+
+        struct Node
+        {
+            BBox box;
+            int first;  // Leaf: first entry in _patch_ids, inner: right child
+            int count;  // Leaf: number of patches, inner: 0
+        };
+
+        vector<Node> _nodes;
+        vector<int> _patch_ids;
+
+        int build(const vector<BBox>& patch_boxes, int first, int count);
+
+    public:
+
+        /**
+         * @param points Control points, points_per_patch consecutive points
+         *               per patch.
+         */
+        PatchBVH(const vec3* points, size_t stride, size_t patch_count, size_t points_per_patch);
+
+        /**
+         * Append the ids of all patches whose hull may be visible.
+         * @param margin Distance the surface may be displaced off the hull.
+         */
+        void cull(const mat4& modelview, const Projection& projection, float margin,
+                  vector<int>& visible_patches) const;
+    };
+
+}
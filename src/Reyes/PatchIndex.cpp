@@ -3,12 +3,16 @@
 
 #include "common.h"
 
+#include "PatchBVH.h"
+
 
 Reyes::PatchIndex::PatchIndex()
     : _is_set_up(false)
     , _load_as_texture(false)
     , _load_as_opencl_buffer(false)
     , _retain_vector(false)
+    , _build_bvh(false)
+    , _build_normal_cones(false)
     , _opencl_device(nullptr)
     , _opencl_queue(nullptr)
 {
@@ -48,13 +52,28 @@ void Reyes::PatchIndex::enable_retain_vector()
 }
 
 
+void Reyes::PatchIndex::enable_build_bvh()
+{
+    assert(!_is_set_up);
+    _build_bvh = true;
+}
+
+
+void Reyes::PatchIndex::enable_build_normal_cones()
+{
+    assert(!_is_set_up);
+    _build_normal_cones = true;
+}
+
+
 bool Reyes::PatchIndex::are_patches_loaded(void* handle)
 {
     return _index.count(handle) > 0;
 }
 
 
-void Reyes::PatchIndex::load_patches(void* handle, const vector<vec3>& patch_data, Reyes::PatchType patch_type)
+Reyes::PatchIndex::PatchData& Reyes::PatchIndex::init_record(void* handle, size_t point_count,
+                                                             Reyes::PatchType patch_type)
 {
     assert(handle != nullptr);
     
@@ -62,14 +81,42 @@ void Reyes::PatchIndex::load_patches(void* handle, const vector<vec3>& patch_dat
 
     switch (patch_type) {
     case BEZIER:
-        record.patch_count = patch_data.size() / 16;
+        record.patch_count = point_count / 16;
         break;
     case GREGORY:
-        record.patch_count = patch_data.size() / 20;
+        record.patch_count = point_count / 20;
         break;
     }
 
     record.type = patch_type;
+    record.bvh.reset();
+    record.normal_cones.clear();
+
+    return record;
+}
+
+
+// Only Bezier patches get normal cones, Gregory patches are never culled
+void Reyes::PatchIndex::build_normal_cones(PatchData& record, const void* patch_data, size_t stride)
+{
+    if (record.type != BEZIER) return;
+
+    record.normal_cones.resize(record.patch_count);
+
+    for (size_t i = 0; i < record.patch_count; ++i) {
+        BezierPatch patch;
+        for (size_t j = 0; j < 16; ++j) {
+            patch.P[j/4][j%4] = *(const vec3*)((const char*)patch_data + (i*16 + j) * stride);
+        }
+
+        calc_normal_cone(patch, record.normal_cones[i]);
+    }
+}
+
+
+void Reyes::PatchIndex::load_patches(void* handle, const vector<vec3>& patch_data, Reyes::PatchType patch_type)
+{
+    PatchData& record = init_record(handle, patch_data.size(), patch_type);
 
     size_t data_size = patch_data.size() * sizeof(vec3);
     
@@ -77,6 +124,15 @@ void Reyes::PatchIndex::load_patches(void* handle, const vector<vec3>& patch_dat
         record.patch_data = patch_data;
     }
 
+    if (_build_bvh) {
+        record.bvh.reset(new PatchBVH(patch_data.data(), sizeof(vec3), record.patch_count,
+                                      patch_data.size() / std::max<size_t>(record.patch_count, 1)));
+    }
+
+    if (_build_normal_cones) {
+        build_normal_cones(record, patch_data.data(), sizeof(vec3));
+    }
+
     if (_load_as_texture) {
         record.patch_texture.reset(new GL::TextureBuffer(data_size, GL_RGB32F));
         record.patch_texture->load((void*)patch_data.data());
@@ -100,6 +156,46 @@ void Reyes::PatchIndex::load_patches(void* handle, const vector<vec3>& patch_dat
 }
 
 
+void Reyes::PatchIndex::load_patches(void* handle, const vec4* patch_data, size_t point_count,
+                                     Reyes::PatchType patch_type)
+{
+    if (_retain_vector || _load_as_texture) {
+        vector<vec3> points;
+        points.reserve(point_count);
+
+        for (size_t i = 0; i < point_count; ++i) {
+            points.push_back(vec3(patch_data[i]));
+        }
+
+        load_patches(handle, points, patch_type);
+        return;
+    }
+
+    PatchData& record = init_record(handle, point_count, patch_type);
+
+    if (_build_bvh) {
+        record.bvh.reset(new PatchBVH((const vec3*)patch_data, sizeof(vec4), record.patch_count,
+                                      point_count / std::max<size_t>(record.patch_count, 1)));
+    }
+
+    if (_build_normal_cones) {
+        build_normal_cones(record, patch_data, sizeof(vec4));
+    }
+
+    if (_load_as_opencl_buffer) {
+        // Already in the device layout, upload without staging copy
+        size_t data_size = point_count * sizeof(vec4);
+
+        record.opencl_buffer.reset(new CL::Buffer(*_opencl_device, data_size, CL_MEM_READ_ONLY, "patch-data"));
+        CL::Event e = _opencl_queue->enq_write_buffer(*(record.opencl_buffer), (void*)patch_data,
+                                                      data_size, "Patch transfer", CL::Event());
+        _opencl_queue->wait_for_events(e);
+    }
+
+    _is_set_up = true;
+}
+
+
 void Reyes::PatchIndex::delete_patches(void* handle)
 {
     assert(are_patches_loaded(handle));
@@ -133,6 +229,20 @@ CL::Buffer* Reyes::PatchIndex::get_opencl_buffer(void* handle)
 
 
 
+const Reyes::PatchBVH* Reyes::PatchIndex::get_bvh(void* handle)
+{
+    return _index[handle].bvh.get();
+}
+
+
+const vector<NormalCone>& Reyes::PatchIndex::get_normal_cones(void* handle)
+{
+    assert(_build_normal_cones);
+
+    return _index[handle].normal_cones;
+}
+
+
 size_t Reyes::PatchIndex::get_patch_count(void* handle)
 {
     return _index[handle].patch_count;
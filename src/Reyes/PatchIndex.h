@@ -1,11 +1,13 @@
 #pragma once
 
+#include "Patch.h"
 #include "PatchType.h"
 #include "GL/Texture.h"
 #include "CL/OpenCL.h"
 
 namespace Reyes
 {
+    class PatchBVH;
 
     class PatchIndex
     {
@@ -19,6 +21,8 @@ namespace Reyes
             
             shared_ptr<GL::TextureBuffer> patch_texture;
             shared_ptr<CL::Buffer> opencl_buffer;
+            shared_ptr<PatchBVH> bvh;
+            vector<NormalCone> normal_cones;
         };
         
         map<void*, PatchData> _index;
@@ -27,10 +31,15 @@ namespace Reyes
         bool _load_as_texture;
         bool _load_as_opencl_buffer;
         bool _retain_vector;
+        bool _build_bvh;
+        bool _build_normal_cones;
 
         CL::Device* _opencl_device;
         CL::CommandQueue* _opencl_queue;
         
+        PatchData& init_record(void* handle, size_t point_count, PatchType patch_type);
+        void build_normal_cones(PatchData& record, const void* patch_data, size_t stride);
+
     public:
         
 
@@ -40,14 +49,19 @@ namespace Reyes
         void enable_load_texture();
         void enable_load_opencl_buffer(CL::Device& opencl_device, CL::CommandQueue& opencl_queue);
         void enable_retain_vector();
+        void enable_build_bvh();
+        void enable_build_normal_cones();
 
         bool are_patches_loaded(void* handle);
         void load_patches(void* handle, const vector<vec3>& patch_data, PatchType patch_type);
+        void load_patches(void* handle, const vec4* patch_data, size_t point_count, PatchType patch_type);
         void delete_patches(void* handle);
         
         const vector<vec3>& get_patch_vector(void* handle);
         GL::TextureBuffer& get_patch_texture(void* handle);
         CL::Buffer* get_opencl_buffer(void* handle);
+        const PatchBVH* get_bvh(void* handle);
+        const vector<NormalCone>& get_normal_cones(void* handle);
         
         size_t get_patch_count(void* handle);
         PatchType get_patch_type(void* handle);
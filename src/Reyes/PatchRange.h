@@ -6,23 +6,49 @@
 
 namespace Reyes
 {
+    // Edges of a range, as indexed in PatchRange::edges
+    enum RangeEdge
+    {
+        EDGE_YMIN = 0,
+        EDGE_XMAX = 1,
+        EDGE_YMAX = 2,
+        EDGE_XMIN = 3
+    };
+
     struct PatchRange
     {
         Bound range;
         size_t depth;
         size_t patch_id;
 
+        // Tessellation lattice of each edge, 8 bits per RangeEdge. Diced
+        // vertices on an edge are moved to multiples of 2^-level of the
+        // parameter along it, see reyes_config.diagsplit
+        unsigned edges;
+
         PatchRange() {}
                 
         PatchRange(const Bound& range, size_t depth, size_t patch_id)
             : range(range)
             , depth(depth)
-            , patch_id(patch_id) {}
+            , patch_id(patch_id)
+            , edges(0) {}
         
         PatchRange(float xmin, float ymin, float xmax, float ymax,
                    size_t depth, size_t patch_id)
             : range(xmin,ymin,xmax,ymax)
             , depth(depth)
-            , patch_id(patch_id) {}
+            , patch_id(patch_id)
+            , edges(0) {}
+
+        int edge_level(RangeEdge edge) const
+        {
+            return (edges >> (8 * edge)) & 0xff;
+        }
+
+        void set_edge_level(RangeEdge edge, int level)
+        {
+            edges = (edges & ~(0xffu << (8 * edge))) | ((unsigned)level << (8 * edge));
+        }
     };
 }
@@ -23,6 +23,29 @@
 
 #define bound_n_split_new bound_n_split
 
+
+void Reyes::Renderer::load_patches(void* patches_handle, const vec4* patch_data, size_t point_count, PatchType type)
+{
+    vector<vec3> points;
+    points.reserve(point_count);
+
+    for (size_t i = 0; i < point_count; ++i) {
+        points.push_back(vec3(patch_data[i]));
+    }
+
+    load_patches(patches_handle, points, type);
+}
+
+
+void Reyes::Renderer::draw_instances(void* patches_handle, const vector<mat4>& matrices,
+                                     const Projection* projection, const vec4& color)
+{
+    for (const mat4& matrix : matrices) {
+        draw_patches(patches_handle, matrix, projection, color);
+    }
+}
+
+
 namespace Reyes
 {
     // void bound_n_split_old(const BezierPatch& patch, const Projection& projection,
@@ -19,6 +19,7 @@
 #pragma once
 
 #include "common.h"
+#include "Light.h"
 #include "PatchType.h"
 
 namespace Reyes
@@ -36,11 +37,23 @@ namespace Reyes
         virtual bool are_patches_loaded(void* patches_handle) = 0;
         virtual void load_patches(void* patches_handle, const vector<vec3>& patch_data, PatchType type) = 0;
 
+        // Control points as homogeneous float4, e.g. mapped from an unpacked scene file
+        virtual void load_patches(void* patches_handle, const vec4* patch_data, size_t point_count, PatchType type);
+
         virtual void draw_patches(void* patches_handle,
                                   const mat4& matrix,
                                   const Projection* projection,
                                   const vec4& color) = 0;
 
+        // Draws the mesh once for every modelview matrix
+        virtual void draw_instances(void* patches_handle,
+                                    const vector<mat4>& matrices,
+                                    const Projection* projection,
+                                    const vec4& color);
+
+        // Lights of the current frame, set between prepare() and the first draw
+        virtual void set_lights(const vector<Light>& lights) {};
+
         virtual void dump_trace() {};
     };
 
@@ -9,7 +9,9 @@
 #include "CL/OpenCL.h"
 #include "CLConfig.h"
 #include "Config.h"
+#include "DepthPyramid.h"
 #include "Framebuffer.h"
+#include "PatchBVH.h"
 #include "PatchIndex.h"
 #include "Projection.h"
 #include "ReyesConfig.h"
@@ -18,6 +20,30 @@
 #define _framebuffer_queue _rasterization_queue
 #define _bound_n_split_queue _rasterization_queue
 
+namespace
+{
+    // Range ids keep the dicing level in their upper 8 bits
+    const size_t MAX_RANGE_PID_COUNT = 1 << 24;
+
+    // Pixels of the tiled framebuffer layout, including partial tiles
+    size_t framebuffer_pixel_count(Reyes::Framebuffer& framebuffer)
+    {
+        ivec2 size = framebuffer.get_grid_size() * framebuffer.get_tile_size();
+        return size.x * size.y;
+    }
+
+    Reyes::Framebuffer* create_framebuffer(CL::Device& device)
+    {
+        if (config.headless()) {
+            return new Reyes::HeadlessFramebuffer(device, reyes_config.window_size(), reyes_config.framebuffer_tile_size(),
+                                                  config.frame_output());
+        } else {
+            return new Reyes::OGLSharedFramebuffer(device, reyes_config.window_size(), reyes_config.framebuffer_tile_size(),
+                                                   glfwGetCurrentContext());
+        }
+    }
+}
+
 Reyes::RendererCL::RendererCL()
     : _device(cl_config.opencl_device_id().x, cl_config.opencl_device_id().y)
 
@@ -25,30 +51,41 @@ Reyes::RendererCL::RendererCL()
     // , _bound_n_split_queue(_device, "bound & split")
     , _rasterization_queue(_device, "rasterization")
 
-    , _framebuffer(_device, reyes_config.window_size(), reyes_config.framebuffer_tile_size(), glfwGetCurrentContext())
+    , _framebuffer(create_framebuffer(_device))
 
     , _patch_index(new PatchIndex())
 
     , _max_block_count(square(reyes_config.reyes_patch_size()/8) * reyes_config.reyes_patches_per_pass())
-    , _pos_grid(_device,
-                reyes_config.reyes_patches_per_pass() * square(reyes_config.reyes_patch_size()+1) * sizeof(vec4),
-                CL_MEM_READ_WRITE, "grid-data")
-    , _pxlpos_grid(_device,
-                   reyes_config.reyes_patches_per_pass() * square(reyes_config.reyes_patch_size()+1) * sizeof(ivec2),
-                   CL_MEM_READ_WRITE, "grid-data")
-    , _color_grid(_device,
-                  reyes_config.reyes_patches_per_pass() * square(reyes_config.reyes_patch_size()) * sizeof(vec4),
-                  CL_MEM_READ_WRITE, "grid-data")
-    , _depth_grid(_device,
-                  reyes_config.reyes_patches_per_pass() * square(reyes_config.reyes_patch_size()+1) * sizeof(float),
-                  CL_MEM_READ_WRITE, "grid-data")
-    , _block_index(_device, _max_block_count * sizeof(ivec4), CL_MEM_READ_WRITE, "block-index")
-    , _tile_locks(_device,
-                  _framebuffer.size().x/8 * _framebuffer.size().y/8 * sizeof(cl_int), CL_MEM_READ_WRITE, "tile-locks")
-	, _depth_buffer(_device, _framebuffer.size().x * _framebuffer.size().y * sizeof(cl_int), CL_MEM_READ_WRITE, "framebuffer")
-    , _reyes_program()
+    , _tile_count(round_up_div(_framebuffer->size().x, 8) * round_up_div(_framebuffer->size().y, 8))
+    , _next_grid_set(0)
+    , _tile_counts(_device, _tile_count * sizeof(cl_int), CL_MEM_READ_WRITE, "tile-bins")
+    , _tile_offsets(_device, _tile_count * sizeof(cl_int), CL_MEM_READ_WRITE, "tile-bins")
+    // Grown when a batch needs more, see sample_grid_set
+    , _tile_blocks(_device, 4 * _max_block_count * sizeof(cl_int), CL_MEM_READ_WRITE, "tile-bins")
+    , _tile_bin_total(_device, sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, "tile-bins")
+    , _tile_prefix_sum(_device, _tile_count, "tile-bins")
+	, _depth_buffer(_device, _framebuffer->size().x * _framebuffer->size().y * sizeof(cl_int), CL_MEM_READ_WRITE, "framebuffer")
+    , _depth_tiles(_device, _tile_count * sizeof(cl_int4), CL_MEM_READ_WRITE, "framebuffer")
+    , _visibility_buffer(_device, (reyes_config.deferred_shading() ? framebuffer_pixel_count(*_framebuffer) : 1) * sizeof(cl_int2),
+                         CL_MEM_READ_WRITE, "framebuffer")
+    , _sample_batch_id(0)
+    , _light_buffer(_device, 3 * sizeof(vec4), CL_MEM_READ_ONLY, "lights")
+    , _light_count(0)
+    , _depth_pyramid_stale(true)
     , _frame_event(_device, "frame")
 {
+    if (reyes_config.patch_bvh_culling()) {
+        _patch_index->enable_build_bvh();
+    }
+
+    _tile_bin_total.host_ref<cl_int>() = 0;
+
+    for (int i = 0; i < std::max(1, reyes_config.grid_pipeline_length()); ++i) {
+        _grid_sets.push_back(shared_ptr<GridSet>(new GridSet(_device, _max_block_count, reyes_config.grid_pipeline_queues(), i)));
+    }
+
+    _depth_pyramid.reset(new DepthPyramid(_device, _framebuffer->size(),
+                                          _framebuffer->get_tile_size(), _framebuffer->get_grid_size()));
 
     switch(reyes_config.bound_n_split_method()) {
     default:
@@ -60,37 +97,37 @@ Reyes::RendererCL::RendererCL()
         _bound_n_split.reset(new BoundNSplitCLCPU(_device, _bound_n_split_queue, _patch_index));
         break;
     case ReyesConfig::LOCAL:
-        _bound_n_split.reset(new BoundNSplitCLLocal(_device, _bound_n_split_queue, _patch_index));
+        _bound_n_split.reset(new BoundNSplitCLLocal(_device, _bound_n_split_queue, _patch_index, _depth_pyramid));
+        break;
+    case ReyesConfig::STEALING:
+        _bound_n_split.reset(new BoundNSplitCLLocal(_device, _bound_n_split_queue, _patch_index, _depth_pyramid, true));
         break;
     case ReyesConfig::BREADTH:
-        _bound_n_split.reset(new BoundNSplitCLBreadth(_device, _bound_n_split_queue, _patch_index));
+        _bound_n_split.reset(new BoundNSplitCLBreadth(_device, _bound_n_split_queue, _patch_index, _depth_pyramid));
         break;
     case ReyesConfig::BOUNDED:
-        _bound_n_split.reset(new BoundNSplitCLBounded(_device, _bound_n_split_queue, _patch_index));
+        _bound_n_split.reset(new BoundNSplitCLBounded(_device, _bound_n_split_queue, _patch_index, _depth_pyramid));
         break;
     }
 
-    for (CL::Program* program : {&_reyes_program, &_dice_bezier_program, &_dice_gregory_program}) {
-        program->set_constant("TILE_SIZE", _framebuffer.get_tile_size());
-        program->set_constant("GRID_SIZE", _framebuffer.get_grid_size());
-        program->set_constant("PATCH_SIZE", (int)reyes_config.reyes_patch_size());
-        program->set_constant("VIEWPORT_MIN_PIXEL", ivec2(0,0));
-        program->set_constant("VIEWPORT_MAX_PIXEL", _framebuffer.size());
-        program->set_constant("VIEWPORT_SIZE_PIXEL", _framebuffer.size());
-        program->set_constant("MAX_BLOCK_COUNT", _max_block_count);
-        program->set_constant("FRAMEBUFFER_SIZE", _framebuffer.size());
-        program->set_constant("BACKFACE_CULLING", reyes_config.backface_culling());
-        program->set_constant("CLEAR_COLOR", reyes_config.clear_color());
-        program->set_constant("CLEAR_DEPTH", 1.0f);
-        program->set_constant("PXLCOORD_SHIFT", reyes_config.subpixel_bits());
-        program->set_constant("DISPLACEMENT", reyes_config.displacement());
-    }
+    // Only the CPU bound & split keeps track of edge lattices
+    bool diagsplit = reyes_config.diagsplit() && dynamic_cast<BoundNSplitCLCPU*>(_bound_n_split.get());
 
-    _reyes_program.compile(_device, "reyes.cl");
+    for (CL::Program* program : {&_dice_bezier_program, &_dice_gregory_program}) {
+        set_program_constants(*program);
+        program->set_constant("DIAGSPLIT", (int)diagsplit);
+    }
 
-    _shade_kernel.reset(_reyes_program.get_kernel("shade"));
+    // Compiles the reyes program
+    set_lights(vector<Light>());
 
-    _sample_kernel.reset(_reyes_program.get_kernel("sample"));
+    if (reyes_config.deferred_shading()) {
+        // No batch matches the initial entries
+        CL::Event e = _rasterization_queue.enq_fill_buffer<cl_int>(_visibility_buffer, -1,
+                                                                   framebuffer_pixel_count(*_framebuffer) * 2,
+                                                                   "clear visibility buffer", CL::Event());
+        _rasterization_queue.wait_for_events(e);
+    }
 
     _dice_bezier_program.define("eval_patch", "eval_bezier_patch");
     _dice_bezier_program.compile(_device, "dice.cl");
@@ -99,10 +136,114 @@ Reyes::RendererCL::RendererCL()
     _dice_gregory_program.define("eval_patch", "eval_gregory_patch");
     _dice_gregory_program.compile(_device, "dice.cl");
     _dice_gregory_kernel.reset(_dice_gregory_program.get_kernel("dice"));
+}
+
+
+void Reyes::RendererCL::set_program_constants(CL::Program& program)
+{
+    program.set_constant("TILE_SIZE", _framebuffer->get_tile_size());
+    program.set_constant("GRID_SIZE", _framebuffer->get_grid_size());
+    program.set_constant("PATCH_SIZE", (int)reyes_config.reyes_patch_size());
+    program.set_constant("VIEWPORT_MIN_PIXEL", ivec2(0,0));
+    program.set_constant("VIEWPORT_MAX_PIXEL", _framebuffer->size());
+    program.set_constant("VIEWPORT_SIZE_PIXEL", _framebuffer->size());
+    program.set_constant("MAX_BLOCK_COUNT", _max_block_count);
+    program.set_constant("FRAMEBUFFER_SIZE", _framebuffer->size());
+    program.set_constant("BACKFACE_CULLING", reyes_config.backface_culling());
+    program.set_constant("CLEAR_COLOR", reyes_config.clear_color());
+    program.set_constant("CLEAR_DEPTH", 1.0f);
+    program.set_constant("PXLCOORD_SHIFT", reyes_config.subpixel_bits());
+    program.set_constant("DISPLACEMENT", reyes_config.displacement());
+    program.set_constant("ADAPTIVE_DICING", reyes_config.adaptive_dicing());
+    program.set_constant("DEFERRED_SHADING", reyes_config.deferred_shading());
+    program.set_constant("TILED_DEPTH", reyes_config.tiled_depth());
+}
+
+
+void Reyes::RendererCL::compile_reyes_program(int light_count)
+{
+    _shade_kernel.reset();
+    _count_tile_blocks_kernel.reset();
+    _scatter_tile_blocks_kernel.reset();
+    _sample_kernel.reset();
+    _resolve_kernel.reset();
+    _fill_cleared_tiles_kernel.reset();
+
+    _reyes_program.reset(new CL::Program());
+
+    set_program_constants(*_reyes_program);
+    _reyes_program->set_constant("LIGHT_COUNT", light_count);
+
+    _reyes_program->compile(_device, "reyes.cl");
+
+    _shade_kernel.reset(_reyes_program->get_kernel("shade"));
+
+    _count_tile_blocks_kernel.reset(_reyes_program->get_kernel("count_tile_blocks"));
+    _scatter_tile_blocks_kernel.reset(_reyes_program->get_kernel("scatter_tile_blocks"));
+
+    _sample_kernel.reset(_reyes_program->get_kernel("sample"));
+    _resolve_kernel.reset(_reyes_program->get_kernel("resolve"));
+    _fill_cleared_tiles_kernel.reset(_reyes_program->get_kernel("fill_cleared_tiles"));
+
+    _light_count = light_count;
+    _light_buffer.resize(light_count * 3 * sizeof(vec4));
+}
+
+
+void Reyes::RendererCL::set_lights(const vector<Light>& lights)
+{
+    _light_data.clear();
+
+    for (const Light& light : lights) {
+        _light_data.push_back(vec4(light.position, (float)light.type));
+        _light_data.push_back(vec4(light.direction, 0));
+        _light_data.push_back(vec4(light.color, 0));
+    }
+
+    // Scenes without lights keep the fixed light used before lights were supported
+    if (lights.empty()) {
+        _light_data.push_back(vec4(0, 0, 0, (float)Light::DIRECTIONAL));
+        _light_data.push_back(vec4(glm::normalize(vec3(4, 3, 8)), 0));
+        _light_data.push_back(vec4(1, 1, 1, 0));
+    }
+
+    int light_count = _light_data.size() / 3;
 
-    _rasterization_queue.enq_fill_buffer<cl_int>(_tile_locks,
-                                                 1, _framebuffer.size().x/8 * _framebuffer.size().y/8,
-                                                 "tile lock init", CL::Event());
+    // The light loop is unrolled for the light count, other changes only
+    // need the upload
+    if (light_count != _light_count) {
+        compile_reyes_program(light_count);
+    }
+
+    // Blocking, the next frame overwrites _light_data
+    CL::Event e = _rasterization_queue.enq_write_buffer(_light_buffer, _light_data.data(),
+                                                        _light_data.size() * sizeof(vec4), "upload lights", CL::Event());
+    _rasterization_queue.wait_for_events(e);
+}
+
+
+Reyes::RendererCL::GridSet::GridSet(CL::Device& device, size_t max_block_count, bool own_queue, int id)
+    : pos_grid(device,
+               reyes_config.reyes_patches_per_pass() * square(reyes_config.reyes_patch_size()+1) * sizeof(vec4),
+               CL_MEM_READ_WRITE, "grid-data")
+    , pxlpos_grid(device,
+                  reyes_config.reyes_patches_per_pass() * square(reyes_config.reyes_patch_size()+1) * sizeof(ivec2),
+                  CL_MEM_READ_WRITE, "grid-data")
+    , color_grid(device,
+                 (reyes_config.deferred_shading() ? 1 : reyes_config.reyes_patches_per_pass() * square(reyes_config.reyes_patch_size()))
+                 * sizeof(vec4),
+                 CL_MEM_READ_WRITE, "grid-data")
+    , depth_grid(device,
+                 reyes_config.reyes_patches_per_pass() * square(reyes_config.reyes_patch_size()+1) * sizeof(float),
+                 CL_MEM_READ_WRITE, "grid-data")
+    , block_index(device, max_block_count * sizeof(ivec4), CL_MEM_READ_WRITE, "block-index")
+    , patch_ids(device, reyes_config.reyes_patches_per_pass() * sizeof(cl_int), CL_MEM_READ_WRITE, "grid-data")
+    , range_colors(device, reyes_config.reyes_patches_per_pass() * sizeof(vec4), CL_MEM_READ_WRITE, "grid-data")
+    , range_count(0)
+{
+    if (own_queue) {
+        queue.reset(new CL::CommandQueue(device, "grid set " + lexical_cast<string>(id)));
+    }
 }
 
 
@@ -115,15 +256,24 @@ Reyes::RendererCL::~RendererCL()
 void Reyes::RendererCL::prepare()
 {
     _frame_event.begin(CL::Event());
+    _device.mark_frame(_frame_event.event());
 
     if (!reyes_config.dummy_render()) {
-        CL::Event e = _framebuffer.acquire(_framebuffer_queue, CL::Event());
-        e = _framebuffer.clear(_framebuffer_queue, e);
+        CL::Event e = _framebuffer->acquire(_framebuffer_queue, CL::Event());
 
-        _framebuffer_cleared =
-            _framebuffer_queue.enq_fill_buffer<cl_int>(_depth_buffer,
-                                                       0x7fffffff, _framebuffer.size().x * _framebuffer.size().y,
-                                                       "clear depthbuffer", e);
+        if (reyes_config.tiled_depth()) {
+            // Color and depth of flagged tiles read as cleared, see sample
+            _framebuffer_cleared =
+                _framebuffer_queue.enq_fill_buffer<ivec4>(_depth_tiles, ivec4(1, 0x7fffffff, 0x7fffffff, 0), _tile_count,
+                                                          "clear depth tiles", e);
+        } else {
+            e = _framebuffer->clear(_framebuffer_queue, e);
+
+            _framebuffer_cleared =
+                _framebuffer_queue.enq_fill_buffer<cl_int>(_depth_buffer,
+                                                           0x7fffffff, _framebuffer->size().x * _framebuffer->size().y,
+                                                           "clear depthbuffer", e);
+        }
 
         _framebuffer_queue.flush();
     } else {
@@ -140,21 +290,50 @@ void Reyes::RendererCL::finish()
     _bound_n_split->finish();
 
     if (!reyes_config.dummy_render()) {
-        _framebuffer.release(_framebuffer_queue, _last_batch);
-        _framebuffer.show();
+        sample_grid_set();
+
+        if (reyes_config.tiled_depth()) {
+            _fill_cleared_tiles_kernel->set_args(_depth_tiles, _framebuffer->get_buffer(),
+                                                 _framebuffer->get_clear_color());
+            _last_batch = _rasterization_queue.enq_kernel(*_fill_cleared_tiles_kernel,
+                                                          ivec3(8,8,_tile_count), ivec3(8,8,1),
+                                                          "fill cleared tiles", _framebuffer_cleared | _last_batch);
+        }
+
+        _framebuffer->release(_framebuffer_queue, _last_batch);
+        _framebuffer->show();
     }
 
+    // Keeps the tile list size for the first batch of the next frame
+    _rasterization_queue.wait_for_events(_tile_bin_total_read);
+
     _frame_event.end();
     _device.release_events();
 
     _last_batch = CL::Event();
+    _tile_bin_total_read = CL::Event();
+    _batch_released = CL::Event();
     _framebuffer_cleared = CL::Event();
+    _depth_pyramid_built = CL::Event();
+    _depth_pyramid_stale = true;
+
+    for (auto grid_set : _grid_sets) {
+        grid_set->range_count = 0;
+        grid_set->shaded = CL::Event();
+        grid_set->released = CL::Event();
+    }
 
     statistics.end_render();
 }
 
 
 
+void Reyes::RendererCL::read_framebuffer(vector<vec4>& pixels)
+{
+    _framebuffer->read_pixels(_framebuffer_queue, pixels);
+}
+
+
 bool Reyes::RendererCL::are_patches_loaded(void* patches_handle)
 {
     return _patch_index->are_patches_loaded(patches_handle);
@@ -167,21 +346,109 @@ void Reyes::RendererCL::load_patches(void* patches_handle, const vector<vec3>& p
 }
 
 
+void Reyes::RendererCL::load_patches(void* patches_handle, const vec4* patch_data, size_t point_count,
+                                     PatchType patch_type)
+{
+    _patch_index->load_patches(patches_handle, patch_data, point_count, patch_type);
+}
+
+
 void Reyes::RendererCL::draw_patches(void* patches_handle,
                                      const mat4& matrix,
                                      const Projection* projection,
                                      const vec4& color)
 {
+    _single_instance.assign(1, matrix);
+
+    draw_instances(patches_handle, _single_instance, projection, color);
+}
+
+
+void Reyes::RendererCL::draw_instances(void* patches_handle,
+                                       const vector<mat4>& matrices,
+                                       const Projection* projection,
+                                       const vec4& color)
+{
+    if (matrices.empty()) return;
+
+    size_t patch_count = _patch_index->get_patch_count(patches_handle);
+
+    if (patch_count == 0) return;
+
+    // Range ids of all instances have to fit the packed patch id
+    size_t max_instances = std::max<size_t>(MAX_RANGE_PID_COUNT / patch_count, 1);
+
+    if (matrices.size() > max_instances) {
+        for (size_t first = 0; first < matrices.size(); first += max_instances) {
+            size_t last = std::min(first + max_instances, matrices.size());
+
+            _instance_chunk.assign(matrices.begin() + first, matrices.begin() + last);
+            draw_instances(patches_handle, _instance_chunk, projection, color);
+        }
+        return;
+    }
+
     mat4 proj;
     projection->calc_projection(proj);
 
-    _bound_n_split->init(patches_handle, matrix, projection);
+    const vector<int>* patch_ids = nullptr;
+    const PatchBVH* bvh = _patch_index->get_bvh(patches_handle);
+
+    if (bvh) {
+        // Displacement may push points up to 0.07 units out of the hull
+        float margin = reyes_config.displacement() ? 0.07f : 0.0f;
+
+        _visible_patches.clear();
+        for (size_t i = 0; i < matrices.size(); ++i) {
+            size_t first = _visible_patches.size();
+            bvh->cull(matrices[i], *projection, margin, _visible_patches);
+
+            for (size_t j = first; j < _visible_patches.size(); ++j) {
+                _visible_patches[j] += i * patch_count;
+            }
+        }
+
+        if (_visible_patches.empty()) {
+            return;
+        }
+
+        if (_visible_patches.size() < patch_count * matrices.size()) {
+            // Stays untouched until bound & split is done with this object
+            patch_ids = &_visible_patches;
+        }
+    }
+
+    CL::Event bound_n_split_ready = _batch_released;
+
+    if (_depth_pyramid->enabled()) {
+        // Occlusion is tested against everything sampled before this object;
+        // ranges still waiting in the open grid set are not part of it
+        if (_depth_pyramid_stale) {
+            if (reyes_config.tiled_depth()) {
+                _depth_pyramid_built = _depth_pyramid->build_from_tiles(_rasterization_queue, _depth_tiles,
+                                                                        _framebuffer_cleared | _last_batch);
+            } else {
+                _depth_pyramid_built = _depth_pyramid->build(_rasterization_queue, _depth_buffer,
+                                                             _framebuffer_cleared | _last_batch);
+            }
+
+            // Sampling must not write the depth buffer while it is read
+            _last_batch = _depth_pyramid_built;
+            _depth_pyramid_stale = false;
+        }
+
+        // Only the first bound & split of this object waits for the pyramid
+        bound_n_split_ready = bound_n_split_ready | _depth_pyramid_built;
+    }
+
+    _bound_n_split->init(patches_handle, matrices, projection, patch_ids, bound_n_split_ready);
 
     PatchType patch_type = _patch_index->get_patch_type(patches_handle);
 
     while (!_bound_n_split->done()) {
 
-        Batch batch = _bound_n_split->do_bound_n_split(_last_batch);
+        // Bound & split may refill its buffers once dice and shade are done
+        Batch batch = _bound_n_split->do_bound_n_split(_batch_released);
 
 
         if (!reyes_config.dummy_render()) {
@@ -192,69 +459,181 @@ void Reyes::RendererCL::draw_patches(void* patches_handle,
                 out_color = vec4(pass_count,1.0f,1.0f,1.0f);
             }
 
-            _last_batch = send_batch(batch, matrix, proj, out_color, patch_type, batch.transfer_done | _last_batch);
+            send_batch(batch, proj, out_color, patch_type, batch.transfer_done, _batch_released);
         } else {
             _last_batch = batch.transfer_done;
+            _batch_released = batch.transfer_done;
         }
     }
 }
 
 
-CL::Event Reyes::RendererCL::send_batch(Reyes::Batch& batch,
-                                        const mat4& matrix, const mat4& proj, const vec4& color, PatchType patch_type,
-                                        const CL::Event& ready)
+void Reyes::RendererCL::send_batch(Reyes::Batch& batch,
+                                   const mat4& proj, const vec4& color, PatchType patch_type,
+                                   const CL::Event& ready, CL::Event& batch_released)
 {
 
     // We can't handle more patches on the fly atm
     int patch_count = std::min<int>(reyes_config.reyes_patches_per_pass(), batch.patch_count);
 
     if (patch_count == 0) {
-        return _last_batch;
+        batch_released = ready;
+        return;
+    }
+
+    if (_grid_sets[_next_grid_set]->range_count + patch_count > (int)reyes_config.reyes_patches_per_pass()) {
+        sample_grid_set();
     }
 
+    GridSet& grid_set = *_grid_sets[_next_grid_set];
+
+    CL::CommandQueue& grid_queue = grid_set.queue ? *grid_set.queue : _rasterization_queue;
+    CL::Event grid_ready = ready | grid_set.released;
+
     CL::Event e;
 
     const int patch_size  = reyes_config.reyes_patch_size();
     const int group_width = reyes_config.dice_group_width();
 
+    // Ranges are appended behind those already in the set
+    const int range_offset = grid_set.range_count;
+
+    // Sample still needs the dice rates after bound & split moved on
+    CL::Event ids_copied = grid_queue.enq_copy_buffer(batch.patch_ids, grid_set.patch_ids, patch_count * sizeof(cl_int),
+                                                      0, range_offset * sizeof(cl_int),
+                                                      "copy patch ids", grid_ready);
+
     // DICE
     switch (patch_type) {
     case BEZIER:
         _dice_bezier_kernel->set_args(batch.patch_buffer, batch.patch_ids, batch.patch_min, batch.patch_max,
-                                      _pos_grid, _pxlpos_grid, _depth_grid,
-                                      matrix, proj);
+                                      grid_set.pos_grid, grid_set.pxlpos_grid, grid_set.depth_grid,
+                                      batch.instance_buffer, (cl_int)batch.instance_patch_count,
+                                      proj, (cl_int)range_offset);
+        if (batch.patch_edges) {
+            _dice_bezier_kernel->set_arg(11, *batch.patch_edges);
+        }
 
-        e = _rasterization_queue.enq_kernel(*_dice_bezier_kernel,
-                                            ivec3(patch_size + group_width, patch_size + group_width, patch_count),
-                                            ivec3(group_width, group_width, 1),
-                                            "dice", ready);
+        e = grid_queue.enq_kernel(*_dice_bezier_kernel,
+                                  ivec3(patch_size + group_width, patch_size + group_width, patch_count),
+                                  ivec3(group_width, group_width, 1),
+                                  "dice", grid_ready);
         break;
     case GREGORY:
         _dice_gregory_kernel->set_args(batch.patch_buffer, batch.patch_ids, batch.patch_min, batch.patch_max,
-                                      _pos_grid, _pxlpos_grid, _depth_grid,
-                                      matrix, proj);
+                                      grid_set.pos_grid, grid_set.pxlpos_grid, grid_set.depth_grid,
+                                      batch.instance_buffer, (cl_int)batch.instance_patch_count,
+                                      proj, (cl_int)range_offset);
+        if (batch.patch_edges) {
+            _dice_gregory_kernel->set_arg(11, *batch.patch_edges);
+        }
 
-        e = _rasterization_queue.enq_kernel(*_dice_gregory_kernel,
-                                            ivec3(patch_size + group_width, patch_size + group_width, patch_count),
-                                            ivec3(group_width, group_width, 1),
-                                            "dice", ready);
+        e = grid_queue.enq_kernel(*_dice_gregory_kernel,
+                                  ivec3(patch_size + group_width, patch_size + group_width, patch_count),
+                                  ivec3(group_width, group_width, 1),
+                                  "dice", grid_ready);
         break;
     }
 
 
     // SHADE
-    _shade_kernel->set_args(_pos_grid, _pxlpos_grid, _block_index, _color_grid, color);
-    e = _rasterization_queue.enq_kernel(*_shade_kernel, ivec3(patch_size, patch_size, patch_count),  ivec3(8,8,1),
-                                        "shade", e);
+    _shade_kernel->set_args(grid_set.patch_ids, grid_set.pos_grid, grid_set.pxlpos_grid, grid_set.block_index,
+                            grid_set.color_grid, grid_set.range_colors, _light_buffer, color, (cl_int)range_offset);
+    e = grid_queue.enq_kernel(*_shade_kernel, ivec3(patch_size, patch_size, patch_count),  ivec3(8,8,1),
+                              "shade", e | ids_copied);
+
+    batch_released = e;
+
+    grid_set.range_count += patch_count;
+    grid_set.shaded = grid_set.shaded | e;
+
+    if (grid_set.queue) {
+        grid_set.queue->flush();
+    }
+
+    if (!reyes_config.batch_objects()) {
+        sample_grid_set();
+    }
+}
+
+
+void Reyes::RendererCL::sample_grid_set()
+{
+    GridSet& grid_set = *_grid_sets[_next_grid_set];
+
+    if (grid_set.range_count == 0) {
+        return;
+    }
+
+    _next_grid_set = (_next_grid_set + 1) % _grid_sets.size();
+
+    const int patch_size = reyes_config.reyes_patch_size();
 
+    // Tile bins are shared, so binning waits for the previous batch to be sampled
+    CL::Event e = grid_set.shaded | _last_batch;
+
+    // BIN
+    int block_count = grid_set.range_count * square(patch_size/8);
+
+    // The size of the tile lists is only known after counting. Instead of
+    // waiting for it, the lists grow once the size of an earlier batch has
+    // been read back. Until then, tiles whose list doesn't fit into
+    // tile_blocks are sampled from all blocks of the batch.
+    if (_rasterization_queue.events_complete(_tile_bin_total_read)) {
+        size_t bin_count = _tile_bin_total.host_ref<cl_int>();
+        if (_tile_blocks.get_size() < bin_count * sizeof(cl_int)) {
+            _tile_blocks.resize(2 * bin_count * sizeof(cl_int));
+        }
+        _tile_bin_total_read = CL::Event();
+    }
+
+    cl_int tile_block_capacity = _tile_blocks.get_size() / sizeof(cl_int);
+    
+    e = _rasterization_queue.enq_fill_buffer<cl_int>(_tile_counts, 0, _tile_count, "clear tile counts", e);
+
+    _count_tile_blocks_kernel->set_args(grid_set.block_index, _tile_counts, (cl_int)block_count);
+    e = _rasterization_queue.enq_kernel(*_count_tile_blocks_kernel, (int)round_up_by(block_count, 64), 64,
+                                        "count tile blocks", e);
+
+    e = _tile_prefix_sum.apply(_tile_count, _rasterization_queue, _tile_counts, _tile_offsets, _tile_bin_total, e);
+
+    // Only one read is in flight, so the host copy is never written while it is used
+    if (_tile_bin_total_read.get_id_count() == 0) {
+        _tile_bin_total_read = _rasterization_queue.enq_read_buffer(_tile_bin_total, _tile_bin_total.void_ptr(),
+                                                                    sizeof(cl_int), "read tile bin count", e);
+    }
+
+    _scatter_tile_blocks_kernel->set_args(grid_set.block_index, _tile_offsets, _tile_blocks, tile_block_capacity,
+                                          (cl_int)block_count);
+    e = _rasterization_queue.enq_kernel(*_scatter_tile_blocks_kernel, (int)round_up_by(block_count, 64), 64,
+                                        "scatter tile blocks", e);
+    
     // SAMPLE
-    _sample_kernel->set_args(_block_index, _pxlpos_grid, _color_grid, _depth_grid,
-                             _tile_locks, _framebuffer.get_buffer(), _depth_buffer);
-    e = _rasterization_queue.enq_kernel(*_sample_kernel, ivec3(8,8,patch_count * square(patch_size/8)), ivec3(8,8,1),
+    _sample_kernel->set_args(_tile_counts, _tile_offsets, _tile_blocks, tile_block_capacity,
+                             grid_set.block_index, (cl_int)block_count,
+                             grid_set.patch_ids, grid_set.pxlpos_grid, grid_set.color_grid, grid_set.depth_grid,
+                             _framebuffer->get_buffer(), _depth_buffer, _depth_tiles, _visibility_buffer,
+                             (cl_int)_sample_batch_id, _framebuffer->get_clear_color());
+    e = _rasterization_queue.enq_kernel(*_sample_kernel, ivec3(8,8,_tile_count), ivec3(8,8,1),
                                         "sample", _framebuffer_cleared | e);
     _framebuffer_cleared = CL::Event();
 
-    _rasterization_queue.flush();
+    // RESOLVE
+    if (reyes_config.deferred_shading()) {
+        _resolve_kernel->set_args(_tile_counts, grid_set.patch_ids, grid_set.pos_grid, grid_set.range_colors,
+                                  _light_buffer, _visibility_buffer, _framebuffer->get_buffer(), (cl_int)_sample_batch_id);
+        e = _rasterization_queue.enq_kernel(*_resolve_kernel, ivec3(8,8,_tile_count), ivec3(8,8,1),
+                                            "resolve", e);
+    }
 
-    return e;
+    _sample_batch_id = (_sample_batch_id + 1) & 0x7fffffff;
+    _depth_pyramid_stale = true;
+
+    grid_set.range_count = 0;
+    grid_set.shaded = CL::Event();
+    grid_set.released = e;
+
+    _last_batch = e;
+
+    _rasterization_queue.flush();
 }
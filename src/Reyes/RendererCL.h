@@ -18,6 +18,7 @@
 #pragma once
 
 #include "CL/OpenCL.h"
+#include "CL/PrefixSum.h"
 #include "Framebuffer.h"
 #include "PatchIndex.h"
 #include "Renderer.h"
@@ -27,6 +28,7 @@ namespace Reyes
     class Batch;
     class PatchIndex;
     class BoundNSplitCL;
+    class DepthPyramid;
 
     class RendererCL : public Renderer
     {
@@ -37,32 +39,90 @@ namespace Reyes
         // CL::CommandQueue _bound_n_split_queue;
         CL::CommandQueue _rasterization_queue;
         
-        OGLSharedFramebuffer _framebuffer;
+        scoped_ptr<Framebuffer> _framebuffer;
 
         shared_ptr<PatchIndex> _patch_index;
         shared_ptr<BoundNSplitCL> _bound_n_split;
+        shared_ptr<DepthPyramid> _depth_pyramid;
         
         size_t _max_block_count;
+        size_t _tile_count;
 
-        CL::Buffer _pos_grid;
-        CL::Buffer _pxlpos_grid;
-        CL::Buffer _color_grid;
-        CL::Buffer _depth_grid;
-        CL::Buffer _block_index;
-        CL::Buffer _tile_locks;
+        // Buffers written by dice and shade and read by sample, one per
+        // batch in flight
+        struct GridSet
+        {
+            CL::Buffer pos_grid;
+            CL::Buffer pxlpos_grid;
+            CL::Buffer color_grid;
+            CL::Buffer depth_grid;
+            CL::Buffer block_index;
+            CL::Buffer patch_ids;
+            CL::Buffer range_colors;
+
+            shared_ptr<CL::CommandQueue> queue;
+
+            // Ranges diced into the set so far, possibly of several objects
+            int range_count;
+
+            // Dice and shade of all ranges in the set finished
+            CL::Event shaded;
+
+            // Sampling finished, set may be reused
+            CL::Event released;
+
+            GridSet(CL::Device& device, size_t max_block_count, bool own_queue, int id);
+        };
+
+        vector<shared_ptr<GridSet> > _grid_sets;
+        size_t _next_grid_set;
+
+        CL::Buffer _tile_counts;
+        CL::Buffer _tile_offsets;
+        CL::Buffer _tile_blocks;
+        CL::TransferBuffer _tile_bin_total;
+        CL::Event _tile_bin_total_read;
+        CL::PrefixSum _tile_prefix_sum;
         CL::Buffer _depth_buffer;
+
+        // Tiled depth: cleared flag, min and max depth per 8x8 pixel tile
+        CL::Buffer _depth_tiles;
+
+        // Deferred shading: closest micropolygon id and batch id per pixel
+        CL::Buffer _visibility_buffer;
+        int _sample_batch_id;
         
-        CL::Program _reyes_program;
+        // Rebuilt when the number of lights changes
+        scoped_ptr<CL::Program> _reyes_program;
         CL::Program _dice_bezier_program;
         CL::Program _dice_gregory_program;
 
         scoped_ptr<CL::Kernel> _dice_bezier_kernel;
         scoped_ptr<CL::Kernel> _dice_gregory_kernel;
         scoped_ptr<CL::Kernel> _shade_kernel;
+        scoped_ptr<CL::Kernel> _count_tile_blocks_kernel;
+        scoped_ptr<CL::Kernel> _scatter_tile_blocks_kernel;
         scoped_ptr<CL::Kernel> _sample_kernel;
+        scoped_ptr<CL::Kernel> _resolve_kernel;
+        scoped_ptr<CL::Kernel> _fill_cleared_tiles_kernel;
+
+        // Position, direction and color of every light, see set_lights
+        CL::Buffer _light_buffer;
+        vector<vec4> _light_data;
+        int _light_count;
+
+        vector<int> _visible_patches;
+        vector<mat4> _single_instance;
+        vector<mat4> _instance_chunk;
 
         CL::Event _last_batch;
+        CL::Event _batch_released;
         CL::Event _framebuffer_cleared;
+
+        // The depth pyramid is rebuilt for the next object once a grid set
+        // has been sampled since the last build
+        CL::Event _depth_pyramid_built;
+        bool _depth_pyramid_stale;
         CL::UserEvent _frame_event;
 
 
@@ -76,21 +136,43 @@ namespace Reyes
         
         virtual bool are_patches_loaded(void* patches_handle);
         virtual void load_patches(void* patches_handle, const vector<vec3>& patch_data, PatchType type);
+        virtual void load_patches(void* patches_handle, const vec4* patch_data, size_t point_count, PatchType type);
         
         virtual void draw_patches(void* patches_handle,
                                   const mat4& matrix,
                                   const Projection* projection,
                                   const vec4& color);
 
+        virtual void draw_instances(void* patches_handle,
+                                    const vector<mat4>& matrices,
+                                    const Projection* projection,
+                                    const vec4& color);
+
+        virtual void set_lights(const vector<Light>& lights);
+
         virtual void dump_trace()
         {
             _device.dump_trace();
         }
 
+        void collect_event_times(map<string, uint64_t>* times)
+        {
+            _device.collect_event_times(times);
+        }
+
+        // Pixels of the last finished frame, see Framebuffer::read_pixels
+        void read_framebuffer(vector<vec4>& pixels);
+        ivec2 framebuffer_size() { return _framebuffer->size(); }
+
     private:
 
+        void set_program_constants(CL::Program& program);
+        void compile_reyes_program(int light_count);
+
         void set_projection(const Projection& projection);
-        CL::Event send_batch(Reyes::Batch& batch, const mat4& matrix, const mat4& proj, const vec4& color, PatchType patch_type, const CL::Event& ready);
+        void send_batch(Reyes::Batch& batch, const mat4& proj, const vec4& color, PatchType patch_type,
+                        const CL::Event& ready, CL::Event& batch_released);
+        void sample_grid_set();
 
     };
 }
@@ -0,0 +1,568 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#include "common.h"
+
+#include "RendererCPU.h"
+
+#include "Patch.h"
+#include "Projection.h"
+#include "ReyesConfig.h"
+#include "Statistics.h"
+
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
+#define PATCH_SIZE ((int)reyes_config.reyes_patch_size())
+#define PXLCOORD_SHIFT ((int)reyes_config.subpixel_bits())
+#define MAX_LOCAL_COORD ((8 << PXLCOORD_SHIFT) - 1)
+
+
+namespace
+{
+    /**
+     * Fixed point edge functions of a triangle, set up like
+     * inside_triangle() in reyes.cl.
+     */
+    struct Triangle
+    {
+        int dx[3], dy[3], o[3], c[3];
+        float w[3]; // Vertex depth divided by the barycentric denominator
+
+        bool setup(const ivec2* p, const float* d)
+        {
+            for (int i = 0; i < 3; ++i) {
+                int j = (i+1) % 3;
+                dx[i] = p[j].y - p[i].y;
+                dy[i] = p[i].x - p[j].x;
+                o[i]  = dx[i] * p[i].x + dy[i] * p[i].y;
+                c[i]  = (dx[i] > 0 || (dx[i] == 0 && dy[i] > 0)) ? -1 : 0;
+            }
+
+            for (int k = 0; k < 3; ++k) {
+                int j = (k+1) % 3;
+                int denominator = dx[j] * p[k].x + dy[j] * p[k].y - o[j];
+
+                if (denominator == 0) return false;
+
+                w[k] = d[k] / denominator;
+            }
+
+            return true;
+        }
+
+        /**
+         * Test four samples (x + i*step, y) and keep the nearest depth
+         * for the covered ones.
+         * @return Bit mask of covered samples.
+         */
+        int test4(int x, int y, int step, float* depth) const
+        {
+#ifdef __SSE4_1__
+            __m128i xs = _mm_setr_epi32(x, x + step, x + 2*step, x + 3*step);
+            __m128i inside = _mm_set1_epi32(-1);
+            __m128i v[3];
+
+            for (int i = 0; i < 3; ++i) {
+                v[i] = _mm_add_epi32(_mm_mullo_epi32(_mm_set1_epi32(dx[i]), xs),
+                                     _mm_set1_epi32(dy[i] * y - o[i]));
+                inside = _mm_and_si128(inside, _mm_cmpgt_epi32(v[i], _mm_set1_epi32(c[i])));
+            }
+
+            int mask = _mm_movemask_ps(_mm_castsi128_ps(inside));
+
+            if (!mask) return 0;
+
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(w[0]), _mm_cvtepi32_ps(v[1])),
+                                             _mm_mul_ps(_mm_set1_ps(w[1]), _mm_cvtepi32_ps(v[2]))),
+                                  _mm_mul_ps(_mm_set1_ps(w[2]), _mm_cvtepi32_ps(v[0])));
+            float ds[4];
+            _mm_storeu_ps(ds, d);
+
+            for (int l = 0; l < 4; ++l) {
+                if ((mask & (1 << l)) && ds[l] < depth[l]) {
+                    depth[l] = ds[l];
+                }
+            }
+
+            return mask;
+#else
+            int mask = 0;
+
+            for (int l = 0; l < 4; ++l) {
+                int v[3];
+                bool inside = true;
+
+                for (int i = 0; i < 3; ++i) {
+                    v[i] = dx[i] * (x + l*step) + dy[i] * y - o[i];
+                    inside = inside && v[i] > c[i];
+                }
+
+                if (!inside) continue;
+
+                float d = w[0] * v[1] + w[1] * v[2] + w[2] * v[0];
+                depth[l] = minimum(d, depth[l]);
+                mask |= 1 << l;
+            }
+
+            return mask;
+#endif
+        }
+    };
+
+
+    bool is_front_facing(const ivec2* ps)
+    {
+        if (!reyes_config.backface_culling()) return true;
+
+        ivec2 d1 = ps[1] - ps[0];
+        ivec2 d2 = ps[2] - ps[0];
+        ivec2 d3 = ps[3] - ps[0];
+
+        return (d1.x*d3.y-d3.x*d1.y < 0 || d3.x*d2.y-d2.x*d3.y < 0);
+    }
+
+
+    size_t calc_grid_pos(int nu, int nv)
+    {
+        return nu + nv * (PATCH_SIZE+1);
+    }
+}
+
+
+Reyes::RendererCPU::RendererCPU()
+    : _threads(reyes_config.cpu_render_threads())
+    , _grids(_threads.size())
+    , _bound_n_split(_threads, _patch_index)
+    , _size(reyes_config.window_size())
+    , _tile_size(reyes_config.framebuffer_tile_size())
+    , _grid_size(ceil((float)_size.x/_tile_size), ceil((float)_size.y/_tile_size))
+    , _act_size(_grid_size * _tile_size)
+    , _color_buffer(_act_size.x * _act_size.y)
+    , _depth_buffer(_act_size.x * _act_size.y)
+    , _tile_locks(round_up_div(_size.x, 8) * round_up_div(_size.y, 8))
+    , _tex_buffer(_act_size.x * _act_size.y * sizeof(vec4), GL_RGBA32F)
+    , _shader("tex_draw")
+    , _screen_quad(6)
+    , _batch(reyes_config.reyes_patches_per_pass())
+    , _dice_levels(reyes_config.reyes_patches_per_pass())
+{
+    size_t grid_size = square(PATCH_SIZE+1);
+
+    for (Grid& grid : _grids) {
+        grid.pos.resize(grid_size);
+        grid.pxlpos.resize(grid_size);
+        grid.depth.resize(grid_size);
+        grid.color.resize(square(PATCH_SIZE));
+    }
+
+    _screen_quad.vertex(-1,-1);
+    _screen_quad.vertex( 1,-1);
+    _screen_quad.vertex( 1, 1);
+
+    _screen_quad.vertex(-1,-1);
+    _screen_quad.vertex( 1, 1);
+    _screen_quad.vertex(-1, 1);
+
+    _screen_quad.send_data(false);
+
+    set_lights(vector<Light>());
+}
+
+
+Reyes::RendererCPU::~RendererCPU()
+{
+}
+
+
+void Reyes::RendererCPU::prepare()
+{
+    vec4 clear_color = reyes_config.clear_color();
+    clear_color = vec4(powf(clear_color.x, 2.2),
+                       powf(clear_color.y, 2.2),
+                       powf(clear_color.z, 2.2), 1000);
+
+    std::fill(_color_buffer.begin(), _color_buffer.end(), clear_color);
+    std::fill(_depth_buffer.begin(), _depth_buffer.end(), std::numeric_limits<float>::infinity());
+
+    statistics.start_render();
+}
+
+
+void Reyes::RendererCPU::finish()
+{
+    _bound_n_split.finish();
+
+    if (!reyes_config.dummy_render()) {
+        _tex_buffer.load(_color_buffer.data());
+
+        glDisable(GL_DEPTH_TEST);
+
+        _tex_buffer.bind();
+        _shader.bind();
+
+        _shader.set_uniform("framebuffer", _tex_buffer);
+        _shader.set_uniform("bsize", _tile_size);
+        _shader.set_uniform("gridsize", _grid_size);
+
+        _screen_quad.draw(GL_TRIANGLES, _shader);
+
+        _shader.unbind();
+        _tex_buffer.unbind();
+    }
+
+    statistics.end_render();
+}
+
+
+bool Reyes::RendererCPU::are_patches_loaded(void* patches_handle)
+{
+    return _patch_index.are_patches_loaded(patches_handle);
+}
+
+
+void Reyes::RendererCPU::load_patches(void* patches_handle, const vector<vec3>& patch_data, PatchType patch_type)
+{
+    _patch_index.load_patches(patches_handle, patch_data, patch_type);
+}
+
+
+void Reyes::RendererCPU::draw_patches(void* patches_handle,
+                                      const mat4& matrix,
+                                      const Projection* projection,
+                                      const vec4& color)
+{
+    mat4 proj;
+    projection->calc_projection(proj);
+
+    _single_instance.assign(1, matrix);
+
+    statistics.start_bound_n_split();
+
+    _bound_n_split.init(patches_handle, _single_instance, projection, nullptr);
+
+    while (!_bound_n_split.done()) {
+        size_t range_count = _bound_n_split.run(_batch.data(), _dice_levels.data(), _batch.size());
+
+        statistics.stop_bound_n_split();
+        send_batch(patches_handle, range_count, matrix, proj, color);
+        statistics.start_bound_n_split();
+    }
+
+    statistics.stop_bound_n_split();
+}
+
+
+void Reyes::RendererCPU::set_lights(const vector<Light>& lights)
+{
+    _lights = lights;
+
+    // Scenes without lights keep the fixed light used before lights were supported
+    if (_lights.empty()) {
+        _lights.push_back(Light{Light::DIRECTIONAL, vec3(0), glm::normalize(vec3(4,3,8)), vec3(1)});
+    }
+}
+
+
+void Reyes::RendererCPU::send_batch(void* patches_handle, size_t range_count,
+                                    const mat4& matrix, const mat4& proj, const vec4& color)
+{
+    if (range_count == 0) return;
+
+    statistics.add_patches(range_count);
+    statistics.inc_pass_count(1);
+
+    if (!reyes_config.dummy_render()) {
+        const vector<vec3>& patches = _patch_index.get_patch_vector(patches_handle);
+        PatchType patch_type = _patch_index.get_patch_type(patches_handle);
+
+        vec4 out_color = color;
+
+        if (reyes_config.pass_color_mode()) {
+            float pass_count = statistics.get_pass_count() / 100.0f * 360;
+            out_color = vec4(pass_count,1.0f,1.0f,1.0f);
+        }
+
+        std::atomic<size_t> next(0);
+
+        _threads.run([&](size_t worker) {
+                Grid& grid = _grids[worker];
+
+                for (size_t i = next++; i < range_count; i = next++) {
+                    dice(patches, patch_type, _batch[i], matrix, proj, grid);
+                    shade(out_color, grid);
+                    sample(grid);
+                }
+            });
+    }
+}
+
+
+void Reyes::RendererCPU::dice(const vector<vec3>& patches, PatchType patch_type, const PatchRange& range,
+                              const mat4& matrix, const mat4& proj, Grid& grid)
+{
+    const vec2 viewport_size = vec2(_size.x << PXLCOORD_SHIFT, _size.y << PXLCOORD_SHIFT);
+
+    for (int nv = 0; nv <= PATCH_SIZE; ++nv) {
+        for (int nu = 0; nu <= PATCH_SIZE; ++nu) {
+            vec2 uv = glm::mix(range.range.min, range.range.max, vec2(nu/(float)PATCH_SIZE, nv/(float)PATCH_SIZE));
+            vec3 p;
+
+            if (reyes_config.diagsplit()) {
+                uv = BoundNSplitCPU::snap_to_edges(range, nu, nv, PATCH_SIZE, uv);
+            }
+
+            switch (patch_type) {
+            case BEZIER:
+                eval_patch(*(const BezierPatch*)&patches[16*range.patch_id], uv.y, uv.x, p);
+                break;
+            case GREGORY:
+                eval_gregory_patch(&patches[20*range.patch_id], uv.y, uv.x, p);
+                break;
+            }
+
+            vec4 pos = matrix * vec4(p, 1);
+
+            if (reyes_config.displacement()) {
+                const float f1=0.04f;
+                const float f2=0.02f;
+                const float f3=0.01f;
+
+                pos.x += sinf(pos.y*5*2) * f1;
+                pos.y += sinf(pos.x*5*2) * f1;
+                pos.z += sinf(pos.y*5*2) * sinf(pos.x*3*2) * f1;
+
+                pos.x += sinf(pos.y*7*2) * f2;
+                pos.y += sinf(pos.x*7*2) * f2;
+                pos.z += sinf(pos.y*7*2) * sinf(pos.x*3*2) * f2;
+
+                pos.x += sinf(pos.y*11*2) * f3;
+                pos.y += sinf(pos.x*11*2) * f3;
+                pos.z += sinf(pos.y*11*2) * sinf(pos.x*3*2) * f3;
+            }
+
+            vec4 pp = proj * pos;
+
+            size_t i = calc_grid_pos(nu, nv);
+
+            grid.pos[i] = pos;
+            grid.pxlpos[i] = ivec2((int)(pp.x/pp.w * viewport_size.x/2 + viewport_size.x/2),
+                                   (int)(pp.y/pp.w * viewport_size.y/2 + viewport_size.y/2));
+            grid.depth[i] = pp.z/pp.w;
+        }
+    }
+}
+
+
+void Reyes::RendererCPU::shade(const vec4& color, Grid& grid)
+{
+    const vec4 ac = vec4(0.015,0.015,0.015,1);
+
+    for (int nv = 0; nv < PATCH_SIZE; ++nv) {
+        for (int nu = 0; nu < PATCH_SIZE; ++nu) {
+            const vec4& p0 = grid.pos[calc_grid_pos(nu,   nv  )];
+            const vec4& p1 = grid.pos[calc_grid_pos(nu+1, nv  )];
+            const vec4& p2 = grid.pos[calc_grid_pos(nu,   nv+1)];
+            const vec4& p3 = grid.pos[calc_grid_pos(nu+1, nv+1)];
+
+            vec3 du = vec3(p1 - p0 + p3 - p2) * 0.5f;
+            vec3 dv = vec3(p2 - p0 + p3 - p1) * 0.5f;
+
+            vec3 n = glm::normalize(glm::cross(dv, du));
+            vec3 p = vec3(p0 + p1 + p2 + p3) * 0.25f;
+
+            vec4 c = ac * color;
+
+            // Same lighting as shade_micropolygon in reyes.cl, without the
+            // specular term, which is black there
+            for (const Light& light : _lights) {
+                vec3 l = light.type == Light::POINT ? glm::normalize(light.position - p) : light.direction;
+
+                float n_dot_l = glm::dot(n, l);
+                float diffuse = light.type == Light::HEMI ? 0.5f + 0.5f * n_dot_l : maximum(n_dot_l, 0.0f);
+
+                c += vec4(light.color, 1) * diffuse * color;
+            }
+
+            grid.color[nu + nv * PATCH_SIZE] = c;
+        }
+    }
+}
+
+
+void Reyes::RendererCPU::sample(const Grid& grid)
+{
+    for (int bv = 0; bv < PATCH_SIZE/8; ++bv) {
+        for (int bu = 0; bu < PATCH_SIZE/8; ++bu) {
+            sample_block(grid, bu, bv);
+        }
+    }
+}
+
+
+void Reyes::RendererCPU::sample_block(const Grid& grid, int bu, int bv)
+{
+    const ivec2 viewport_min = ivec2(0);
+    const ivec2 viewport_max = ivec2((_size.x << PXLCOORD_SHIFT) - 1, (_size.y << PXLCOORD_SHIFT) - 1);
+
+    // Set up the micropolygons of the 8x8 block
+    struct Micropolygon
+    {
+        Triangle triangles[2];
+        bool valid[2];
+        ivec2 min, max;
+        vec4 color;
+    };
+
+    Micropolygon polys[64];
+    int poly_count = 0;
+
+    ivec2 block_min = viewport_max;
+    ivec2 block_max = viewport_min;
+
+    for (int v = bv * 8; v < bv * 8 + 8; ++v) {
+        for (int u = bu * 8; u < bu * 8 + 8; ++u) {
+            ivec2 ps[4];
+            float ds[4];
+
+            for (int idx = 0; idx < 4; ++idx) {
+                size_t i = calc_grid_pos(u + (idx&1), v + (idx>>1));
+
+                // Cull the block if it touches the eye plane
+                if (grid.pos[i].z == 0) return;
+
+                ps[idx] = grid.pxlpos[i];
+                ds[idx] = grid.depth[i];
+            }
+
+            if (!is_front_facing(ps)) continue;
+
+            Micropolygon& poly = polys[poly_count++];
+
+            poly.min = glm::min(glm::min(ps[0], ps[1]), glm::min(ps[2], ps[3]));
+            poly.max = glm::max(glm::max(ps[0], ps[1]), glm::max(ps[2], ps[3]));
+            poly.color = grid.color[u + v * PATCH_SIZE];
+
+            // Triangles 0-1-3 and 0-3-2
+            ivec2 t0[3] = {ps[0], ps[1], ps[3]};
+            float d0[3] = {ds[0], ds[1], ds[3]};
+            ivec2 t1[3] = {ps[0], ps[3], ps[2]};
+            float d1[3] = {ds[0], ds[3], ds[2]};
+            poly.valid[0] = poly.triangles[0].setup(t0, d0);
+            poly.valid[1] = poly.triangles[1].setup(t1, d1);
+
+            block_min = glm::min(block_min, poly.min);
+            block_max = glm::max(block_max, poly.max);
+        }
+    }
+
+    block_min = glm::max(block_min, viewport_min);
+    block_max = glm::min(block_max, viewport_max);
+
+    if (block_min.x > block_max.x || block_min.y > block_max.y) return;
+
+    ivec2 min_tile = ivec2(block_min.x >> (PXLCOORD_SHIFT + 3), block_min.y >> (PXLCOORD_SHIFT + 3));
+    ivec2 max_tile = ivec2(block_max.x >> (PXLCOORD_SHIFT + 3), block_max.y >> (PXLCOORD_SHIFT + 3));
+
+    const int tiles_per_line = round_up_div(_size.x, 8);
+    const int step = 1 << PXLCOORD_SHIFT;
+
+    for     (int ty = min_tile.y; ty <= max_tile.y; ++ty) {
+        for (int tx = min_tile.x; tx <= max_tile.x; ++tx) {
+            ivec2 o  = ivec2(tx*8, ty*8);
+            ivec2 os = ivec2(o.x << PXLCOORD_SHIFT, o.y << PXLCOORD_SHIFT);
+
+            float depths[8][8];
+            vec4  colors[8][8];
+            bool  touched = false;
+
+            for (int y = 0; y < 8; ++y) {
+                for (int x = 0; x < 8; ++x) {
+                    depths[y][x] = std::numeric_limits<float>::infinity();
+                }
+            }
+
+            for (int pi = 0; pi < poly_count; ++pi) {
+                const Micropolygon& poly = polys[pi];
+
+                ivec2 min_p = glm::clamp(poly.min - os, 0, MAX_LOCAL_COORD);
+                ivec2 max_p = glm::clamp(poly.max - os, 0, MAX_LOCAL_COORD);
+
+                min_p = ivec2(min_p.x >> PXLCOORD_SHIFT, min_p.y >> PXLCOORD_SHIFT);
+                max_p = ivec2(max_p.x >> PXLCOORD_SHIFT, max_p.y >> PXLCOORD_SHIFT);
+
+                for (int y = min_p.y; y <= max_p.y; ++y) {
+                    for (int x = min_p.x; x <= max_p.x; x += 4) {
+                        float depth[4] = {std::numeric_limits<float>::infinity(),
+                                          std::numeric_limits<float>::infinity(),
+                                          std::numeric_limits<float>::infinity(),
+                                          std::numeric_limits<float>::infinity()};
+                        int tpx = (x << PXLCOORD_SHIFT) + os.x;
+                        int tpy = (y << PXLCOORD_SHIFT) + os.y;
+
+                        int mask = 0;
+                        for (int t = 0; t < 2; ++t) {
+                            if (poly.valid[t]) {
+                                mask |= poly.triangles[t].test4(tpx, tpy, step, depth);
+                            }
+                        }
+
+                        for (int l = 0; l < 4 && x + l <= max_p.x; ++l) {
+                            if ((mask & (1 << l)) && depth[l] < depths[y][x+l]) {
+                                depths[y][x+l] = depth[l];
+                                colors[y][x+l] = poly.color;
+                                touched = true;
+                            }
+                        }
+                    }
+                }
+            }
+
+            if (!touched) continue;
+
+            // blit tile
+            std::lock_guard<std::mutex> lock(_tile_locks[tx + ty * tiles_per_line]);
+
+            for (int y = 0; y < 8; ++y) {
+                for (int x = 0; x < 8; ++x) {
+                    ivec2 fb_pos = o + ivec2(x, y);
+
+                    if (fb_pos.x >= _act_size.x || fb_pos.y >= _act_size.y) continue;
+
+                    int fb_id = calc_framebuffer_pos(fb_pos);
+
+                    if (depths[y][x] < _depth_buffer[fb_id]) {
+                        _depth_buffer[fb_id] = depths[y][x];
+                        _color_buffer[fb_id] = colors[y][x];
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+int Reyes::RendererCPU::calc_framebuffer_pos(ivec2 pxlpos) const
+{
+    ivec2 gridpos = pxlpos / _tile_size;
+    int   grid_id = gridpos.x + _grid_size.x * gridpos.y;
+    ivec2 loclpos = pxlpos - gridpos * _tile_size;
+    int   locl_id = loclpos.x + _tile_size * loclpos.y;
+
+    return grid_id * _tile_size * _tile_size + locl_id;
+}
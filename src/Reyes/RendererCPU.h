@@ -0,0 +1,107 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#pragma once
+
+#include "BoundNSplitCPU.h"
+#include "GL/Shader.h"
+#include "GL/Texture.h"
+#include "GL/VBO.h"
+#include "PatchIndex.h"
+#include "PatchRange.h"
+#include "Renderer.h"
+#include "ThreadPool.h"
+
+namespace Reyes
+{
+
+    /**
+     * Renderer that runs bound & split, dice, shade and sample natively on
+     * the host, without an OpenCL device. The result is shown through the
+     * same tiled texture buffer the OpenCL framebuffer uses.
+     */
+    class RendererCPU : public Renderer
+    {
+
+        // Diced grid of a single patch range
+        struct Grid
+        {
+            vector<vec4>  pos;
+            vector<ivec2> pxlpos;
+            vector<float> depth;
+            vector<vec4>  color;
+        };
+
+        ThreadPool _threads;
+        vector<Grid> _grids;
+
+        PatchIndex _patch_index;
+        BoundNSplitCPU _bound_n_split;
+
+        ivec2 _size;
+        int   _tile_size;
+        ivec2 _grid_size;
+        ivec2 _act_size;
+
+        vector<vec4>  _color_buffer;
+        vector<float> _depth_buffer;
+        vector<std::mutex> _tile_locks;
+
+        GL::TextureBuffer _tex_buffer;
+        GL::Shader _shader;
+        GL::VBO _screen_quad;
+
+        // Ranges of the batch being diced, see BoundNSplitCPU::run
+        vector<PatchRange> _batch;
+        vector<int> _dice_levels;
+        vector<mat4> _single_instance;
+
+        // View space lights of the current frame, see set_lights
+        vector<Light> _lights;
+
+    public:
+
+        RendererCPU();
+        ~RendererCPU();
+
+        virtual void prepare();
+        virtual void finish();
+
+        virtual bool are_patches_loaded(void* patches_handle);
+        virtual void load_patches(void* patches_handle, const vector<vec3>& patch_data, PatchType type);
+
+        virtual void draw_patches(void* patches_handle,
+                                  const mat4& matrix,
+                                  const Projection* projection,
+                                  const vec4& color);
+
+        virtual void set_lights(const vector<Light>& lights);
+
+    private:
+
+        void send_batch(void* patches_handle, size_t range_count,
+                        const mat4& matrix, const mat4& proj, const vec4& color);
+
+        void dice(const vector<vec3>& patches, PatchType patch_type, const PatchRange& range,
+                  const mat4& matrix, const mat4& proj, Grid& grid);
+        void shade(const vec4& color, Grid& grid);
+        void sample(const Grid& grid);
+        void sample_block(const Grid& grid, int bu, int bv);
+
+        int calc_framebuffer_pos(ivec2 pxlpos) const;
+    };
+}
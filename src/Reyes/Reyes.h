@@ -21,6 +21,7 @@
 
 #include "Framebuffer.h"
 #include "RendererCL.h"
+#include "RendererCPU.h"
 #include "Projection.h"
 
 #endif
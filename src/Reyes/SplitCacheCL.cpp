@@ -0,0 +1,139 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#include "SplitCacheCL.h"
+
+#include "ReyesConfig.h"
+
+#define LEAVES_PER_PATCH 16
+
+
+Reyes::SplitCacheCL::Leaves::Leaves(CL::Device& device)
+    : patches_handle(nullptr)
+    , patch_count(0)
+    , counts(device, sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "split cache")
+    , ranges(device, sizeof(cl_float4), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "split cache")
+    , depths(device, sizeof(cl_uchar), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "split cache")
+{
+}
+
+
+Reyes::SplitCacheCL::SplitCacheCL(CL::Device& device)
+    : _enabled(reyes_config.split_cache())
+    , _device(device)
+    , _call(0)
+    , _unused(device)
+    , _active(&_unused)
+    , _seed_counts(device, sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "split cache")
+    , _seed_offsets(device, sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "split cache")
+    , _seed_total(device, sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_READ_ONLY, "split cache")
+    , _prefix_sum(device, 1, "split cache")
+    , _pids(device, sizeof(cl_int), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "split cache")
+    , _depths(device, sizeof(cl_uchar), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "split cache")
+    , _mins(device, sizeof(cl_float2), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "split cache")
+    , _maxs(device, sizeof(cl_float2), CL_MEM_READ_WRITE | CL_MEM_HOST_NO_ACCESS, "split cache")
+{
+    if (!_enabled) return;
+
+    _program.set_constant("SPLIT_CACHE_LEAVES", LEAVES_PER_PATCH);
+    _program.compile(device, "split_cache.cl");
+
+    _merge_kernel.reset(_program.get_kernel("merge_split_leaves"));
+    _seed_kernel.reset(_program.get_kernel("seed_split_leaves"));
+}
+
+
+void Reyes::SplitCacheCL::set_constants(CL::Program& program) const
+{
+    program.set_constant("SPLIT_CACHE", (int)_enabled);
+    program.set_constant("SPLIT_CACHE_LEAVES", LEAVES_PER_PATCH);
+}
+
+
+size_t Reyes::SplitCacheCL::count_seeds(CL::CommandQueue& queue, void* patches_handle, size_t patch_count,
+                                        CL::Buffer& seed_pids, bool use_seed_pids, size_t seed_count,
+                                        CL::Event& ready)
+{
+    assert(_enabled);
+
+    // The n-th call of a frame reuses the leaves of the n-th call of the
+    // previous frame, as long as it draws the same mesh
+    if (_call == _calls.size()) {
+        _calls.push_back(shared_ptr<Leaves>(new Leaves(_device)));
+    }
+
+    _active = _calls[_call++].get();
+
+    if (_active->patches_handle != patches_handle || _active->patch_count != patch_count) {
+        _active->patches_handle = patches_handle;
+        _active->patch_count = patch_count;
+
+        if (_active->counts.get_size() < patch_count * sizeof(cl_int)) {
+            _active->counts.resize(patch_count * sizeof(cl_int));
+            _active->ranges.resize(patch_count * LEAVES_PER_PATCH * sizeof(cl_float4));
+            _active->depths.resize(patch_count * LEAVES_PER_PATCH * sizeof(cl_uchar));
+        }
+
+        ready = queue.enq_fill_buffer<cl_int>(_active->counts, 0, patch_count, "clear split leaves", ready);
+    }
+
+    if (_seed_counts.get_size() < seed_count * sizeof(cl_int)) {
+        _seed_counts.resize(seed_count * sizeof(cl_int));
+        _seed_offsets.resize(seed_count * sizeof(cl_int));
+    }
+    _prefix_sum.resize(seed_count);
+
+    _merge_kernel->set_args(_active->counts, _active->ranges, _active->depths,
+                            seed_pids, (cl_int)use_seed_pids, (cl_int)seed_count, _seed_counts);
+    ready = queue.enq_kernel(*_merge_kernel, round_up_by((int)seed_count, 64), 64, "merge split leaves", ready);
+
+    ready = _prefix_sum.apply(seed_count, queue, _seed_counts, _seed_offsets, _seed_total, ready);
+
+    ready = queue.enq_read_buffer(_seed_total, _seed_total.void_ptr(), sizeof(cl_int), "read seed count", ready);
+    queue.flush();
+    queue.wait_for_events(ready);
+
+    size_t range_count = _seed_total.host_ref<cl_int>();
+
+    if (_pids.get_size() < range_count * sizeof(cl_int)) {
+        _pids.resize(range_count * sizeof(cl_int));
+        _depths.resize(range_count * sizeof(cl_uchar));
+        _mins.resize(range_count * sizeof(cl_float2));
+        _maxs.resize(range_count * sizeof(cl_float2));
+    }
+
+    return range_count;
+}
+
+
+CL::Event Reyes::SplitCacheCL::seed_ranges(CL::CommandQueue& queue,
+                                           CL::Buffer& seed_pids, bool use_seed_pids, size_t seed_count,
+                                           const CL::Event& ready)
+{
+    _seed_kernel->set_args(_active->counts, _active->ranges, _active->depths,
+                           seed_pids, (cl_int)use_seed_pids, (cl_int)seed_count, _seed_offsets,
+                           _pids, _depths, _mins, _maxs);
+    return queue.enq_kernel(*_seed_kernel, round_up_by((int)seed_count, 64), 64, "seed split leaves", ready);
+}
+
+
+void Reyes::SplitCacheCL::finish()
+{
+    _call = 0;
+    _active = &_unused;
+}
@@ -0,0 +1,115 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#pragma once
+
+#include "common.h"
+
+#include "CL/OpenCL.h"
+#include "CL/PrefixSum.h"
+
+namespace Reyes
+{
+
+    /**
+     * Device side counterpart of the split cache of BoundNSplitCPU, used by
+     * the OpenCL bound & split methods. The bound kernels record the leaf
+     * ranges of every patch into a fixed number of slots per patch, see
+     * record_split_leaf. The next frame merges them and seeds bound & split
+     * with the result instead of the whole patches. Patches with more
+     * leaves than slots start from the whole patch again.
+     */
+    class SplitCacheCL : public noncopyable
+    {
+        // Leaf lists of one init() call, seeds the same call of the next frame
+        struct Leaves
+        {
+            void* patches_handle;
+            size_t patch_count;
+
+            CL::Buffer counts;
+            CL::Buffer ranges;
+            CL::Buffer depths;
+
+            Leaves(CL::Device& device);
+        };
+
+        bool _enabled;
+        CL::Device& _device;
+
+        vector<shared_ptr<Leaves>> _calls;
+        size_t _call;
+
+        // Kernels record into the leaves of the active call, or into an
+        // unused list when the cache is disabled
+        Leaves _unused;
+        Leaves* _active;
+
+        CL::Buffer _seed_counts;
+        CL::Buffer _seed_offsets;
+        CL::TransferBuffer _seed_total;
+        CL::PrefixSum _prefix_sum;
+
+        // Seed ranges, see seed_ranges
+        CL::Buffer _pids;
+        CL::Buffer _depths;
+        CL::Buffer _mins;
+        CL::Buffer _maxs;
+
+        CL::Program _program;
+        shared_ptr<CL::Kernel> _merge_kernel;
+        shared_ptr<CL::Kernel> _seed_kernel;
+
+    public:
+
+        SplitCacheCL(CL::Device& device);
+
+        bool enabled() const { return _enabled; }
+
+        // Sets the SPLIT_CACHE* constants of a program that records leaves
+        void set_constants(CL::Program& program) const;
+
+        /**
+         * Merges the leaves of the previous frame's call with the same
+         * index and returns the number of seed ranges. Waits for the count.
+         * @param patch_count Patches of all instances of the mesh.
+         * @param seed_pids   Patches to start from, all patches if
+         *                    use_seed_pids is false.
+         */
+        size_t count_seeds(CL::CommandQueue& queue, void* patches_handle, size_t patch_count,
+                           CL::Buffer& seed_pids, bool use_seed_pids, size_t seed_count, CL::Event& ready);
+
+        // Writes the seed ranges counted by count_seeds to pids(), depths(), mins() and maxs()
+        CL::Event seed_ranges(CL::CommandQueue& queue,
+                              CL::Buffer& seed_pids, bool use_seed_pids, size_t seed_count, const CL::Event& ready);
+
+        // Starts over with the first call of the next frame
+        void finish();
+
+        CL::Buffer& pids()   { return _pids; }
+        CL::Buffer& depths() { return _depths; }
+        CL::Buffer& mins()   { return _mins; }
+        CL::Buffer& maxs()   { return _maxs; }
+
+        // Leaf lists the bound kernels of the active call record into
+        CL::Buffer& leaf_counts() { return _active->counts; }
+        CL::Buffer& leaf_ranges() { return _active->ranges; }
+        CL::Buffer& leaf_depths() { return _active->depths; }
+    };
+
+}
@@ -0,0 +1,170 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#include "ImageWriter.h"
+
+#include <fstream>
+
+#include "IL/il.h"
+
+#include "GL/Image.h"
+
+
+namespace
+{
+    bool has_extension(const string& filename, const string& extension)
+    {
+        return filename.size() >= extension.size() &&
+            filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+    }
+}
+
+
+ImageWriter::ImageWriter(size_t max_pending)
+    : _max_pending(std::max<size_t>(max_pending, 1))
+    , _shutdown(false)
+{
+    _thread = std::thread(&ImageWriter::worker, this);
+}
+
+
+ImageWriter::~ImageWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _shutdown = true;
+    }
+
+    _job_posted.notify_all();
+    _thread.join();
+}
+
+
+void ImageWriter::write(const string& filename, const ivec2& size, vector<vec4>&& pixels)
+{
+    assert(pixels.size() == (size_t)(size.x * size.y));
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _job_taken.wait(lock, [this] { return _jobs.size() < _max_pending; });
+
+    _jobs.push_back(Job{filename, size, std::move(pixels)});
+
+    lock.unlock();
+    _job_posted.notify_one();
+}
+
+
+void ImageWriter::worker()
+{
+    while (true) {
+        Job job;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+
+            _job_posted.wait(lock, [this] { return _shutdown || !_jobs.empty(); });
+
+            if (_jobs.empty()) return;
+
+            job = std::move(_jobs.front());
+            _jobs.pop_front();
+        }
+
+        _job_taken.notify_one();
+
+        write_image(job);
+    }
+}
+
+
+unsigned char ImageWriter::to_srgb8(float c)
+{
+    return (unsigned char)(glm::clamp(powf(std::max(c, 0.0f), 0.454545f), 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+
+void ImageWriter::write_image(const Job& job)
+{
+    const ivec2& size = job.size;
+
+    if (has_extension(job.filename, ".ppm")) {
+        std::ofstream fs(job.filename.c_str(), std::ios::binary);
+
+        fs << "P6\n" << size.x << " " << size.y << "\n255\n";
+
+        // PPM rows run from top to bottom
+        vector<unsigned char> row(size.x * 3);
+        for (int y = size.y - 1; y >= 0; --y) {
+            for (int x = 0; x < size.x; ++x) {
+                const vec4& c = job.pixels[x + y * size.x];
+
+                row[x*3 + 0] = to_srgb8(c.x);
+                row[x*3 + 1] = to_srgb8(c.y);
+                row[x*3 + 2] = to_srgb8(c.z);
+            }
+
+            fs.write((const char*)row.data(), row.size());
+        }
+
+        if (!fs) {
+            cerr << "Failed writing image \"" << job.filename << "\"." << endl;
+        }
+
+        return;
+    }
+
+    // DevIL is only used from this thread
+    if (!Image::devil_initialized) {
+        ilInit();
+        ilEnable(IL_ORIGIN_SET);
+        ilOriginFunc(IL_ORIGIN_LOWER_LEFT);
+        Image::devil_initialized = true;
+    }
+
+    ilEnable(IL_FILE_OVERWRITE);
+
+    ILuint il_image;
+    ilGenImages(1, &il_image);
+    ilBindImage(il_image);
+
+    if (has_extension(job.filename, ".exr")) {
+        vector<float> data(size.x * size.y * 3);
+        for (size_t i = 0; i < job.pixels.size(); ++i) {
+            data[i*3 + 0] = job.pixels[i].x;
+            data[i*3 + 1] = job.pixels[i].y;
+            data[i*3 + 2] = job.pixels[i].z;
+        }
+
+        ilTexImage(size.x, size.y, 1, 3, IL_RGB, IL_FLOAT, data.data());
+    } else {
+        vector<unsigned char> data(size.x * size.y * 3);
+        for (size_t i = 0; i < job.pixels.size(); ++i) {
+            data[i*3 + 0] = to_srgb8(job.pixels[i].x);
+            data[i*3 + 1] = to_srgb8(job.pixels[i].y);
+            data[i*3 + 2] = to_srgb8(job.pixels[i].z);
+        }
+
+        ilTexImage(size.x, size.y, 1, 3, IL_RGB, IL_UNSIGNED_BYTE, data.data());
+    }
+
+    if (!ilSaveImage(job.filename.c_str())) {
+        cerr << "Failed writing image \"" << job.filename << "\"." << endl;
+    }
+
+    ilDeleteImages(1, &il_image);
+}
@@ -0,0 +1,82 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include "common.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/**
+ * Writes images to disk on a background thread.
+ * The format is picked from the file extension: ".ppm" and ".png" are
+ * gamma corrected to 8 bits, ".exr" keeps the linear float values.
+ */
+class ImageWriter : noncopyable
+{
+    struct Job
+    {
+        string filename;
+        ivec2 size;
+        vector<vec4> pixels;
+    };
+
+    std::thread _thread;
+
+    std::mutex _mutex;
+    std::condition_variable _job_posted;
+    std::condition_variable _job_taken;
+
+    std::deque<Job> _jobs;
+    size_t _max_pending;
+    bool _shutdown;
+
+    void worker();
+    void write_image(const Job& job);
+
+public:
+
+    /**
+     * Start the writer thread.
+     * @param max_pending Number of queued images after which write()
+     *                    blocks, bounds the memory held by the queue.
+     */
+    ImageWriter(size_t max_pending);
+
+    /**
+     * Write all pending images and join the writer thread.
+     */
+    ~ImageWriter();
+
+    /**
+     * Queue an image for writing.
+     * @param pixels Linear RGBA values, rows from bottom to top.
+     */
+    void write(const string& filename, const ivec2& size, vector<vec4>&& pixels);
+
+    /**
+     * Gamma correction applied to ".ppm" and ".png" files.
+     */
+    static unsigned char to_srgb8(float c);
+};
+
+
+#endif
@@ -319,6 +319,60 @@ void qsplit_patch(const BezierPatch& patch,
     vsplit_patch(t1, o2, o3);
 }
 
+// Replaces the control points p[0], p[stride], ... of a cubic with those of
+// its part between t0 and t1, using de Casteljau subdivision at t1 and t0/t1
+void restrict_spline(vec3* p, size_t stride, float t0, float t1)
+{
+    vec3& p0 = p[0];
+    vec3& p1 = p[stride];
+    vec3& p2 = p[2*stride];
+    vec3& p3 = p[3*stride];
+
+    if (t1 < 1) {
+        vec3 p10 = glm::mix(p0, p1, t1);
+        vec3 p11 = glm::mix(p1, p2, t1);
+        vec3 p12 = glm::mix(p2, p3, t1);
+        vec3 p20 = glm::mix(p10, p11, t1);
+        vec3 p21 = glm::mix(p11, p12, t1);
+
+        p3 = glm::mix(p20, p21, t1);
+        p2 = p20;
+        p1 = p10;
+    }
+
+    if (t0 > 0) {
+        float t = t0 / t1;
+
+        vec3 p10 = glm::mix(p0, p1, t);
+        vec3 p11 = glm::mix(p1, p2, t);
+        vec3 p12 = glm::mix(p2, p3, t);
+        vec3 p20 = glm::mix(p10, p11, t);
+        vec3 p21 = glm::mix(p11, p12, t);
+
+        p0 = glm::mix(p20, p21, t);
+        p1 = p21;
+        p2 = p12;
+    }
+}
+
+
+// Control points of the part of the patch in [min,max], with x along the
+// first and y along the second index of P
+void restrict_patch(const BezierPatch& patch, const vec2& min, const vec2& max,
+                    BezierPatch& out)
+{
+    out = patch;
+
+    for (int i = 0; i < 4; ++i) {
+        restrict_spline(&out.P[i][0], 1, min.y, max.y);
+    }
+
+    for (int j = 0; j < 4; ++j) {
+        restrict_spline(&out.P[0][j], 4, min.x, max.x);
+    }
+}
+
+
 void calc_bbox(const BezierPatch& patch, BBox& box) {
     box.clear();
     for (int i = 0; i < 4; ++i) {
@@ -327,3 +381,79 @@ void calc_bbox(const BezierPatch& patch, BBox& box) {
         }
     }
 }
+
+
+// P_u and P_v are Bezier patches with the control point differences along
+// u and v as coefficients. Their product has non-negative weights, so every
+// normal is a non-negative combination of the cross products of those
+// coefficients.
+void calc_normal_cone(const BezierPatch& patch, NormalCone& cone)
+{
+    vec3 du[3][4], dv[4][3];
+
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            du[j][i] = patch.P[j+1][i] - patch.P[j][i];
+            dv[i][j] = patch.P[i][j+1] - patch.P[i][j];
+        }
+    }
+
+    vec3 sum(0.0f);
+
+    for (int k = 0; k < 12; ++k) {
+        for (int l = 0; l < 12; ++l) {
+            vec3 n = glm::cross(du[k/4][k%4], dv[l/3][l%3]);
+            float len = glm::length(n);
+            if (len > 0) sum += n / len;
+        }
+    }
+
+    BBox box;
+    calc_bbox(patch, box);
+
+    cone.center = box.center();
+    cone.radius = glm::length(box.size()) * 0.5f;
+
+    float sum_len = glm::length(sum);
+
+    if (sum_len < 1e-6f) {
+        cone.axis = vec3(0,0,1);
+        cone.angle = (float)M_PI;
+        return;
+    }
+
+    cone.axis = sum / sum_len;
+
+    float min_cos = 1;
+    for (int k = 0; k < 12; ++k) {
+        for (int l = 0; l < 12; ++l) {
+            vec3 n = glm::cross(du[k/4][k%4], dv[l/3][l%3]);
+            float len = glm::length(n);
+            if (len > 0) min_cos = minimum(min_cos, glm::dot(cone.axis, n) / len);
+        }
+    }
+
+    cone.angle = acosf(glm::clamp(min_cos, -1.0f, 1.0f));
+}
+
+
+// True if the surface faces away from eye everywhere, i.e. n.(p-eye) < 0
+// for all normals n and points p, which is what the per-micropolygon test
+// in shade culls. flipped is set for transforms that mirror the patch.
+bool is_backfacing(const NormalCone& cone, const vec3& eye, bool flipped)
+{
+    vec3 d = cone.center - eye;
+    float dist = glm::length(d);
+
+    if (dist <= cone.radius || cone.angle >= 0.5f * (float)M_PI) {
+        return false;
+    }
+
+    float cos_b = glm::dot(cone.axis, d) / dist;
+    if (flipped) cos_b = -cos_b;
+
+    float view_angle = asinf(cone.radius / dist);
+    float b = acosf(glm::clamp(cos_b, -1.0f, 1.0f));
+
+    return b - cone.angle - view_angle > 0.5f * (float)M_PI;
+}
@@ -26,6 +26,17 @@ struct BezierPatch
     vec3 P[4][4];
 };
 
+// Cone containing the (unnormalized) normals P_u x P_v of a patch, with u
+// along the first and v along the second index of P, and a sphere
+// containing its points
+struct NormalCone
+{
+    vec3 axis;
+    float angle;
+    vec3 center;
+    float radius;
+};
+
 namespace Reyes
 {
     class Projection;
@@ -55,8 +66,15 @@ void qsplit_patch(const BezierPatch& patch,
                   BezierPatch& o0, BezierPatch& o1, 
                   BezierPatch& o2, BezierPatch& o3);
 
+void restrict_spline(vec3* p, size_t stride, float t0, float t1);
+void restrict_patch(const BezierPatch& patch, const vec2& min, const vec2& max,
+                    BezierPatch& out);
+
 void calc_bbox(const BezierPatch& patch, BBox& box);
 
+void calc_normal_cone(const BezierPatch& patch, NormalCone& cone);
+bool is_backfacing(const NormalCone& cone, const vec3& eye, bool flipped=false);
+
 
 
 #endif
@@ -216,3 +216,22 @@ void Statistics::dump_stats()
     fs << ";";
     
 }
+
+
+void Statistics::dump_frame_header(std::ostream& os)
+{
+    os << "frame,ms_render,ms_bound_n_split,ms_dice_n_raster,patches,processed_patches,passes,max_patches" << endl;
+}
+
+
+void Statistics::dump_frame(std::ostream& os, long long frame_no)
+{
+    os << frame_no << ","
+       << ms_per_render_pass << ","
+       << ms_bound_n_split << ","
+       << ms_dice_n_raster << ","
+       << patches_per_frame << ","
+       << bounds_per_frame << ","
+       << _pass_count << ","
+       << max_patches << endl;
+}
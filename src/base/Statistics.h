@@ -90,6 +90,10 @@ class Statistics
 
     void print();
     void dump_stats();
+
+    // One line per rendered frame, for camera path benchmarks
+    void dump_frame_header(std::ostream& os);
+    void dump_frame(std::ostream& os, long long frame_no);
         
 };
 
@@ -0,0 +1,111 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#include "ThreadPool.h"
+
+
+ThreadPool::ThreadPool(size_t thread_count)
+    : _generation(0)
+    , _running(0)
+    , _shutdown(false)
+{
+    if (thread_count == 0) {
+        thread_count = maximum<size_t>(1, std::thread::hardware_concurrency());
+    }
+
+    for (size_t i = 1; i < thread_count; ++i) {
+        _threads.emplace_back(&ThreadPool::worker, this, i);
+    }
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _shutdown = true;
+    }
+    _job_posted.notify_all();
+
+    for (std::thread& thread : _threads) {
+        thread.join();
+    }
+}
+
+
+void ThreadPool::run(const std::function<void(size_t)>& job)
+{
+    if (_threads.empty()) {
+        job(0);
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _job = job;
+        _running = _threads.size();
+        ++_generation;
+    }
+    _job_posted.notify_all();
+
+    job(0);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _job_done.wait(lock, [this]{ return _running == 0; });
+    _job = nullptr;
+}
+
+
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)>& job)
+{
+    std::atomic<size_t> next(0);
+
+    run([&](size_t) {
+            for (size_t i = next++; i < count; i = next++) {
+                job(i);
+            }
+        });
+}
+
+
+void ThreadPool::worker(size_t index)
+{
+    uint64_t generation = 0;
+
+    while (true) {
+        std::function<void(size_t)> job;
+        
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _job_posted.wait(lock, [&]{ return _shutdown || _generation != generation; });
+
+            if (_shutdown) return;
+            
+            generation = _generation;
+            job = _job;
+        }
+
+        job(index);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            --_running;
+        }
+        _job_done.notify_one();
+    }
+}
@@ -0,0 +1,76 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include "common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/**
+ * A fixed set of worker threads that run jobs in lockstep.
+ * The calling thread participates as worker 0, so a pool of size one
+ * runs everything inline.
+ */
+class ThreadPool : noncopyable
+{
+    std::vector<std::thread> _threads;
+
+    std::mutex _mutex;
+    std::condition_variable _job_posted;
+    std::condition_variable _job_done;
+
+    std::function<void(size_t)> _job;
+    uint64_t _generation;
+    size_t _running;
+    bool _shutdown;
+
+    void worker(size_t index);
+
+public:
+
+    /**
+     * Create a pool.
+     * @param thread_count Number of workers including the calling
+     *                     thread. Zero picks the hardware concurrency.
+     */
+    ThreadPool(size_t thread_count);
+    ~ThreadPool();
+
+    size_t size() const { return _threads.size() + 1; }
+
+    /**
+     * Run job(i) once on every worker i in [0, size()) and wait for all
+     * of them to return.
+     */
+    void run(const std::function<void(size_t)>& job);
+
+    /**
+     * Call job(i) for every i in [0, count), distributing the indices
+     * dynamically over all workers.
+     */
+    void parallel_for(size_t count, const std::function<void(size_t)>& job);
+};
+
+
+#endif
@@ -0,0 +1,92 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#include "BenchmarkResults.h"
+
+#include <boost/format.hpp>
+#include <fstream>
+
+
+void BenchmarkResults::add(const string& name, double items, uint64_t ns)
+{
+    if (items <= 0 || ns == 0) {
+        return;
+    }
+
+    _results.push_back({name, items * BILLION / ns});
+}
+
+
+bool BenchmarkResults::save(const string& filename) const
+{
+    std::ofstream fs(filename.c_str());
+
+    if (!fs) {
+        return false;
+    }
+
+    fs.precision(10);
+
+    for (const Result& result : _results) {
+        fs << result.name << " " << result.items_per_second << endl;
+    }
+
+    return true;
+}
+
+
+int BenchmarkResults::compare(const string& filename, float tolerance, std::ostream& os) const
+{
+    // Names contain no whitespace, the value is the last field of a line
+    map<string, double> baseline;
+
+    std::ifstream fs(filename.c_str());
+    for (string line; std::getline(fs, line);) {
+        size_t split = line.find_last_of(' ');
+
+        if (split == string::npos) continue;
+
+        baseline[line.substr(0, split)] = atof(line.c_str() + split + 1);
+    }
+
+    int regressions = 0;
+
+    for (const Result& result : _results) {
+        os << boost::format("%1$-56s %2$14.0f items/s") % result.name % result.items_per_second;
+
+        auto base = baseline.find(result.name);
+
+        if (base == baseline.end() || base->second <= 0) {
+            os << "   (no baseline)" << endl;
+            continue;
+        }
+
+        double ratio = result.items_per_second / base->second;
+
+        os << boost::format("   %1$6.3fx") % ratio;
+
+        if (ratio < 1 - tolerance) {
+            os << "   REGRESSION";
+            ++regressions;
+        }
+
+        os << endl;
+    }
+
+    return regressions;
+}
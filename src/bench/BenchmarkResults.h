@@ -0,0 +1,49 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+#pragma once
+
+#include "common.h"
+
+#include <iosfwd>
+
+/**
+ * Throughput of a set of benchmarks, compared against the results of an
+ * earlier run stored in a baseline file.
+ */
+class BenchmarkResults
+{
+    struct Result
+    {
+        string name;
+        double items_per_second;
+    };
+
+    vector<Result> _results;
+
+public:
+
+    // Records items processed in ns nanoseconds. Empty runs are skipped.
+    void add(const string& name, double items, uint64_t ns);
+
+    // Writes one "name items_per_second" pair per line
+    bool save(const string& filename) const;
+
+    // Prints all results with their ratio to the baseline. Returns the
+    // number of results that are more than tolerance slower.
+    int compare(const string& filename, float tolerance, std::ostream& os) const;
+};
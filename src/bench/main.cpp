@@ -0,0 +1,358 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#include "common.h"
+
+#include "BenchmarkResults.h"
+#include "CL/HistogramPyramid.h"
+#include "CL/OpenCL.h"
+#include "CL/PrefixSum.h"
+#include "Config.h"
+#include "CLConfig.h"
+#include "GLConfig.h"
+#include "ReyesConfig.h"
+#include "Projection.h"
+#include "Reyes/RendererCL.h"
+#include "Statistics.h"
+#include "micropolis/Scene.h"
+
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+
+/*
+ * Micro-benchmarks for the OpenCL primitives and the Reyes pipeline
+ * stages. All timings are summed device event durations, so they exclude
+ * host overhead between commands. Render stages are measured within
+ * complete headless frames, with each bound & split method and over sweeps
+ * of the batch and patch size.
+ */
+
+namespace
+{
+    const size_t primitive_sizes[] = {1 << 12, 1 << 16, 1 << 20};
+
+    const size_t patches_per_pass_sweep[] = {64, 256, 1024};
+    const size_t patch_size_sweep[] = {16, 32, 64, 128};
+
+    const std::pair<ReyesConfig::BoundNSplitMethod, const char*> bound_n_split_methods[] = {
+        {ReyesConfig::CPU,      "cpu"},
+        {ReyesConfig::BOUNDED,  "bounded"},
+        {ReyesConfig::LOCAL,    "local"},
+        {ReyesConfig::BREADTH,  "breadth"},
+        {ReyesConfig::STEALING, "stealing"},
+    };
+
+    // Event names that make up a pipeline stage
+    struct Stage
+    {
+        const char* name;
+        vector<string> events;
+    };
+
+    const vector<Stage> render_stages = {
+        {"bound_n_split", {"bound & split", "bound patches", "split patches", "push split ranges", "CPU bound & split",
+                           "merge split leaves", "seed split leaves"}},
+        {"dice",          {"dice"}},
+        {"shade",         {"shade"}},
+        {"sample",        {"sample"}},
+        {"resolve",       {"resolve"}},
+    };
+
+    struct Input
+    {
+        string name;
+        std::function<void(Reyes::Renderer&)> draw;
+    };
+
+
+    uint64_t sum_times(const map<string, uint64_t>& times, const vector<string>& names)
+    {
+        uint64_t sum = 0;
+
+        for (const string& name : names) {
+            auto t = times.find(name);
+
+            if (t != times.end()) {
+                sum += t->second;
+            }
+        }
+
+        return sum;
+    }
+
+
+    /*
+     * Square grid of gently curved bicubic Bezier patches that fills the
+     * view of the synthetic input's camera.
+     */
+    vector<vec3> make_patch_grid(int n)
+    {
+        vector<vec3> patches;
+        patches.reserve(n * n * 16);
+
+        for (int pv = 0; pv < n; ++pv) {
+            for (int pu = 0; pu < n; ++pu) {
+                for (int v = 0; v < 4; ++v) {
+                    for (int u = 0; u < 4; ++u) {
+                        float x = pu + u / 3.0f - n * 0.5f;
+                        float y = pv + v / 3.0f - n * 0.5f;
+
+                        patches.push_back(vec3(x, y, 0.5f * sinf(x * 0.7f) * cosf(y * 0.5f)));
+                    }
+                }
+            }
+        }
+
+        return patches;
+    }
+
+
+    template<typename Apply>
+    void bench_primitive(CL::Device& device, CL::CommandQueue& queue, const string& name, size_t items,
+                         BenchmarkResults& results, Apply apply)
+    {
+        map<string, uint64_t> times;
+
+        for (int i = 0; i <= config.bench_iterations(); ++i) {
+            // First run is a warm-up
+            device.collect_event_times(i > 0 ? &times : nullptr);
+
+            queue.wait_for_events(apply());
+            device.release_events();
+        }
+
+        device.collect_event_times(nullptr);
+
+        uint64_t ns = 0;
+        for (auto t : times) {
+            ns += t.second;
+        }
+
+        results.add(name, (double)items * config.bench_iterations(), ns);
+    }
+
+
+    void bench_primitives(BenchmarkResults& results)
+    {
+        CL::Device device(cl_config.opencl_device_id().x, cl_config.opencl_device_id().y);
+        CL::CommandQueue queue(device, "benchmark");
+
+        CL::HistogramPyramid histogram_pyramid(device);
+
+        for (size_t N : primitive_sizes) {
+            vector<int> input(N);
+            for (size_t i = 0; i < N; ++i) {
+                input[i] = i % 8 + 1;
+            }
+
+            CL::PrefixSum prefix_sum(device, N);
+
+            CL::Buffer i_buffer(device, N * sizeof(int), CL_MEM_READ_WRITE);
+            CL::Buffer o_buffer(device, N * sizeof(int), CL_MEM_READ_WRITE);
+            CL::Buffer t_buffer(device, sizeof(int), CL_MEM_READ_WRITE);
+            CL::Buffer pyramid(device, histogram_pyramid.pyramid_size(N) * sizeof(int), CL_MEM_READ_WRITE);
+
+            CL::Event e = queue.enq_write_buffer(i_buffer, input.data(), N * sizeof(int), "fill input buffer", CL::Event());
+            e = queue.enq_write_buffer(pyramid, input.data(), N * sizeof(int), "fill input buffer", e);
+            queue.wait_for_events(e);
+            device.release_events();
+
+            bench_primitive(device, queue, str(format("prefix_sum/%1%") % N), N, results, [&]{
+                    CL::Event none;
+                    return prefix_sum.apply(N, queue, i_buffer, o_buffer, t_buffer, none);
+                });
+
+            bench_primitive(device, queue, str(format("histogram_pyramid/%1%") % N), N, results, [&]{
+                    CL::Event none;
+                    return histogram_pyramid.apply(N, N, queue, pyramid, none);
+                });
+        }
+    }
+
+
+    /*
+     * Renders every input with the current configuration and adds the
+     * throughput of each stage. Stages count grid points at the configured
+     * patch size, bound & split counts bounded ranges.
+     */
+    void bench_renderer(const vector<Input>& inputs, const string& config_name, BenchmarkResults& results)
+    {
+        Reyes::RendererCL renderer;
+
+        size_t patch_size = reyes_config.reyes_patch_size();
+
+        for (const Input& input : inputs) {
+            map<string, uint64_t> times;
+            double patches = 0, bounds = 0;
+
+            for (int i = 0; i <= config.bench_iterations(); ++i) {
+                renderer.collect_event_times(i > 0 ? &times : nullptr);
+
+                input.draw(renderer);
+
+                if (i > 0) {
+                    patches += statistics.patches_per_frame;
+                    bounds  += statistics.bounds_per_frame;
+                }
+            }
+
+            renderer.collect_event_times(nullptr);
+
+            // The CPU implementation does not count bounds
+            if (bounds == 0) {
+                bounds = patches;
+            }
+
+            for (const Stage& stage : render_stages) {
+                double items = stage.name == string("bound_n_split") ? bounds : patches * patch_size * patch_size;
+
+                results.add(str(format("%1%/%2%/%3%") % input.name % config_name % stage.name),
+                            items, sum_times(times, stage.events));
+            }
+        }
+    }
+
+
+    void bench_render_stages(BenchmarkResults& results)
+    {
+        config.set_headless(true);
+        config.set_frame_output("");
+        reyes_config.set_renderer_type(ReyesConfig::OPENCL);
+        reyes_config.set_dummy_render(false);
+
+        vector<Input> inputs;
+
+        // The synthetic grid gets its own camera, scenes use their active one
+        vector<vec3> grid = make_patch_grid(32);
+        Reyes::Projection grid_projection(45, 0.1f, reyes_config.window_size());
+        mat4 grid_matrix = glm::translate<float>(glm::mat4(1.0f), glm::vec3(0, 0, -40));
+
+        inputs.push_back({"synthetic", [&](Reyes::Renderer& renderer) {
+                    renderer.prepare();
+
+                    if (!renderer.are_patches_loaded(&grid)) {
+                        renderer.load_patches(&grid, grid, Reyes::BEZIER);
+                    }
+
+                    renderer.draw_patches(&grid, grid_matrix, &grid_projection, vec4(1));
+                    renderer.finish();
+                }});
+
+        vector<shared_ptr<Reyes::Scene> > scenes;
+
+        std::istringstream scene_files(config.bench_scenes());
+        for (string file; scene_files >> file;) {
+            if (!file_exists(file)) {
+                cerr << "Benchmark scene \"" << file << "\" does not exist, skipped." << endl;
+                continue;
+            }
+
+            scenes.push_back(shared_ptr<Reyes::Scene>(new Reyes::Scene(file)));
+            Reyes::Scene* scene = scenes.back().get();
+
+            inputs.push_back({file, [scene](Reyes::Renderer& renderer) { scene->draw(renderer); }});
+        }
+
+        const size_t patches_per_pass = reyes_config.reyes_patches_per_pass();
+        const size_t patch_size = reyes_config.reyes_patch_size();
+
+        for (auto method : bound_n_split_methods) {
+            reyes_config.set_bound_n_split_method(method.first);
+
+            // Sweep one parameter at a time, keeping the other as configured
+            for (size_t ppp : patches_per_pass_sweep) {
+                reyes_config.set_reyes_patches_per_pass(ppp);
+                reyes_config.set_reyes_patch_size(patch_size);
+
+                bench_renderer(inputs, str(format("%1%/ppp%2%/ps%3%") % method.second % ppp % patch_size), results);
+            }
+
+            for (size_t ps : patch_size_sweep) {
+                reyes_config.set_reyes_patches_per_pass(patches_per_pass);
+                reyes_config.set_reyes_patch_size(ps);
+
+                bench_renderer(inputs, str(format("%1%/ppp%2%/ps%3%") % method.second % patches_per_pass % ps), results);
+            }
+        }
+    }
+
+
+    bool load_options(int& argc, char** argv)
+    {
+        // Unlike the renderer, never resave the options files
+        bool needs_resave;
+
+        if (!Config::load_file("micropolis.options", config, needs_resave) ||
+            !CLConfig::load_file("cl.options", cl_config, needs_resave) ||
+            !GLConfig::load_file("gl.options", gl_config, needs_resave) ||
+            !ReyesConfig::load_file("reyes.options", reyes_config, needs_resave)) {
+            cout << "Failed to load options files" << endl;
+            return false;
+        }
+
+        config.parse_args(argc, argv);
+        cl_config.parse_args(argc, argv);
+        gl_config.parse_args(argc, argv);
+        reyes_config.parse_args(argc, argv);
+
+        return true;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    if (!load_options(argc, argv)) {
+        return 1;
+    }
+
+    BenchmarkResults results;
+
+    try {
+        bench_primitives(results);
+        bench_render_stages(results);
+    } catch (CL::Exception& e) {
+        cerr << e.file() << ":" << e.line_no() << ": error: " <<  e.msg() << endl;
+        return 1;
+    } catch (std::runtime_error& e) {
+        cerr << "error: " << e.what() << endl;
+        return 1;
+    }
+
+    if (config.bench_save_baseline()) {
+        if (!results.save(config.bench_baseline())) {
+            cerr << "Failed to write baseline \"" << config.bench_baseline() << "\"" << endl;
+            return 1;
+        }
+
+        results.compare("", 0, cout);
+        cout << endl << "Baseline written to \"" << config.bench_baseline() << "\"" << endl;
+        return 0;
+    }
+
+    int regressions = results.compare(config.bench_baseline(), config.bench_tolerance(), cout);
+
+    if (regressions > 0) {
+        cout << endl << regressions << " benchmarks regressed by more than "
+             << config.bench_tolerance() * 100 << "%" << endl;
+        return 1;
+    }
+
+    return 0;
+}
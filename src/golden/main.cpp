@@ -0,0 +1,272 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#include "common.h"
+
+#include "CL/OpenCL.h"
+#include "Config.h"
+#include "CLConfig.h"
+#include "GLConfig.h"
+#include "ReyesConfig.h"
+#include "ImageWriter.h"
+#include "Reyes/RendererCL.h"
+#include "Statistics.h"
+#include "micropolis/Scene.h"
+
+#include <fstream>
+#include <glob.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+
+/*
+ * Golden image regression harness. Renders every scene from its active
+ * camera with the configured renderer settings, reads back the OpenCL
+ * framebuffer and compares it against a stored reference image. Frame
+ * times are reported alongside, so kernel optimizations can be checked
+ * for speed and correctness in one run.
+ */
+
+namespace
+{
+    struct Comparison
+    {
+        double psnr;
+        int max_error;
+    };
+
+
+    vector<string> expand_patterns(const string& patterns)
+    {
+        vector<string> files;
+
+        std::istringstream ss(patterns);
+        for (string pattern; ss >> pattern;) {
+            glob_t matches;
+
+            if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+                for (size_t i = 0; i < matches.gl_pathc; ++i) {
+                    files.push_back(matches.gl_pathv[i]);
+                }
+            }
+
+            globfree(&matches);
+        }
+
+        return files;
+    }
+
+
+    string scene_name(const string& filename)
+    {
+        size_t begin = filename.find_last_of('/');
+        begin = (begin == string::npos) ? 0 : begin + 1;
+
+        size_t end = filename.find_last_of('.');
+        if (end == string::npos || end < begin) {
+            end = filename.size();
+        }
+
+        return filename.substr(begin, end - begin);
+    }
+
+
+    /*
+     * Reads a binary PPM as written by ImageWriter into 8 bit sRGB
+     * triples, rows from bottom to top like the framebuffer.
+     */
+    bool read_ppm(const string& filename, ivec2& size, vector<unsigned char>& rgb)
+    {
+        std::ifstream fs(filename.c_str(), std::ios::binary);
+
+        string magic;
+        int max_value;
+        fs >> magic >> size.x >> size.y >> max_value;
+
+        if (!fs || magic != "P6" || max_value != 255) {
+            return false;
+        }
+
+        // Single whitespace character before the pixel data
+        fs.get();
+
+        rgb.resize(size.x * size.y * 3);
+        for (int y = size.y - 1; y >= 0; --y) {
+            fs.read((char*)&rgb[y * size.x * 3], size.x * 3);
+        }
+
+        return (bool)fs;
+    }
+
+
+    Comparison compare(const vector<vec4>& pixels, const vector<unsigned char>& reference)
+    {
+        assert(pixels.size() * 3 == reference.size());
+
+        double squared_sum = 0;
+        int max_error = 0;
+
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            for (int c = 0; c < 3; ++c) {
+                int error = abs((int)ImageWriter::to_srgb8(pixels[i][c]) - (int)reference[i * 3 + c]);
+
+                squared_sum += error * error;
+                max_error = std::max(max_error, error);
+            }
+        }
+
+        double mse = squared_sum / reference.size();
+        double psnr = (mse > 0) ? 10 * log10(255.0 * 255.0 / mse) : std::numeric_limits<double>::infinity();
+
+        return {psnr, max_error};
+    }
+
+
+    bool load_options(int& argc, char** argv)
+    {
+        // Unlike the renderer, never resave the options files
+        bool needs_resave;
+
+        if (!Config::load_file("micropolis.options", config, needs_resave) ||
+            !CLConfig::load_file("cl.options", cl_config, needs_resave) ||
+            !GLConfig::load_file("gl.options", gl_config, needs_resave) ||
+            !ReyesConfig::load_file("reyes.options", reyes_config, needs_resave)) {
+            cout << "Failed to load options files" << endl;
+            return false;
+        }
+
+        config.parse_args(argc, argv);
+        cl_config.parse_args(argc, argv);
+        gl_config.parse_args(argc, argv);
+        reyes_config.parse_args(argc, argv);
+
+        return true;
+    }
+
+
+    int run()
+    {
+        if (reyes_config.renderer_type() != ReyesConfig::OPENCL) {
+            cerr << "Golden image tests are only supported by the OpenCL renderer." << endl;
+            return 1;
+        }
+
+        config.set_headless(true);
+        config.set_frame_output("");
+        reyes_config.set_dummy_render(false);
+
+        vector<string> files = expand_patterns(config.golden_scenes());
+
+        if (files.empty()) {
+            cerr << "No scenes match \"" << config.golden_scenes() << "\"." << endl;
+            return 1;
+        }
+
+        if (config.golden_update()) {
+            mkdir(config.golden_reference_dir().c_str(), 0755);
+        }
+
+        ImageWriter writer(2);
+
+        std::ofstream report(config.golden_report().c_str());
+        report << "scene,ms_per_frame,psnr,max_error,passed" << endl;
+
+        const int frames = std::max(config.golden_frames(), 2);
+        int failures = 0;
+
+        for (const string& file : files) {
+            string name = scene_name(file);
+            string reference_file = config.golden_reference_dir() + "/" + name + ".ppm";
+
+            // Fresh renderer per scene, patch handles of freed scenes may be reused
+            Reyes::Scene scene(file);
+            Reyes::RendererCL renderer;
+
+            float ms_per_frame = 0;
+            for (int i = 0; i < frames; ++i) {
+                scene.draw(renderer);
+
+                if (i > 0) {
+                    ms_per_frame += statistics.ms_per_render_pass / (frames - 1);
+                }
+            }
+
+            vector<vec4> pixels;
+            renderer.read_framebuffer(pixels);
+
+            ivec2 size = renderer.framebuffer_size();
+
+            if (config.golden_update()) {
+                writer.write(reference_file, size, std::move(pixels));
+
+                cout << format("%1$-24s %2$8.2f ms   reference updated") % name % ms_per_frame << endl;
+                report << name << "," << ms_per_frame << ",,," << endl;
+                continue;
+            }
+
+            ivec2 reference_size;
+            vector<unsigned char> reference;
+
+            if (!read_ppm(reference_file, reference_size, reference) || reference_size != size) {
+                cout << format("%1$-24s %2$8.2f ms   FAILED: no reference \"%3%\" of matching size")
+                    % name % ms_per_frame % reference_file << endl;
+                report << name << "," << ms_per_frame << ",,,0" << endl;
+                ++failures;
+                continue;
+            }
+
+            Comparison result = compare(pixels, reference);
+            bool passed = result.psnr >= config.golden_min_psnr() && result.max_error <= config.golden_max_error();
+
+            cout << format("%1$-24s %2$8.2f ms   PSNR %3$6.2f dB   max error %4$3d   %5%")
+                % name % ms_per_frame % result.psnr % result.max_error % (passed ? "passed" : "FAILED") << endl;
+            report << name << "," << ms_per_frame << "," << result.psnr << "," << result.max_error << ","
+                   << passed << endl;
+
+            if (!passed) {
+                writer.write(config.golden_reference_dir() + "/" + name + ".fail.ppm", size, std::move(pixels));
+                ++failures;
+            }
+        }
+
+        if (failures > 0) {
+            cout << endl << failures << " of " << files.size() << " scenes failed." << endl;
+            return 1;
+        }
+
+        return 0;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    if (!load_options(argc, argv)) {
+        return 1;
+    }
+
+    try {
+        return run();
+    } catch (CL::Exception& e) {
+        cerr << e.file() << ":" << e.line_no() << ": error: " <<  e.msg() << endl;
+        return 1;
+    } catch (std::runtime_error& e) {
+        cerr << "error: " << e.what() << endl;
+        return 1;
+    }
+}
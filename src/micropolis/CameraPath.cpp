@@ -0,0 +1,92 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#include "CameraPath.h"
+
+#include "Scene.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+
+Reyes::CameraPath::CameraPath(const string& filename, const Scene& scene)
+{
+    if (filename == "scene") {
+        for (size_t i = 0; i < scene.camera_count(); ++i) {
+            _keyframes.push_back(scene.camera(i).transform);
+        }
+    } else {
+        std::ifstream fs(filename.c_str());
+
+        if (!fs) {
+            throw std::runtime_error("Failed to open camera path '" + filename + "'");
+        }
+
+        // Values may span several lines, only the total count matters
+        vector<float> values;
+        string line;
+        while (std::getline(fs, line)) {
+            std::istringstream ls(line.substr(0, line.find('#')));
+
+            float v;
+            while (ls >> v) {
+                values.push_back(v);
+            }
+        }
+
+        if (values.size() % 16 != 0) {
+            throw std::runtime_error("Camera path '" + filename + "' does not contain whole 4x4 matrices");
+        }
+
+        for (size_t i = 0; i < values.size(); i += 16) {
+            mat4 m;
+            for (int c = 0; c < 4; ++c) {
+                for (int r = 0; r < 4; ++r) {
+                    m[c][r] = values[i + c*4 + r];
+                }
+            }
+
+            _keyframes.push_back(m);
+        }
+    }
+
+    if (_keyframes.empty()) {
+        throw std::runtime_error("Camera path '" + filename + "' is empty");
+    }
+}
+
+
+mat4 Reyes::CameraPath::transform(size_t frame_no, size_t frame_count) const
+{
+    if (_keyframes.size() == 1 || frame_count < 2) {
+        return _keyframes.front();
+    }
+
+    float t = (float)frame_no / (frame_count - 1) * (_keyframes.size() - 1);
+    size_t key = std::min<size_t>((size_t)t, _keyframes.size() - 2);
+    float f = t - key;
+
+    const mat4& a = _keyframes[key];
+    const mat4& b = _keyframes[key + 1];
+
+    mat4 m = glm::mat4_cast(glm::slerp(glm::quat_cast(a), glm::quat_cast(b), f));
+    m[3] = glm::mix(a[3], b[3], f);
+
+    return m;
+}
@@ -0,0 +1,56 @@
+/******************************************************************************\
+ * This file is part of Micropolis.                                           *
+ *                                                                            *
+ * Micropolis is free software: you can redistribute it and/or modify         *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation, either version 3 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Micropolis is distributed in the hope that it will be useful,              *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Micropolis.  If not, see <http://www.gnu.org/licenses/>.        *
+\******************************************************************************/
+
+
+#ifndef CAMERAPATH_H
+#define CAMERAPATH_H
+
+#include "common.h"
+
+namespace Reyes
+{
+    class Scene;
+
+    /**
+     * Keyframed camera transforms for deterministic playback. Positions are
+     * interpolated linearly and orientations spherically between
+     * consecutive keyframes.
+     */
+    class CameraPath
+    {
+        vector<mat4> _keyframes;
+
+    public:
+
+        /**
+         * Load keyframes from a text file with 16 floats per camera
+         * transform, column-major, '#' starts a comment. The filename
+         * "scene" uses the cameras stored in the scene instead.
+         */
+        CameraPath(const string& filename, const Scene& scene);
+
+        size_t keyframe_count() const { return _keyframes.size(); }
+
+        /**
+         * Camera transform for frame frame_no of a playback spanning
+         * frame_count frames from the first to the last keyframe.
+         */
+        mat4 transform(size_t frame_no, size_t frame_count) const;
+    };
+}
+
+#endif
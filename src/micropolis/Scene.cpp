@@ -28,7 +28,13 @@
 #include "ReyesConfig.h"
 #include "Statistics.h"
 
+#include <algorithm>
+#include <cstdio>
 #include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include "mscene.capnp.h"
 #include "capnp/message.h"
@@ -37,6 +43,56 @@
 
 namespace {
 
+    // Unpacked scene files start with this header, followed by the control
+    // points of all meshes and the unpacked message describing the scene.
+    struct UnpackedSceneHeader
+    {
+        char magic[8]           = {'M','S','C','E','N','E','U','P'};
+        uint32_t version        = 1;
+        uint32_t reserved       = 0;
+        uint64_t message_offset = 0;
+        uint64_t message_size   = 0;
+    };
+
+    const uint32_t UNPACKED_SCENE_VERSION = 1;
+    const size_t UNPACKED_SCENE_ALIGNMENT = 16;
+
+
+    bool is_unpacked_scene(const string& filename)
+    {
+        UnpackedSceneHeader expected, header;
+
+        std::ifstream file(filename.c_str(), std::ios::binary);
+        file.read((char*)&header, sizeof(header));
+
+        return file && std::equal(expected.magic, expected.magic + 8, header.magic);
+    }
+
+
+    // Pads the file to the next multiple of alignment, returns the new position
+    size_t write_padding(std::ofstream& file, size_t alignment)
+    {
+        size_t pos = file.tellp();
+
+        while (pos % alignment != 0) {
+            file.put(0);
+            ++pos;
+        }
+
+        return pos;
+    }
+
+
+    capnp::ReaderOptions reader_options()
+    {
+        capnp::ReaderOptions options;
+        options.traversalLimitInWords = 256LL*1024LL*1024LL;
+        options.nestingLimit =  64;
+
+        return options;
+    }
+    
+
     vec3 to_vec3(const ::Vec3::Reader& vec)
     {
         return vec3(vec.getX(), vec.getY(), vec.getZ());
@@ -87,18 +143,82 @@ namespace {
 }
 
 Reyes::Scene::Scene (const string& filename) :
-    active_cam_id(0)
+    active_cam_id(0),
+    mapping(nullptr),
+    mapping_size(0)
+{
+    if (is_unpacked_scene(filename)) {
+        load_unpacked(filename);
+    } else {
+        load_packed(filename);
+    }
+
+    size_t patch_count = total_patch_count();
+    statistics.set_total_input_patches(patch_count);
+
+    if (config.verbosity_level() > 0) {
+        cout << "Scene \"" << filename << "\" contains " << patch_count << " patches." << endl;
+    }
+}
+
+Reyes::Scene::~Scene()
+{
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+
+void Reyes::Scene::load_packed(const string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+
+    capnp::PackedFdMessageReader message(fd, reader_options());
+
+    read_scene(message.getRoot<::Scene>());
+
+    close(fd);
+}
+
+
+void Reyes::Scene::load_unpacked(const string& filename)
 {
     int fd = open(filename.c_str(), O_RDONLY);
 
-    capnp::ReaderOptions reader_options;
-    reader_options.traversalLimitInWords = 256LL*1024LL*1024LL;
-    reader_options.nestingLimit =  64;
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+
+    mapping_size = file_stat.st_size;
+    mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
 
-    capnp::PackedFdMessageReader message(fd, reader_options);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        throw std::runtime_error("Failed to map scene file '" + filename + "'");
+    }
+
+    const UnpackedSceneHeader* header = (const UnpackedSceneHeader*)mapping;
+
+    if (header->version != UNPACKED_SCENE_VERSION ||
+        header->message_offset % sizeof(capnp::word) != 0 ||
+        header->message_offset > mapping_size ||
+        header->message_size > mapping_size - header->message_offset) {
+        throw std::runtime_error("Unsupported or truncated scene file '" + filename + "'");
+    }
 
-    ::Scene::Reader scene = message.getRoot<::Scene>();
+    kj::ArrayPtr<const capnp::word> words((const capnp::word*)((const char*)mapping + header->message_offset),
+                                          header->message_size / sizeof(capnp::word));
 
+    capnp::FlatArrayMessageReader message(words, reader_options());
+
+    read_scene(message.getRoot<::Scene>());
+}
+
+
+template<typename SceneReader>
+void Reyes::Scene::read_scene(const SceneReader& scene)
+{
     for (auto c : scene.getCameras()) {
         Camera* camera =
             new Camera{c.getName(),
@@ -110,14 +230,21 @@ Reyes::Scene::Scene (const string& filename) :
     }
 
     for (auto l : scene.getLights()) {
-        //assert(l.getType() == ::LightSource::Type::DIRECTIONAL);
+        Light::Type light_type = Light::DIRECTIONAL;
+        switch (l.getType()) {
+        case ::LightSource::Type::POINT:       light_type = Light::POINT;       break;
+        case ::LightSource::Type::DIRECTIONAL: light_type = Light::DIRECTIONAL; break;
+        case ::LightSource::Type::HEMI:        light_type = Light::HEMI;        break;
+        }
 
-        DirectionalLight* light =
-            new DirectionalLight{l.getName(),
-                                 vec3(vec4(0,0,1,1) * to_matrix(l.getTransform())),
-                                 to_vec3(l.getColor()) * l.getIntensity()};
+        SceneLight* light =
+            new SceneLight{l.getName(),
+                           light_type,
+                           to_matrix(l.getTransform()),
+                           to_vec3(l.getColor()),
+                           l.getIntensity()};
 
-        lights.push_back(shared_ptr<DirectionalLight>(light));
+        lights.push_back(shared_ptr<SceneLight>(light));
     }
 
     map<string, shared_ptr<Mesh> > meshmap;
@@ -133,18 +260,36 @@ Reyes::Scene::Scene (const string& filename) :
             break;
         }
 
-        Mesh* mesh = new Mesh{m.getName(), {}, mesh_type};
+        bool mapped = mapping && m.getPointCount() > 0;
 
-        int i = 0;
-        vec3 v;
-        for (float f : m.getPositions()) {
-            v[i%3] = f;
+        if (mapped) {
+            uint64_t offset = m.getPointOffset();
+            uint64_t count = m.getPointCount();
 
-            if (i%3 == 2) {
-                mesh->patch_data.push_back(v);
+            if (offset % UNPACKED_SCENE_ALIGNMENT != 0 || offset > mapping_size ||
+                count > (mapping_size - offset) / sizeof(vec4)) {
+                throw std::runtime_error("Control points of mesh '" + string(m.getName().cStr()) +
+                                         "' lie outside of the scene file");
             }
+        }
 
-            ++i;
+        Mesh* mesh = new Mesh{m.getName(), {}, mesh_type};
+
+        if (mapped) {
+            mesh->mapped_data = (const vec4*)((const char*)mapping + m.getPointOffset());
+            mesh->mapped_count = m.getPointCount();
+        } else {
+            int i = 0;
+            vec3 v;
+            for (float f : m.getPositions()) {
+                v[i%3] = f;
+
+                if (i%3 == 2) {
+                    mesh->patch_data.push_back(v);
+                }
+
+                ++i;
+            }
         }
 
         meshes.push_back(shared_ptr<Mesh>(mesh));
@@ -159,37 +304,58 @@ Reyes::Scene::Scene (const string& filename) :
                                     vec4(to_vec3(o.getColor()),1),
                                     mesh};
 
-        objects.push_back(shared_ptr<Object>(object));
-    }
-
-    close(fd);
-
-    size_t patch_count = total_patch_count();
-    statistics.set_total_input_patches(patch_count);
+        for (auto instance : o.getInstances()) {
+            object->instances.push_back(to_matrix(instance));
+        }
 
-    if (config.verbosity_level() > 0) {
-        cout << "Scene \"" << filename << "\" contains " << patch_count << " patches." << endl;
+        objects.push_back(shared_ptr<Object>(object));
     }
 }
 
-Reyes::Scene::~Scene()
-{
-}
 
 void Reyes::Scene::draw(Renderer& renderer) const
 {
     renderer.prepare();
 
+    mat4 view = glm::inverse(active_cam().transform);
+
+    view_lights.clear();
+    for (auto light : lights) {
+        mat4 m = view * light->transform;
+
+        view_lights.push_back(Light{light->type,
+                                    vec3(m[3]),
+                                    glm::normalize(vec3(m * vec4(0,0,1,0))),
+                                    light->color * light->intensity});
+    }
+
+    renderer.set_lights(view_lights);
+
     for (auto object : objects) {
 
         // Load patch data on demand
         if (!renderer.are_patches_loaded(object->mesh.get())) {
-            renderer.load_patches(object->mesh.get(), object->mesh->patch_data, object->mesh->type);
+            if (object->mesh->mapped_data) {
+                renderer.load_patches(object->mesh.get(), object->mesh->mapped_data, object->mesh->mapped_count,
+                                      object->mesh->type);
+            } else {
+                renderer.load_patches(object->mesh.get(), object->mesh->patch_data, object->mesh->type);
+            }
         }
 
-        mat4 matrix(glm::inverse(active_cam().transform) * object->transform);
+        mat4 matrix(view * object->transform);
 
-        renderer.draw_patches(object->mesh.get(), matrix, active_cam().projection.get(), object->color);
+        if (object->instances.empty()) {
+            renderer.draw_patches(object->mesh.get(), matrix, active_cam().projection.get(), object->color);
+        } else {
+            instance_matrices.clear();
+            for (const mat4& instance : object->instances) {
+                instance_matrices.push_back(matrix * instance);
+            }
+
+            renderer.draw_instances(object->mesh.get(), instance_matrices, active_cam().projection.get(),
+                                    object->color);
+        }
 
     }
 
@@ -213,10 +379,82 @@ void Reyes::Scene::save(const string& base_filename, bool overwrite) const
 
     cout << "Saving to file '" << filename << "'" << endl;
 
+    // Keep the format the scene was loaded in
+    if (mapping) {
+        save_unpacked(filename);
+        return;
+    }
+
     ::capnp::MallocMessageBuilder message;
 
     ::Scene::Builder scene = message.initRoot<::Scene>();
+    write_scene(scene, true);
+
+    int fd = creat(filename.c_str(), 0664);
+
+    writePackedMessageToFd(fd, message);
 
+    close(fd);
+
+}
+
+
+void Reyes::Scene::save_unpacked(const string& filename) const
+{
+    ::capnp::MallocMessageBuilder message;
+
+    ::Scene::Builder scene = message.initRoot<::Scene>();
+    write_scene(scene, false);
+
+    // Write to a new file and move it over the target, the target may
+    // still be mapped by this scene.
+    string tmp_filename = filename + ".tmp";
+    std::ofstream file(tmp_filename.c_str(), std::ios::binary);
+
+    UnpackedSceneHeader header;
+    file.write((const char*)&header, sizeof(header));
+
+    ::capnp::List<::Mesh>::Builder _meshes = scene.getMeshes();
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        auto mesh = meshes[i];
+
+        size_t offset = write_padding(file, UNPACKED_SCENE_ALIGNMENT);
+        size_t count = mesh->point_count();
+
+        if (mesh->mapped_data) {
+            file.write((const char*)mesh->mapped_data, count * sizeof(vec4));
+        } else {
+            for (auto p : mesh->patch_data) {
+                vec4 cp(p, 1);
+                file.write((const char*)&cp, sizeof(cp));
+            }
+        }
+
+        _meshes[i].setPointOffset(offset);
+        _meshes[i].setPointCount(count);
+    }
+
+    kj::Array<capnp::word> words = capnp::messageToFlatArray(message);
+    kj::ArrayPtr<kj::byte> bytes = words.asBytes();
+
+    header.message_offset = write_padding(file, UNPACKED_SCENE_ALIGNMENT);
+    header.message_size = bytes.size();
+
+    file.write((const char*)bytes.begin(), bytes.size());
+
+    file.seekp(0);
+    file.write((const char*)&header, sizeof(header));
+    file.close();
+
+    if (!file || std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        cerr << "Failed to write scene file '" << filename << "'" << endl;
+    }
+}
+
+
+template<typename SceneBuilder>
+void Reyes::Scene::write_scene(SceneBuilder& scene, bool with_positions) const
+{
     ::capnp::List<::Camera>::Builder _cameras = scene.initCameras(cameras.size());
     for (size_t i = 0; i < cameras.size(); ++i) {
         auto cam = cameras[i];
@@ -236,13 +474,18 @@ void Reyes::Scene::save(const string& base_filename, bool overwrite) const
 
         _lights[i].setName(light->name);
         ::Transform::Builder transform = _lights[i].initTransform();
-        from_matrix(mat4(), transform); // TODO: implement properly
+        from_matrix(light->transform, transform);
 
         ::Vec3::Builder color = _lights[i].initColor();
         from_vec3(light->color, color);
 
-        _lights[i].setIntensity(1.0f);
-        _lights[i].setType(::LightSource::Type::DIRECTIONAL);
+        _lights[i].setIntensity(light->intensity);
+
+        switch (light->type) {
+        case Light::POINT:       _lights[i].setType(::LightSource::Type::POINT);       break;
+        case Light::DIRECTIONAL: _lights[i].setType(::LightSource::Type::DIRECTIONAL); break;
+        case Light::HEMI:        _lights[i].setType(::LightSource::Type::HEMI);        break;
+        }
     }
 
     ::capnp::List<::Object>::Builder _objects = scene.initObjects(objects.size());
@@ -258,6 +501,14 @@ void Reyes::Scene::save(const string& base_filename, bool overwrite) const
         from_vec3(vec3(object->color), color);
 
         _objects[i].setMeshname(object->mesh->name);
+
+        if (!object->instances.empty()) {
+            ::capnp::List<::Transform>::Builder _instances = _objects[i].initInstances(object->instances.size());
+            for (size_t j = 0; j < object->instances.size(); ++j) {
+                ::Transform::Builder instance = _instances[j];
+                from_matrix(object->instances[j], instance);
+            }
+        }
     }
 
     ::capnp::List<::Mesh>::Builder _meshes = scene.initMeshes(meshes.size());
@@ -275,22 +526,20 @@ void Reyes::Scene::save(const string& base_filename, bool overwrite) const
             break;
         }
 
-        size_t fcount = mesh->patch_data.size() * 3;
-        float* meshdata = (float*)mesh->patch_data.data();
+        if (!with_positions) continue;
 
-        ::capnp::List<float>::Builder _data = _meshes[i].initPositions(fcount);
+        size_t count = mesh->point_count();
 
-        for (size_t i = 0; i < fcount; ++i) {
-            _data.set(i, meshdata[i]);
-        }
-    }
-
-    int fd = creat(filename.c_str(), 0664);
-
-    writePackedMessageToFd(fd, message);
+        ::capnp::List<float>::Builder _data = _meshes[i].initPositions(count * 3);
 
-    close(fd);
+        for (size_t j = 0; j < count; ++j) {
+            vec3 p = mesh->point(j);
 
+            _data.set(j*3 + 0, p.x);
+            _data.set(j*3 + 1, p.y);
+            _data.set(j*3 + 2, p.z);
+        }
+    }
 }
 
 
@@ -303,10 +552,10 @@ size_t Reyes::Scene::total_patch_count() const
 
         switch(mesh->type) {
         case BEZIER:
-            count += mesh->patch_data.size() / 16;
+            count += mesh->point_count() / 16 * object->instance_count();
             break;
         case GREGORY:
-            count += mesh->patch_data.size() / 20;
+            count += mesh->point_count() / 20 * object->instance_count();
             break;
         }
     }
@@ -22,6 +22,7 @@
 #include "common.h"
 
 #include "Patch.h"
+#include "Reyes/Light.h"
 #include "Reyes/PatchType.h"
 
 namespace Reyes
@@ -30,11 +31,15 @@ namespace Reyes
     class Renderer;
 
     
-    struct DirectionalLight
+    struct SceneLight
     {
         string name;
-        vec3 dir;
+        Light::Type type;
+
+        // Lights shine along their local -Z axis
+        mat4 transform;
         vec3 color;
+        float intensity;
     };
 
 
@@ -43,6 +48,14 @@ namespace Reyes
         string name;
         vector<vec3> patch_data;
         Reyes::PatchType type;
+
+        // Control points of meshes mapped from an unpacked scene file, already
+        // laid out like the OpenCL patch buffer. patch_data is empty then.
+        const vec4* mapped_data = nullptr;
+        size_t mapped_count = 0;
+
+        size_t point_count() const { return mapped_data ? mapped_count : patch_data.size(); }
+        vec3 point(size_t i) const { return mapped_data ? vec3(mapped_data[i]) : patch_data[i]; }
     };
 
 
@@ -52,6 +65,11 @@ namespace Reyes
         mat4 transform;
         vec4 color;
         shared_ptr<Mesh> mesh;
+
+        // Relative to transform, empty for a single instance
+        vector<mat4> instances;
+
+        size_t instance_count() const { return std::max<size_t>(instances.size(), 1); }
     };
 
 
@@ -66,11 +84,21 @@ namespace Reyes
     class Scene
     {
         shared_vector<Camera> cameras;
-        shared_vector<DirectionalLight> lights;
+        shared_vector<SceneLight> lights;
         shared_vector<Object> objects;
         shared_vector<Mesh> meshes;
 
         size_t active_cam_id;
+
+        // Modelview matrices of the instances of the object drawn last
+        mutable vector<mat4> instance_matrices;
+
+        // Lights of the last frame in view space
+        mutable vector<Light> view_lights;
+
+        // Unpacked scene file, meshes point into it
+        void* mapping;
+        size_t mapping_size;
         
         public:
 
@@ -80,11 +108,25 @@ namespace Reyes
         const Camera& active_cam() const { return *cameras[active_cam_id]; }
         Camera& active_cam() { return *cameras[active_cam_id]; }
 
+        size_t camera_count() const { return cameras.size(); }
+        const Camera& camera(size_t i) const { return *cameras[i]; }
+
         void draw(Renderer& renderer) const;
 
         void save(const string& filename, bool overwrite=false) const;
 
+        // Writes the scene in the unpacked, memory-mappable format
+        void save_unpacked(const string& filename) const;
+
         size_t total_patch_count() const;
+
+        private:
+
+        void load_packed(const string& filename);
+        void load_unpacked(const string& filename);
+
+        template<typename SceneReader> void read_scene(const SceneReader& scene);
+        template<typename SceneBuilder> void write_scene(SceneBuilder& scene, bool with_positions) const;
         
     };
 }
@@ -30,12 +30,16 @@
 #include "Reyes/Reyes.h"
 #include "Statistics.h"
 #include "Scene.h"
+#include "CameraPath.h"
 
 #include <boost/format.hpp>
 #include <algorithm>
+#include <fstream>
 #include <random>
+#include <stdexcept>
 
 void mainloop(GLFWwindow* window);
+void headless_loop();
 bool test_GL_prefix_sum(const int N, bool print);
 bool test_CL_prefix_sum(const int N, bool print);
 bool test_CL_histogram_pyramid(const int N, bool print);
@@ -56,6 +60,32 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    // Convert scene without opening a window
+    if (!config.convert_scene().empty()) {
+        try {
+            Reyes::Scene scene(reyes_config.input_file());
+            scene.save_unpacked(config.convert_scene());
+        } catch (std::runtime_error& e) {
+            cerr << "error: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (config.headless()) {
+        try {
+            headless_loop();
+        } catch (CL::Exception& e) {
+            cerr << e.file() << ":" << e.line_no() << ": error: " <<  e.msg() << endl;
+            return 1;
+        } catch (std::runtime_error& e) {
+            cerr << "error: " << e.what() << endl;
+            return 1;
+        }
+
+        return 0;
+    }
+
     ivec2 size = reyes_config.window_size();
 
 
@@ -81,6 +111,9 @@ int main(int argc, char** argv)
     } catch (CL::Exception& e) {
         cerr << e.file() << ":" << e.line_no() << ": error: " <<  e.msg() << endl;
         return 1;
+    } catch (std::runtime_error& e) {
+        cerr << "error: " << e.what() << endl;
+        return 1;
     }
 
     return 0;
@@ -97,6 +130,9 @@ void mainloop(GLFWwindow* window)
     case ReyesConfig::OPENCL:
         renderer.reset(new Reyes::RendererCL());
         break;
+    case ReyesConfig::NATIVE:
+        renderer.reset(new Reyes::RendererCPU());
+        break;
     // case ReyesConfig::GLTESS:
     //     renderer.reset(new Reyes::RendererGLHWTess());
     //     break;
@@ -118,8 +154,17 @@ void mainloop(GLFWwindow* window)
     Keyboard keys(window);
 
     // Apply configured camera offset
-    scene.active_cam().transform = scene.active_cam().transform
-        * glm::translate<float>(glm::mat4(1.0f), glm::vec3(config.camera_x_offset(), config.camera_y_offset(), config.camera_z_offset()));
+    mat4 camera_offset = glm::translate<float>(glm::mat4(1.0f), glm::vec3(config.camera_x_offset(), config.camera_y_offset(), config.camera_z_offset()));
+    scene.active_cam().transform = scene.active_cam().transform * camera_offset;
+
+    scoped_ptr<Reyes::CameraPath> camera_path;
+    std::ofstream benchmark;
+
+    if (!config.camera_path().empty()) {
+        camera_path.reset(new Reyes::CameraPath(config.camera_path(), scene));
+        benchmark.open(config.benchmark_file().c_str());
+        statistics.dump_frame_header(benchmark);
+    }
 
     // for (auto N : {1,2, 20, 100,
     //             128, 200, 512, 800, 1000,
@@ -243,6 +288,10 @@ void mainloop(GLFWwindow* window)
             statistics.dump_stats();
         }
 
+        if (camera_path) {
+            scene.active_cam().transform = camera_path->transform(frame_no, config.camera_path_frames()) * camera_offset;
+        }
+
         // Render scene
         statistics.start_render();
         if (in_wire_mode) {
@@ -254,6 +303,11 @@ void mainloop(GLFWwindow* window)
         glfwSwapBuffers(window);
         statistics.end_render();
 
+        if (camera_path) {
+            statistics.dump_frame(benchmark, frame_no);
+            running = running && frame_no + 1 < config.camera_path_frames();
+        }
+
         statistics.update();
 
         // Check if the window has been closed
@@ -274,6 +328,73 @@ void mainloop(GLFWwindow* window)
 
 
 
+/**
+ * Render loop without OpenGL, keyboard or window. Runs for frame_count
+ * frames or until dump mode is done.
+ */
+void headless_loop()
+{
+    if (reyes_config.renderer_type() != ReyesConfig::OPENCL) {
+        cerr << "Headless mode is only supported by the OpenCL renderer." << endl;
+        return;
+    }
+
+    Reyes::Scene scene(reyes_config.input_file());
+    Reyes::RendererCL renderer;
+
+    statistics.reset_timer();
+
+    // Apply configured camera offset
+    mat4 camera_offset = glm::translate<float>(glm::mat4(1.0f), glm::vec3(config.camera_x_offset(), config.camera_y_offset(), config.camera_z_offset()));
+    scene.active_cam().transform = scene.active_cam().transform * camera_offset;
+
+    string trace_file = cl_config.trace_file();
+    string statistics_file = config.statistics_file();
+
+    long long frame_count = config.frame_count();
+    if (config.dump_mode()) {
+        frame_count = config.dump_after() + config.dump_count();
+    }
+
+    scoped_ptr<Reyes::CameraPath> camera_path;
+    std::ofstream benchmark;
+
+    if (!config.camera_path().empty()) {
+        camera_path.reset(new Reyes::CameraPath(config.camera_path(), scene));
+        benchmark.open(config.benchmark_file().c_str());
+        statistics.dump_frame_header(benchmark);
+
+        frame_count = config.camera_path_frames();
+    }
+
+    for (long long frame_no = 0; frame_no < frame_count; ++frame_no) {
+
+        if (config.dump_mode() && frame_no >= config.dump_after()) {
+            int dump_id = frame_no - config.dump_after();
+
+            cl_config.set_trace_file(trace_file + lexical_cast<string>(dump_id));
+            config.set_statistics_file(statistics_file + lexical_cast<string>(dump_id));
+
+            renderer.dump_trace();
+            statistics.dump_stats();
+        }
+
+        if (camera_path) {
+            scene.active_cam().transform = camera_path->transform(frame_no, frame_count) * camera_offset;
+        }
+
+        statistics.start_render();
+        scene.draw(renderer);
+        statistics.end_render();
+
+        if (camera_path) {
+            statistics.dump_frame(benchmark, frame_no);
+        }
+
+        statistics.update();
+    }
+}
+
 
 bool test_GL_prefix_sum(const int N, bool print)
 {
@@ -0,0 +1,137 @@
+import sys
+
+from mathutils import *
+
+import capnp
+mscene = capnp.load('src/micropolis/mscene.capnp')
+
+
+# Writes testscene/depth_tiles.mscene, drawn in object order:
+#
+#   Near    left half of the screen, in front
+#   Far     right half, in the back, leaving a gap of a few pixels to Near
+#           inside the same column of 8x8 tiles
+#   Middle  whole screen, between the two
+#
+# Far only touches part of the tiles along the gap. Rendered with
+# tiled_depth, their depth range has to keep covering Near's pixels or
+# Middle shows through Near along the gap.
+
+
+def lookat(eye, at, up):
+    e,l,U = (Vector(v) for v in (eye,at,up))
+
+    f = (l-e).normalized()
+    u_ = U.normalized()
+
+    s = f.cross(u_)
+    u = s.cross(f)
+
+    M = Matrix(((s.x,s.y,s.z,0), (u.x,u.y,u.z,0), (-f.x,-f.y,-f.z,0), (0,0,0,1)))
+    T = Matrix(((1,0,0,-e.x), (0,1,0,-e.y), (0,0,1,-e.z), (0,0,0,1)))
+
+    L = M * T
+    return L.inverted()
+
+
+def set_vec3(vec3, v):
+    v = v.to_4d()
+    vh = v.xyz / v.w
+
+    vec3.x = vh.x
+    vec3.y = vh.y
+    vec3.z = vh.z
+
+
+def set_quat(quat, q):
+    quat.r = q.w
+    quat.i = q.x
+    quat.j = q.y
+    quat.k = q.z
+
+
+def set_transform(transform, matrix):
+    set_vec3(transform.translation, matrix.to_translation())
+    set_quat(transform.rotation, matrix.to_quaternion())
+
+
+def add_camera(cameras, name, eye, at, up, near, far, fovy):
+    camera = cameras.add()
+
+    camera.name = name
+    set_transform(camera.transform, lookat(eye,at,up))
+    camera.near = near
+    camera.far = far
+    camera.fovy = fovy
+
+
+def add_directional_light(lights, name, color, intensity, direction):
+    light = lights.add()
+
+    light.name = name
+    set_transform(light.transform, lookat((0,0,0), -Vector(direction), (0,1,0)))
+    set_vec3(light.color, Vector(color))
+    light.intensity = intensity
+    light.type = 'directional'
+
+
+def add_object(objects, name, transform, meshname, color):
+    obj = objects.add()
+
+    obj.name = name
+    set_transform(obj.transform, transform)
+    obj.meshname = meshname
+    set_vec3(obj.color, Vector(color))
+
+
+def add_bezier_mesh(meshes, name, positions):
+    mesh = meshes.add()
+
+    mesh.name = name
+    mesh.type = 'bezier'
+
+    mesh.init('positions', len(positions))
+
+    for i in range(len(positions)):
+        mesh.positions[i] = positions[i]
+
+
+# Flat bicubic patch facing +z
+def quad(x0, x1, y0, y1, z):
+    positions = []
+    for j in range(4):
+        for i in range(4):
+            positions += [x0 + (x1-x0) * i / 3.0, y0 + (y1-y0) * j / 3.0, z]
+    return positions
+
+
+quads = [('Near',   (-7.0, 0.05, -6.0, 6.0,  2.0), (1.0, 0.2, 0.2)),
+         ('Far',    (0.12, 10.0, -6.0, 6.0, -2.0), (0.2, 1.0, 0.2)),
+         ('Middle', (-10.0, 10.0, -8.0, 8.0, 0.0), (0.2, 0.2, 1.0))]
+
+
+if __name__ == '__main__':
+    outfile = sys.argv[1] if len(sys.argv) > 1 else 'testscene/depth_tiles.mscene'
+
+    scene = mscene.Scene.new_message()
+
+    cameras = scene.init_resizable_list('cameras')
+    meshes = scene.init_resizable_list('meshes')
+    lights = scene.init_resizable_list('lights')
+    objects = scene.init_resizable_list('objects')
+
+    # The quads' inner edges project to x=403 and x=405 of an 800x600 frame
+    add_camera(cameras, 'Camera', (0,0,10), (0,0,0), (0,1,0), 0.01, 1000.0, 60.0)
+    add_directional_light(lights, 'Light', Color((1,1,1)), 1.0, (0,0,1))
+
+    for name, bounds, color in quads:
+        add_bezier_mesh(meshes, name, quad(*bounds))
+        add_object(objects, name, Matrix.Identity(4), name, Color(color))
+
+    cameras.finish()
+    objects.finish()
+    lights.finish()
+    meshes.finish()
+
+    with open(outfile, 'wb') as f:
+        scene.write_packed(f)